@@ -0,0 +1,75 @@
+#include "mpi.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <dlfcn.h>
+
+// Times traced malloc/free outside of MPI calls. Run with mpimcu-trace.so
+// preloaded, once with MMCU_ALLOC_HEADERS=0 (address map) and once with
+// MMCU_ALLOC_HEADERS=1 (headers).
+
+typedef void *(*get_mgr_fn_t)(void);
+typedef void (*mgr_fn_t)(void *);
+
+int
+main(int argc, char **argv)
+{
+    static const size_t n_live = 4096;
+    static const size_t n_ops = 200000;
+
+    MPI_Init(&argc, &argv);
+
+    int rank = 0;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    get_mgr_fn_t get_mgr = (get_mgr_fn_t)dlsym(
+        RTLD_DEFAULT, "mmcu_rt_get_mem_hook_mgr"
+    );
+    mgr_fn_t activate = (mgr_fn_t)dlsym(
+        RTLD_DEFAULT, "mmcu_mem_hook_mgr_activate_all"
+    );
+    mgr_fn_t deactivate = (mgr_fn_t)dlsym(
+        RTLD_DEFAULT, "mmcu_mem_hook_mgr_deactivate_all"
+    );
+    if (!get_mgr || !activate || !deactivate) {
+        if (rank == 0) {
+            fprintf(stderr, "mpimcu-trace.so is not preloaded\n");
+        }
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    void *mgr = get_mgr();
+
+    void **live = (void **)calloc(n_live, sizeof(void *));
+    uint64_t x = 0x9e3779b97f4a7c15ULL;
+
+    const double start = MPI_Wtime();
+    // Trace this rank's allocations as if they came from within MPI.
+    activate(mgr);
+    for (size_t i = 0; i < n_ops; ++i) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        const size_t slot = x % n_live;
+        free(live[slot]);
+        live[slot] = malloc(16 + (x >> 32) % 4096);
+    }
+    for (size_t i = 0; i < n_live; ++i) {
+        free(live[i]);
+        live[i] = NULL;
+    }
+    deactivate(mgr);
+    const double end = MPI_Wtime();
+
+    free(live);
+
+    if (rank == 0) {
+        printf(
+            "alloc-bench: %zu malloc/free pairs in %lf s (%lf pairs/s)\n",
+            n_ops, end - start, (double)n_ops / (end - start)
+        );
+    }
+
+    MPI_Finalize();
+    //
+    return 0;
+}
@@ -0,0 +1,98 @@
+#include "mpi.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <dlfcn.h>
+
+// Checks that traced posix_memalign keeps the requested alignment. Run with
+// mpimcu-trace.so preloaded and MMCU_ALLOC_HEADERS=1, so that allocations get
+// a header in front of them.
+
+typedef void *(*get_mgr_fn_t)(void);
+typedef void (*mgr_fn_t)(void *);
+typedef int (*is_tagged_fn_t)(void *);
+
+#define N_ALIGNMENTS 4
+#define N_SIZES 4
+
+#define CHECK(cond)                                                           \
+    do {                                                                      \
+        if (!(cond)) {                                                        \
+            fprintf(stderr, "%s:%d: check failed: %s\n",                      \
+                    __FILE__, __LINE__, #cond);                               \
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);                          \
+        }                                                                     \
+    } while (0)
+
+int
+main(int argc, char **argv)
+{
+    static const size_t alignments[N_ALIGNMENTS] = {16, 32, 64, 4096};
+    static const size_t sizes[N_SIZES] = {1, 100, 4096, 100000};
+
+    MPI_Init(&argc, &argv);
+
+    int rank = 0;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    get_mgr_fn_t get_mgr = (get_mgr_fn_t)dlsym(
+        RTLD_DEFAULT, "mmcu_rt_get_mem_hook_mgr"
+    );
+    mgr_fn_t activate = (mgr_fn_t)dlsym(
+        RTLD_DEFAULT, "mmcu_mem_hook_mgr_activate_all"
+    );
+    mgr_fn_t deactivate = (mgr_fn_t)dlsym(
+        RTLD_DEFAULT, "mmcu_mem_hook_mgr_deactivate_all"
+    );
+    is_tagged_fn_t is_tagged = (is_tagged_fn_t)dlsym(
+        RTLD_DEFAULT, "mmcu_mem_hooks_is_tagged"
+    );
+    if (!get_mgr || !activate || !deactivate || !is_tagged) {
+        if (rank == 0) {
+            fprintf(stderr, "mpimcu-trace.so is not preloaded\n");
+        }
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    void *mgr = get_mgr();
+    const char *headers = getenv("MMCU_ALLOC_HEADERS");
+    const int header_mode = headers && strcmp(headers, "0") != 0;
+
+    void *ptrs[N_ALIGNMENTS][N_SIZES];
+    int tagged[N_ALIGNMENTS][N_SIZES];
+    // Trace this rank's allocations as if they came from within MPI.
+    activate(mgr);
+    for (size_t i = 0; i < N_ALIGNMENTS; ++i) {
+        for (size_t j = 0; j < N_SIZES; ++j) {
+            ptrs[i][j] = NULL;
+            const int rc = posix_memalign(
+                &ptrs[i][j], alignments[i], sizes[j]
+            );
+            tagged[i][j] = rc == 0 ? is_tagged(ptrs[i][j]) : 0;
+            if (rc == 0) memset(ptrs[i][j], 0xa5, sizes[j]);
+        }
+    }
+    deactivate(mgr);
+
+    for (size_t i = 0; i < N_ALIGNMENTS; ++i) {
+        for (size_t j = 0; j < N_SIZES; ++j) {
+            CHECK(ptrs[i][j] != NULL);
+            CHECK((uintptr_t)ptrs[i][j] % alignments[i] == 0);
+            if (header_mode) CHECK(tagged[i][j]);
+        }
+    }
+
+    activate(mgr);
+    for (size_t i = 0; i < N_ALIGNMENTS; ++i) {
+        for (size_t j = 0; j < N_SIZES; ++j) {
+            free(ptrs[i][j]);
+        }
+    }
+    deactivate(mgr);
+
+    if (rank == 0) printf("# OK\n");
+
+    MPI_Finalize();
+    //
+    return 0;
+}
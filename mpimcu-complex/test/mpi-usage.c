@@ -0,0 +1,124 @@
+#include "mpi.h"
+#include "mpimcu.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+/*
+ * Exercises the application API. Links against the stubs, so it also runs
+ * without the tool.
+ */
+
+#define CHECK(cond)                                                           \
+    do {                                                                      \
+        if (!(cond)) {                                                        \
+            fprintf(stderr, "%s:%d: check failed: %s\n",                      \
+                    __FILE__, __LINE__, #cond);                               \
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);                          \
+        }                                                                     \
+    } while (0)
+
+/*
+ * Returns the index of MPI_Comm_split in mmcu_usage_t::mpi_call_b.
+ */
+static uint32_t
+get_comm_split_index(const mmcu_usage_t *u)
+{
+    for (uint32_t i = 0; i < u->n_mpi_calls; ++i) {
+        if (0 == strcmp(mmcu_usage_mpi_call_name(i), "MPI_Comm_split")) {
+            return i;
+        }
+    }
+    CHECK(0 && "MPI_Comm_split not found");
+    return 0;
+}
+
+/*
+ * Checks what must hold for any usage snapshot.
+ */
+static void
+check_usage(const mmcu_usage_t *u)
+{
+    CHECK(u->version == MMCU_USAGE_VERSION);
+    CHECK(u->n_mpi_calls > 0);
+    CHECK(u->n_mpi_calls <= MMCU_USAGE_MAX_MPI_CALLS);
+    CHECK(u->time > 0.0);
+    CHECK(u->mpi_b <= u->mpi_high_b);
+    CHECK(u->pss_b <= u->pss_high_b);
+    CHECK(u->n_frees <= u->n_allocs);
+}
+
+int
+main(int argc, char **argv)
+{
+    MPI_Init(&argc, &argv);
+
+    int rank = 0;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    mmcu_usage_t before, after, freed, diff;
+    if (mmcu_usage_get(&before) != 0) {
+        if (rank == 0) printf("# mpimcu-trace.so not loaded\n");
+        MPI_Finalize();
+        return 0;
+    }
+    check_usage(&before);
+
+    mmcu_phase_push("dup");
+    static const int n_comms = 16;
+    MPI_Comm comms[16];
+    for (int i = 0; i < n_comms; ++i) {
+        MPI_Comm_split(MPI_COMM_WORLD, i % 2, rank, &comms[i]);
+    }
+    mmcu_phase_pop();
+
+    CHECK(mmcu_usage_get(&after) == 0);
+    check_usage(&after);
+    mmcu_usage_diff(&after, &before, &diff);
+    // Creating communicators allocates, and nothing is counted backwards.
+    CHECK(diff.time > 0.0);
+    CHECK(diff.n_allocs > 0);
+    CHECK(diff.n_frees >= 0);
+    CHECK(diff.mpi_high_b >= 0);
+    CHECK(diff.pss_high_b >= 0);
+
+    // The new communicators are held by what MPI_Comm_split allocated.
+    const uint32_t split = get_comm_split_index(&after);
+    CHECK(diff.mpi_call_b[split] > 0);
+
+    if (rank == 0) {
+        for (uint32_t i = 0; i < diff.n_mpi_calls; ++i) {
+            if (diff.mpi_call_b[i] == 0) continue;
+            printf(
+                "# %s: %" PRId64 " B\n",
+                mmcu_usage_mpi_call_name(i), diff.mpi_call_b[i]
+            );
+        }
+        printf(
+            "# MPI: %" PRId64 " B (high: %" PRId64 " B, delta: %" PRId64
+            " B), PSS: %" PRId64 " B\n",
+            after.mpi_b, after.mpi_high_b, diff.mpi_b, after.pss_b
+        );
+    }
+
+    mmcu_phase_push("free");
+    for (int i = 0; i < n_comms; ++i) {
+        MPI_Comm_free(&comms[i]);
+    }
+    mmcu_phase_pop();
+
+    CHECK(mmcu_usage_get(&freed) == 0);
+    check_usage(&freed);
+    mmcu_usage_diff(&freed, &after, &diff);
+    // Freeing them gives back what MPI_Comm_split allocated.
+    CHECK(diff.n_frees > 0);
+    CHECK(diff.mpi_call_b[split] < 0);
+
+    if (rank == 0) printf("# OK\n");
+
+    MPI_Finalize();
+
+    return 0;
+}
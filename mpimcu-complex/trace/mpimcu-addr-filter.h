@@ -0,0 +1,105 @@
+/*
+ * Copyright (c)      2017 Los Alamos National Security, LLC.
+ *                         All rights reserved.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+
+/**
+ * Counting Bloom filter over heap addresses. Answers either 'maybe present' or
+ * 'definitely absent' without taking a lock. Updates must be serialized by
+ * the caller, but lookups may race with them.
+ */
+class mmcu_addr_filter {
+    // log2 of the number of counters.
+    static constexpr int n_bits = 18;
+    //
+    static constexpr size_t n_counters = size_t(1) << n_bits;
+    // Saturated counters stay put, since their true count is lost.
+    static constexpr uint8_t sticky = UINT8_MAX;
+    //
+    std::atomic<uint8_t> counters[n_counters];
+
+    /**
+     * Sets the two counter indices of the given address.
+     */
+    static void
+    hash(
+        uintptr_t addr,
+        size_t &h1,
+        size_t &h2
+    ) {
+        // Heap addresses are at least 16 B aligned, so skip the low bits.
+        const uint64_t h = uint64_t(addr >> 4) * 0x9e3779b97f4a7c15ULL;
+        h1 = size_t(h >> (64 - n_bits));
+        h2 = size_t(h >> (64 - 2 * n_bits)) & (n_counters - 1);
+    }
+
+    /**
+     *
+     */
+    void
+    add(
+        size_t i,
+        int delta
+    ) {
+        const uint8_t c = counters[i].load(std::memory_order_relaxed);
+        if (c == sticky || (c == 0 && delta < 0)) return;
+        counters[i].store(uint8_t(c + delta), std::memory_order_relaxed);
+    }
+
+public:
+
+    /**
+     *
+     */
+    mmcu_addr_filter(void)
+    {
+        for (auto &c : counters) {
+            c.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     *
+     */
+    void
+    insert(
+        uintptr_t addr
+    ) {
+        size_t h1, h2;
+        hash(addr, h1, h2);
+        add(h1, 1);
+        add(h2, 1);
+    }
+
+    /**
+     * Must only be called for addresses that were inserted.
+     */
+    void
+    remove(
+        uintptr_t addr
+    ) {
+        size_t h1, h2;
+        hash(addr, h1, h2);
+        add(h1, -1);
+        add(h2, -1);
+    }
+
+    /**
+     * Returns false only if the given address is definitely not present.
+     */
+    bool
+    maybe_contains(
+        uintptr_t addr
+    ) const {
+        size_t h1, h2;
+        hash(addr, h1, h2);
+        return counters[h1].load(std::memory_order_relaxed) != 0 &&
+               counters[h2].load(std::memory_order_relaxed) != 0;
+    }
+};
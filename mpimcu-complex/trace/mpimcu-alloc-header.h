@@ -0,0 +1,116 @@
+/*
+ * Copyright (c)      2017 Los Alamos National Security, LLC.
+ *                         All rights reserved.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* XOR'd with the user pointer to form a header's tag. */
+#define MMCU_ALLOC_HEADER_MAGIC 0x6d6d6375a110c8edULL
+/* Largest distance between a block's start and its user pointer. */
+#define MMCU_ALLOC_HEADER_MAX_OFFSET ((1U << 24) - 1)
+
+/*
+ * Placed right before the user pointer of allocations made in header mode
+ * (MMCU_ALLOC_HEADERS). 48 B, so user pointers keep malloc's alignment.
+ */
+typedef struct mmcu_alloc_header_t {
+    /* Requested size. */
+    uint64_t size;
+    /* Return address of the allocation call. */
+    uint64_t callsite;
+    /* Time at which the allocation was made (see mmcu_time). */
+    double captured_at;
+    /* Distance from the start of the block to the user pointer (low 24 bits)
+     * and the MPI call during which the allocation happened (high 8 bits). */
+    uint32_t offset_call;
+    /* See mmcu_memory_op_entry::sample_weight. */
+    float sample_weight;
+    /* Keeps the size a multiple of 16 B. */
+    uint64_t reserved;
+    /* MMCU_ALLOC_HEADER_MAGIC ^ user pointer. Last, so that it overlays the
+     * allocator's chunk size field for untagged pointers. */
+    uint64_t tag;
+} mmcu_alloc_header_t;
+
+/**
+ * Fills in the header of the given user pointer.
+ */
+static inline void
+mmcu_alloc_header_set(
+    void *ptr,
+    uint64_t size,
+    uint64_t callsite,
+    uint32_t offset,
+    uint8_t mpi_call_id,
+    float sample_weight,
+    double captured_at
+) {
+    mmcu_alloc_header_t *hdr = (mmcu_alloc_header_t *)ptr - 1;
+    hdr->size = size;
+    hdr->callsite = callsite;
+    hdr->captured_at = captured_at;
+    hdr->offset_call = (offset & MMCU_ALLOC_HEADER_MAX_OFFSET) |
+                       ((uint32_t)mpi_call_id << 24);
+    hdr->sample_weight = sample_weight;
+    hdr->reserved = 0;
+    hdr->tag = MMCU_ALLOC_HEADER_MAGIC ^ (uint64_t)(uintptr_t)ptr;
+}
+
+/**
+ * Returns the header of the given user pointer, or NULL if it wasn't
+ * allocated in header mode. Safe for any pointer returned by the allocator:
+ * for untagged pointers, the word read is the allocator's chunk size field.
+ */
+static inline mmcu_alloc_header_t *
+mmcu_alloc_header_get(
+    void *ptr
+) {
+    if (!ptr) return NULL;
+    mmcu_alloc_header_t *hdr = (mmcu_alloc_header_t *)ptr - 1;
+    if (hdr->tag != (MMCU_ALLOC_HEADER_MAGIC ^ (uint64_t)(uintptr_t)ptr)) {
+        return NULL;
+    }
+    return hdr;
+}
+
+/**
+ *
+ */
+static inline uint32_t
+mmcu_alloc_header_offset(
+    const mmcu_alloc_header_t *hdr
+) {
+    return hdr->offset_call & MMCU_ALLOC_HEADER_MAX_OFFSET;
+}
+
+/**
+ *
+ */
+static inline uint8_t
+mmcu_alloc_header_mpi_call_id(
+    const mmcu_alloc_header_t *hdr
+) {
+    return (uint8_t)(hdr->offset_call >> 24);
+}
+
+/**
+ * Returns the start of the block that holds the given header.
+ */
+static inline void *
+mmcu_alloc_header_block(
+    mmcu_alloc_header_t *hdr
+) {
+    return (char *)(hdr + 1) - mmcu_alloc_header_offset(hdr);
+}
+
+#ifdef __cplusplus
+}
+#endif
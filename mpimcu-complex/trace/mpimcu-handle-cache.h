@@ -0,0 +1,157 @@
+/*
+ * Copyright (c)      2017 Los Alamos National Security, LLC.
+ *                         All rights reserved.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+
+/**
+ * Fixed-capacity map from MPI handle (as a nonzero integer) to an immutable
+ * value, for lookups on the fast path of MPI calls. Lookups don't lock; inserts
+ * and erases serialize on the cache's own mutex, never the hooks lock. Keys
+ * stay in their slots once inserted, so that lookups can probe without
+ * locking: erasing a key only drops its value, and the slot is reused by a
+ * later insert that probes it. When the cache is full, inserts fail and
+ * callers compute what they need every time.
+ */
+template <typename T, size_t capacity = 4096>
+class mmcu_handle_cache {
+    static_assert(
+        (capacity & (capacity - 1)) == 0, "capacity must be a power of two"
+    );
+    //
+    struct slot {
+        // 0 if never used.
+        std::atomic<uint64_t> key{0};
+        // nullptr if never set, or erased.
+        std::atomic<const T *> value{nullptr};
+    };
+    //
+    slot slots[capacity];
+    // Serializes inserts and erases.
+    std::mutex mtx;
+
+    /**
+     * Returns the home slot of the given key. Handles are often pointers, so
+     * mix the bits before taking the low ones.
+     */
+    static size_t
+    get_home(
+        uint64_t key
+    ) {
+        uint64_t h = key * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 32;
+        return size_t(h) & (capacity - 1);
+    }
+
+public:
+
+    /**
+     *
+     */
+    mmcu_handle_cache(void) = default;
+
+    /**
+     *
+     */
+    ~mmcu_handle_cache(void) {
+        for (auto &s : slots) {
+            delete s.value.load(std::memory_order_relaxed);
+        }
+    }
+
+    mmcu_handle_cache(const mmcu_handle_cache &) = delete;
+    //
+    mmcu_handle_cache &
+    operator=(const mmcu_handle_cache &) = delete;
+
+    /**
+     * Returns the value of the given key, or nullptr if it has none. Doesn't
+     * lock.
+     */
+    const T *
+    find(
+        uint64_t key
+    ) const {
+        if (key == 0) return nullptr;
+        //
+        size_t i = get_home(key);
+        for (size_t n = 0; n < capacity; ++n) {
+            // Acquire, so that an erased value is never seen under the key of
+            // a reused slot.
+            const uint64_t k = slots[i].key.load(std::memory_order_acquire);
+            if (k == key) {
+                return slots[i].value.load(std::memory_order_acquire);
+            }
+            if (k == 0) break;
+            i = (i + 1) & (capacity - 1);
+        }
+        return nullptr;
+    }
+
+    /**
+     * Publishes the given value (allocated with new) for the given key, and
+     * takes ownership of it. Returns false, leaving the value with the caller,
+     * if the key already has one (e.g., another thread got in first) or the
+     * cache is full.
+     */
+    bool
+    insert(
+        uint64_t key,
+        const T *value
+    ) {
+        if (key == 0) return false;
+        //
+        std::lock_guard<std::mutex> lock(mtx);
+        size_t i = get_home(key);
+        // First slot without a value along the probe sequence.
+        size_t free_i = capacity;
+        for (size_t n = 0; n < capacity; ++n) {
+            const uint64_t k = slots[i].key.load(std::memory_order_relaxed);
+            const T *v = slots[i].value.load(std::memory_order_relaxed);
+            if (k == key) {
+                if (v) return false;
+                slots[i].value.store(value, std::memory_order_release);
+                return true;
+            }
+            if (free_i == capacity && !v) free_i = i;
+            if (k == 0) break;
+            i = (i + 1) & (capacity - 1);
+        }
+        if (free_i == capacity) return false;
+        //
+        slots[free_i].key.store(key, std::memory_order_release);
+        slots[free_i].value.store(value, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Drops and deletes the value of the given key. Nothing may look up the
+     * key meanwhile (e.g., call before freeing the handle).
+     */
+    void
+    erase(
+        uint64_t key
+    ) {
+        if (key == 0) return;
+        //
+        std::lock_guard<std::mutex> lock(mtx);
+        size_t i = get_home(key);
+        for (size_t n = 0; n < capacity; ++n) {
+            const uint64_t k = slots[i].key.load(std::memory_order_relaxed);
+            if (k == key) {
+                delete slots[i].value.exchange(
+                    nullptr, std::memory_order_relaxed
+                );
+                return;
+            }
+            if (k == 0) return;
+            i = (i + 1) & (capacity - 1);
+        }
+    }
+};
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c)      2017 Los Alamos National Security, LLC.
+ *                         All rights reserved.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+
+#include <string.h>
+#include <malloc.h>
+
+/**
+ * Process-wide allocator state, as reported by glibc.
+ */
+class mmcu_malloc_stats {
+public:
+    // Bytes obtained from the system by all arenas, including chunks that
+    // were mmapped directly.
+    size_t arena_b = 0;
+    // Bytes of arena memory handed out to callers.
+    size_t in_use_b = 0;
+    // Bytes of arena memory sitting in free lists (fragmentation).
+    size_t free_b = 0;
+    // Free bytes at the top of the main arena that could be trimmed.
+    size_t trimmable_b = 0;
+
+    /**
+     *
+     */
+    static mmcu_malloc_stats
+    sample(void) {
+        mmcu_malloc_stats ms;
+        // Summed over all arenas.
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 33)
+        const struct mallinfo2 mi = mallinfo2();
+#else
+        // Fields are ints, so they wrap past 2 GB.
+        const struct mallinfo mi = mallinfo();
+#endif
+        ms.arena_b = size_t(mi.arena) + size_t(mi.hblkhd);
+        ms.in_use_b = size_t(mi.uordblks) + size_t(mi.hblkhd);
+        ms.free_b = size_t(mi.fordblks);
+        ms.trimmable_b = size_t(mi.keepcost);
+        return ms;
+    }
+
+    /**
+     * Returns the number of arenas according to malloc_info(3), or 0 if it
+     * couldn't be determined.
+     */
+    static size_t
+    get_num_arenas(void) {
+        char *buf = NULL;
+        size_t buf_len = 0;
+        FILE *f = open_memstream(&buf, &buf_len);
+        if (!f) return 0;
+        //
+        const int rc = malloc_info(0, f);
+        fclose(f);
+        //
+        size_t n_arenas = 0;
+        // Each arena is reported as a '<heap nr="N">' element.
+        if (rc == 0) {
+            for (const char *p = buf; (p = strstr(p, "<heap nr=")); ++p) {
+                ++n_arenas;
+            }
+        }
+        free(buf);
+        return n_arenas;
+    }
+
+    /**
+     * Returns the usable size of a live allocation.
+     */
+    static size_t
+    get_usable_size(
+        uintptr_t addr
+    ) {
+        return malloc_usable_size((void *)addr);
+    }
+};
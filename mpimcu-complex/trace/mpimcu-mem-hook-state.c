@@ -7,6 +7,9 @@
 
 #include <assert.h>
 
+/* Nesting depth of tool code on this thread. */
+static __thread uint32_t tool_depth = 0;
+
 static inline void
 mem_hook_set_all(
     mmcu_mem_hook_mgr_t *mgr,
@@ -41,5 +44,21 @@ mmcu_mem_hook_mgr_hook_active(
 ) {
     assert(mgr);
     assert(hook_id < MMCU_HOOK_LAST);
+    /* Hook state is shared by all threads, so another one may activate hooks
+     * while this one is in tool code. */
+    if (tool_depth) return 0;
     return mgr->mmcu_mem_hook_state_tab[hook_id].active;
 }
+
+void
+mmcu_mem_hook_mgr_enter_tool(void)
+{
+    ++tool_depth;
+}
+
+void
+mmcu_mem_hook_mgr_exit_tool(void)
+{
+    assert(tool_depth);
+    --tool_depth;
+}
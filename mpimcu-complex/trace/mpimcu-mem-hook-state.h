@@ -20,6 +20,8 @@ enum {
     MMCU_HOOK_MMAP,
     MMCU_HOOK_MMAP_PSS_UPDATE, /* For internal use only. */
     MMCU_HOOK_MUNMAP,
+    MMCU_HOOK_MREMAP,
+    MMCU_HOOK_MADVISE,
     MMCU_HOOK_NOOP,            /* For internal use only. */
     MMCU_HOOK_LAST
 };
@@ -57,6 +59,19 @@ mmcu_mem_hook_mgr_hook_active(
     uint8_t hook_id
 );
 
+/**
+ * Brackets tool code on the calling thread. No hook is active for the thread
+ * in between, so the tool's own memory operations never re-enter the hooks.
+ */
+void
+mmcu_mem_hook_mgr_enter_tool(void);
+
+/**
+ *
+ */
+void
+mmcu_mem_hook_mgr_exit_tool(void);
+
 #ifdef __cplusplus
 }
 #endif
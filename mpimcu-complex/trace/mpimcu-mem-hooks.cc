@@ -7,14 +7,229 @@
 
 #include "mpimcu-rt.h"
 #include "mpimcu-mem-stat-mgr.h"
+#include "mpimcu-alloc-header.h"
 
 #include <cstdlib>
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include <atomic>
 #include <mutex>
 
+#include <unistd.h>
+#include <malloc.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void __libc_free(void *ptr);
 
 namespace {
 static std::mutex mmcu_mem_hooks_mtx;
+
+/**
+ * Holds the hooks lock, and keeps this thread out of the hooks meanwhile.
+ */
+class hooks_lock_guard {
+    std::lock_guard<std::mutex> lock;
+public:
+    hooks_lock_guard(void) : lock(mmcu_mem_hooks_mtx) {
+        mmcu_mem_hook_mgr_enter_tool();
+    }
+    //
+    ~hooks_lock_guard(void) {
+        mmcu_mem_hook_mgr_exit_tool();
+    }
+    //
+    hooks_lock_guard(const hooks_lock_guard &) = delete;
+    //
+    hooks_lock_guard &
+    operator=(const hooks_lock_guard &) = delete;
+};
+// Bytes left until the next sampled allocation (allocation sampling only).
+// Negative until first use.
+static __thread int64_t sample_bytes_left = -1;
+// State of the per-thread random number generator used by the sampler.
+static __thread uint64_t sample_rng_state = 0;
+// Bytes in front of the user pointer in header mode (MMCU_ALLOC_HEADERS).
+static const size_t hdr_len = sizeof(mmcu_alloc_header_t);
+// Number of tagged allocations freed while not tracing.
+static std::atomic<uint64_t> n_untraced_tagged_frees(0);
+
+/**
+ * Returns the number of bytes until the next sampled allocation. Drawn from
+ * an exponential distribution with the given mean, so that every allocated
+ * byte is equally likely to be sampled (Poisson sampling).
+ */
+int64_t
+next_sample_distance(
+    uint64_t mean
+) {
+    if (sample_rng_state == 0) {
+        sample_rng_state = (uint64_t(syscall(SYS_gettid)) << 32) ^
+                           uint64_t(mmcu_time() * 1e9) ^ 1;
+    }
+    // xorshift64*: not rand(3), which the application may depend on.
+    uint64_t x = sample_rng_state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    sample_rng_state = x;
+    // In [0, 1).
+    const double u = double((x * 0x2545F4914F6CDD1DULL) >> 11) /
+                     9007199254740992.0;
+    return int64_t(-std::log1p(-u) * double(mean)) + 1;
+}
+
+/**
+ * Attributes the given allocation entry to the current MPI call and the given
+ * caller.
+ */
+void
+init_alloc_entry(
+    mmcu_rt *rt,
+    mmcu_memory_op_entry &ope,
+    const void *caller,
+    bool sampled
+) {
+    ope.mpi_call_id = rt->get_mpi_call_id();
+    ope.callsite = uintptr_t(caller);
+    ope.captured_at = mmcu_time();
+    // Each recorded allocation stands in for 1 / P(sampled) allocations.
+    const uint64_t interval = rt->get_alloc_sample_interval();
+    if (sampled && interval != 0 && ope.size != 0) {
+        const double p = -std::expm1(-double(ope.size) / double(interval));
+        ope.sample_weight = float(1.0 / p);
+    }
+}
+
+/**
+ * Writes a header describing the given entry at the front of blk and returns
+ * the pointer handed out to the caller, or NULL if blk is NULL.
+ */
+void *
+tag_block(
+    void *blk,
+    size_t offset,
+    mmcu_memory_op_entry &ope
+) {
+    if (!blk) return NULL;
+    //
+    char *ptr = (char *)blk + offset;
+    mmcu_alloc_header_set(
+        ptr, ope.size, ope.callsite, uint32_t(offset),
+        ope.mpi_call_id, ope.sample_weight, ope.captured_at
+    );
+    ope.addr = uintptr_t(ptr);
+    ope.usable_size = malloc_usable_size(blk) - offset;
+    return ptr;
+}
+
+/**
+ * Hands the given allocation entry to the stat manager. Tagged allocations
+ * are only accounted for: the header is all a later free needs.
+ */
+void
+record_alloc(
+    mmcu_memory_op_entry &ope,
+    bool tagged
+) {
+    auto *stat_mgr = mmcu_mem_stat_mgr::the_mmcu_mem_stat_mgr();
+    if (!tagged) {
+        stat_mgr->capture(new mmcu_memory_op_entry(ope));
+    }
+    // Nothing to account for if the allocation failed.
+    else if (ope.addr != 0) {
+        stat_mgr->capture_tagged(&ope);
+    }
+}
+
+/**
+ * Frees the given pointer and records it. hdr is the pointer's header, or
+ * NULL if it isn't tagged.
+ */
+void
+untag_and_free(
+    mmcu_alloc_header_t *hdr,
+    void *ptr
+) {
+    auto *stat_mgr = mmcu_mem_stat_mgr::the_mmcu_mem_stat_mgr();
+    if (!hdr) {
+        const uintptr_t addr = uintptr_t(ptr);
+        free(ptr);
+        stat_mgr->capture(new mmcu_memory_op_entry(MMCU_HOOK_FREE, addr));
+        return;
+    }
+    //
+    void *blk = mmcu_alloc_header_block(hdr);
+    mmcu_memory_op_entry ope(MMCU_HOOK_FREE, uintptr_t(ptr), hdr->size);
+    ope.usable_size = malloc_usable_size(blk) - mmcu_alloc_header_offset(hdr);
+    ope.sample_weight = hdr->sample_weight;
+    ope.mpi_call_id = mmcu_alloc_header_mpi_call_id(hdr);
+    ope.callsite = uintptr_t(hdr->callsite);
+    ope.captured_at = hdr->captured_at;
+    // So that whatever reuses the block isn't mistaken for a tagged pointer.
+    hdr->tag = 0;
+    free(blk);
+    //
+    stat_mgr->capture_tagged(&ope);
+}
+
+/**
+ * Returns whether or not the given madvise(2) advice gives pages back to the
+ * kernel.
+ */
+bool
+advice_releases_pages(
+    int advice
+) {
+    switch (advice) {
+        case (MADV_DONTNEED):
+        case (MADV_REMOVE):
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * Returns whether or not the given madvise(2) advice lets the kernel reclaim
+ * pages later. Such pages stay resident until it does.
+ */
+bool
+advice_frees_lazily(
+    int advice
+) {
+#ifdef MADV_FREE
+    return advice == MADV_FREE;
+#else
+    (void)advice;
+    return false;
+#endif
+}
+}
+
+/**
+ *
+ */
+int
+mmcu_mem_hooks_sample_alloc(
+    size_t size
+) {
+    static mmcu_rt *rt = mmcu_rt::the_mmcu_rt();
+    const uint64_t interval = rt->get_alloc_sample_interval();
+    if (interval == 0) return 1;
+    //
+    if (sample_bytes_left < 0) {
+        sample_bytes_left = next_sample_distance(interval);
+    }
+    sample_bytes_left -= int64_t(size);
+    if (sample_bytes_left > 0) return 0;
+    // Crossed the threshold, so sample this one and start over.
+    sample_bytes_left = next_sample_distance(interval);
+    return 1;
 }
 
 /**
@@ -22,21 +237,39 @@ static std::mutex mmcu_mem_hooks_mtx;
  */
 void *
 mmcu_mem_hooks_malloc_hook(
-    size_t size
+    size_t size,
+    const void *caller
 ) {
-    std::lock_guard<std::mutex> lock(mmcu_mem_hooks_mtx);
+    hooks_lock_guard lock;
     //
     static mmcu_rt *rt = mmcu_rt::the_mmcu_rt();
     // Deactivate hooks for logging.
     rt->deactivate_all_mem_hooks();
+    //
+    mmcu_memory_op_entry ope(MMCU_HOOK_MALLOC, 0, size);
+    init_alloc_entry(rt, ope, caller, true);
+    const bool tagged = rt->get_alloc_headers();
     // Do op.
-    void *res = malloc(size);
+    void *res = NULL;
+    if (tagged) {
+        if (size <= SIZE_MAX - hdr_len) {
+            res = tag_block(malloc(size + hdr_len), hdr_len, ope);
+        }
+        else {
+            errno = ENOMEM;
+        }
+    }
+    else {
+        res = malloc(size);
+        ope.addr = uintptr_t(res);
+    }
+    // Logging must not clobber the operation's errno.
+    const int op_errno = errno;
     // Do logging.
-    mmcu_mem_stat_mgr::the_mmcu_mem_stat_mgr()->capture(
-        new mmcu_memory_op_entry(MMCU_HOOK_MALLOC, uintptr_t(res), size)
-    );
+    record_alloc(ope, tagged);
     // Reactivate hooks.
     rt->activate_all_mem_hooks();
+    errno = op_errno;
 
     return res;
 }
@@ -47,22 +280,41 @@ mmcu_mem_hooks_malloc_hook(
 void *
 mmcu_mem_hooks_calloc_hook(
     size_t nmemb,
-    size_t size
+    size_t size,
+    const void *caller
 ) {
-    std::lock_guard<std::mutex> lock(mmcu_mem_hooks_mtx);
+    hooks_lock_guard lock;
     //
     static mmcu_rt *rt = mmcu_rt::the_mmcu_rt();
     // Deactivate hooks for logging.
     rt->deactivate_all_mem_hooks();
+    //
+    const size_t real_size = nmemb * size;
+    mmcu_memory_op_entry ope(MMCU_HOOK_CALLOC, 0, real_size);
+    init_alloc_entry(rt, ope, caller, true);
+    const bool tagged = rt->get_alloc_headers();
     // Do op.
-    void *res = calloc(nmemb, size);
+    void *res = NULL;
+    if (tagged) {
+        if ((size == 0 || nmemb <= SIZE_MAX / size) &&
+            real_size <= SIZE_MAX - hdr_len) {
+            res = tag_block(calloc(1, real_size + hdr_len), hdr_len, ope);
+        }
+        else {
+            errno = ENOMEM;
+        }
+    }
+    else {
+        res = calloc(nmemb, size);
+        ope.addr = uintptr_t(res);
+    }
+    // Logging must not clobber the operation's errno.
+    const int op_errno = errno;
     // Do logging.
-    const size_t real_size = nmemb * size;
-    mmcu_mem_stat_mgr::the_mmcu_mem_stat_mgr()->capture(
-        new mmcu_memory_op_entry(MMCU_HOOK_CALLOC, uintptr_t(res), real_size)
-    );
+    record_alloc(ope, tagged);
     // Reactivate hooks.
     rt->activate_all_mem_hooks();
+    errno = op_errno;
 
     return res;
 }
@@ -73,26 +325,61 @@ mmcu_mem_hooks_calloc_hook(
 void *
 mmcu_mem_hooks_realloc_hook(
     void *ptr,
-    size_t size
+    size_t size,
+    const void *caller
 ) {
-    std::lock_guard<std::mutex> lock(mmcu_mem_hooks_mtx);
+    hooks_lock_guard lock;
     //
     static mmcu_rt *rt = mmcu_rt::the_mmcu_rt();
+    auto *stat_mgr = mmcu_mem_stat_mgr::the_mmcu_mem_stat_mgr();
     // Deactivate hooks for logging.
     rt->deactivate_all_mem_hooks();
+    // Never sampled, since the old allocation may be tracked.
+    mmcu_memory_op_entry ope(MMCU_HOOK_REALLOC, 0, size, uintptr_t(ptr));
+    init_alloc_entry(rt, ope, caller, false);
     // Do op.
-    void *res = realloc(ptr, size);
-    // Do logging.
-    mmcu_mem_stat_mgr::the_mmcu_mem_stat_mgr()->capture(
-        new mmcu_memory_op_entry(
-            MMCU_HOOK_REALLOC,
-            uintptr_t(res),
-            size,
-            uintptr_t(ptr)
-        )
-    );
+    void *res = NULL;
+    if (!rt->get_alloc_headers()) {
+        res = realloc(ptr, size);
+        ope.addr = uintptr_t(res);
+        // Logging must not clobber the operation's errno.
+        const int op_errno = errno;
+        // Do logging.
+        stat_mgr->capture(new mmcu_memory_op_entry(ope));
+        // Reactivate hooks.
+        rt->activate_all_mem_hooks();
+        errno = op_errno;
+        //
+        return res;
+    }
+    // Header mode: the header can't be grown in place, so move to a new
+    // tagged block. Memory allocated outside of tracing is moved, too.
+    // Successful reallocs leave errno alone.
+    int op_errno = errno;
+    mmcu_alloc_header_t *hdr = mmcu_alloc_header_get(ptr);
+    if (ptr && size == 0) {
+        untag_and_free(hdr, ptr);
+    }
+    else if (size <= SIZE_MAX - hdr_len) {
+        ope.opid = MMCU_HOOK_MALLOC;
+        res = tag_block(malloc(size + hdr_len), hdr_len, ope);
+        if (!res) {
+            op_errno = ENOMEM;
+        }
+        else if (ptr) {
+            const size_t old_size = hdr ? size_t(hdr->size)
+                                        : malloc_usable_size(ptr);
+            memcpy(res, ptr, std::min(old_size, size));
+            untag_and_free(hdr, ptr);
+        }
+        record_alloc(ope, true);
+    }
+    else {
+        op_errno = ENOMEM;
+    }
     // Reactivate hooks.
     rt->activate_all_mem_hooks();
+    errno = op_errno;
     //
     return res;
 }
@@ -104,25 +391,51 @@ int
 mmcu_mem_hooks_posix_memalign_hook(
     void **memptr,
     size_t alignment,
-    size_t size
+    size_t size,
+    const void *caller
 ) {
-    std::lock_guard<std::mutex> lock(mmcu_mem_hooks_mtx);
+    hooks_lock_guard lock;
     //
     static mmcu_rt *rt = mmcu_rt::the_mmcu_rt();
     // Deactivate hooks for logging.
     rt->deactivate_all_mem_hooks();
+    //
+    mmcu_memory_op_entry ope(MMCU_HOOK_POSIX_MEMALIGN, 0, size);
+    init_alloc_entry(rt, ope, caller, true);
+    // The user pointer must keep the requested alignment, so the header is
+    // rounded up to a multiple of it. Invalid alignments (not a power of two),
+    // which posix_memalign rejects, and huge ones are left untagged.
+    const bool pow2 = alignment != 0 && (alignment & (alignment - 1)) == 0;
+    const size_t offset =
+        pow2 && alignment <= MMCU_ALLOC_HEADER_MAX_OFFSET ?
+        (hdr_len + alignment - 1) & ~(alignment - 1) : SIZE_MAX;
+    const bool tagged = rt->get_alloc_headers() &&
+                        offset <= MMCU_ALLOC_HEADER_MAX_OFFSET &&
+                        size <= SIZE_MAX - offset;
     // Do op.
-    int rc = posix_memalign(memptr, alignment, size);
+    int rc = 0;
+    if (tagged) {
+        void *blk = NULL;
+        rc = posix_memalign(&blk, alignment, size + offset);
+        if (rc == 0) {
+            *memptr = tag_block(blk, offset, ope);
+        }
+    }
+    else {
+        rc = posix_memalign(memptr, alignment, size);
+        if (rc == 0) {
+            ope.addr = uintptr_t(*memptr);
+        }
+    }
+    // Logging must not clobber the operation's errno.
+    const int op_errno = errno;
     // Do logging.
-    mmcu_mem_stat_mgr::the_mmcu_mem_stat_mgr()->capture(
-        new mmcu_memory_op_entry(
-            MMCU_HOOK_POSIX_MEMALIGN,
-            uintptr_t(*memptr),
-            size
-        )
-    );
+    if (rc == 0) {
+        record_alloc(ope, tagged);
+    }
     // Reactivate hooks.
     rt->activate_all_mem_hooks();
+    errno = op_errno;
     //
     return rc;
 }
@@ -139,13 +452,15 @@ mmcu_mem_hooks_mmap_hook(
     int fd,
     off_t offset
 ) {
-    std::lock_guard<std::mutex> lock(mmcu_mem_hooks_mtx);
+    hooks_lock_guard lock;
     //
     static mmcu_rt *rt = mmcu_rt::the_mmcu_rt();
     // Deactivate hooks for logging.
     rt->deactivate_all_mem_hooks();
     // Do op.
     void *res = mmap(addr, length, prot, flags, fd, offset);
+    // Logging must not clobber the operation's errno.
+    const int op_errno = errno;
     // Do logging.
     mmcu_mem_stat_mgr::the_mmcu_mem_stat_mgr()->capture(
         new mmcu_memory_op_entry(
@@ -156,6 +471,7 @@ mmcu_mem_hooks_mmap_hook(
     );
     // Reactivate hooks.
     rt->activate_all_mem_hooks();
+    errno = op_errno;
     //
     return res;
 }
@@ -167,19 +483,124 @@ void
 mmcu_mem_hooks_free_hook(
     void *ptr
 ) {
-    std::lock_guard<std::mutex> lock(mmcu_mem_hooks_mtx);
+    hooks_lock_guard lock;
     //
     static mmcu_rt *rt = mmcu_rt::the_mmcu_rt();
     // Deactivate hooks for logging.
     rt->deactivate_all_mem_hooks();
+    // Tagged, so no lookup is needed to learn what is being freed.
+    mmcu_alloc_header_t *hdr = NULL;
+    if (rt->get_alloc_headers()) {
+        hdr = mmcu_alloc_header_get(ptr);
+    }
+    if (hdr) {
+        // Logging must not clobber errno.
+        const int op_errno = errno;
+        // Does the op and the logging.
+        untag_and_free(hdr, ptr);
+        // Reactivate hooks.
+        rt->activate_all_mem_hooks();
+        errno = op_errno;
+        return;
+    }
     // Do op.
     free(ptr);
+    // Logging must not clobber the operation's errno.
+    const int op_errno = errno;
     // Do logging.
     mmcu_mem_stat_mgr::the_mmcu_mem_stat_mgr()->capture(
         new mmcu_memory_op_entry(MMCU_HOOK_FREE, uintptr_t(ptr))
     );
     // Reactivate hooks.
     rt->activate_all_mem_hooks();
+    errno = op_errno;
+}
+
+/**
+ *
+ */
+int
+mmcu_mem_hooks_is_tagged(
+    void *ptr
+) {
+    static mmcu_rt *rt = mmcu_rt::the_mmcu_rt();
+    if (!rt->get_alloc_headers()) return 0;
+    return mmcu_alloc_header_get(ptr) != NULL;
+}
+
+/**
+ *
+ */
+void
+mmcu_mem_hooks_lock(void)
+{
+    mmcu_mem_hooks_mtx.lock();
+    mmcu_mem_hook_mgr_enter_tool();
+}
+
+/**
+ *
+ */
+void
+mmcu_mem_hooks_unlock(void)
+{
+    mmcu_mem_hook_mgr_exit_tool();
+    mmcu_mem_hooks_mtx.unlock();
+}
+
+/**
+ *
+ */
+int
+mmcu_mem_hooks_maybe_tracked(
+    void *ptr
+) {
+    static mmcu_mem_stat_mgr *stat_mgr =
+        mmcu_mem_stat_mgr::the_mmcu_mem_stat_mgr();
+    return stat_mgr->maybe_tracked(uintptr_t(ptr));
+}
+
+/**
+ *
+ */
+void
+mmcu_mem_hooks_untraced_free(
+    void *ptr
+) {
+    mmcu_alloc_header_t *hdr = mmcu_alloc_header_get(ptr);
+    n_untraced_tagged_frees++;
+    hdr->tag = 0;
+    __libc_free(mmcu_alloc_header_block(hdr));
+}
+
+/**
+ *
+ */
+void *
+mmcu_mem_hooks_untraced_realloc(
+    void *ptr,
+    size_t size
+) {
+    if (size == 0) {
+        mmcu_mem_hooks_untraced_free(ptr);
+        return NULL;
+    }
+    // Not tracing, so the new block isn't tagged.
+    void *res = __libc_malloc(size);
+    if (!res) return NULL;
+    const mmcu_alloc_header_t *hdr = mmcu_alloc_header_get(ptr);
+    memcpy(res, ptr, std::min(size_t(hdr->size), size));
+    mmcu_mem_hooks_untraced_free(ptr);
+    return res;
+}
+
+/**
+ *
+ */
+uint64_t
+mmcu_mem_hooks_num_untraced_tagged_frees(void)
+{
+    return n_untraced_tagged_frees.load();
 }
 
 /**
@@ -190,23 +611,111 @@ mmcu_mem_hooks_munmap_hook(
     void *addr,
     size_t length
 ) {
-    std::lock_guard<std::mutex> lock(mmcu_mem_hooks_mtx);
+    hooks_lock_guard lock;
     //
     static mmcu_rt *rt = mmcu_rt::the_mmcu_rt();
     // Deactivate hooks for logging.
     rt->deactivate_all_mem_hooks();
     // Do op.
     int res = munmap(addr, length);
+    // Logging must not clobber the operation's errno.
+    const int op_errno = errno;
+    // Do logging. Nothing was unmapped if it failed.
+    if (res == 0) {
+        mmcu_mem_stat_mgr::the_mmcu_mem_stat_mgr()->capture(
+            new mmcu_memory_op_entry(
+                MMCU_HOOK_MUNMAP,
+                uintptr_t(addr),
+                length
+            )
+        );
+    }
+    // Reactivate hooks.
+    rt->activate_all_mem_hooks();
+    errno = op_errno;
+    //
+    return res;
+}
+
+/**
+ *
+ */
+void *
+mmcu_mem_hooks_mremap_hook(
+    void *old_address,
+    size_t old_size,
+    size_t new_size,
+    int flags,
+    void *new_address
+) {
+    hooks_lock_guard lock;
+    //
+    static mmcu_rt *rt = mmcu_rt::the_mmcu_rt();
+    // Deactivate hooks for logging.
+    rt->deactivate_all_mem_hooks();
+    // Do op.
+    void *res = mremap(old_address, old_size, new_size, flags, new_address);
+    // Logging must not clobber the operation's errno.
+    const int op_errno = errno;
     // Do logging.
-    mmcu_mem_stat_mgr::the_mmcu_mem_stat_mgr()->capture(
-        new mmcu_memory_op_entry(
-            MMCU_HOOK_MUNMAP,
-            uintptr_t(addr),
-            length
-        )
-    );
+    if (res != MAP_FAILED) {
+        mmcu_mem_stat_mgr::the_mmcu_mem_stat_mgr()->capture(
+            new mmcu_memory_op_entry(
+                MMCU_HOOK_MREMAP,
+                uintptr_t(res),
+                new_size,
+                uintptr_t(old_address)
+            )
+        );
+    }
+    // Reactivate hooks.
+    rt->activate_all_mem_hooks();
+    errno = op_errno;
+    //
+    return res;
+}
+
+/**
+ *
+ */
+int
+mmcu_mem_hooks_madvise_hook(
+    void *addr,
+    size_t length,
+    int advice
+) {
+    hooks_lock_guard lock;
+    //
+    static mmcu_rt *rt = mmcu_rt::the_mmcu_rt();
+    // Deactivate hooks for logging.
+    rt->deactivate_all_mem_hooks();
+    mmcu_mem_stat_mgr *const stat_mgr =
+        mmcu_mem_stat_mgr::the_mmcu_mem_stat_mgr();
+    // The pages being released have to be measured before they are gone.
+    const bool releases = advice_releases_pages(advice);
+    if (releases) {
+        stat_mgr->begin_madvise(uintptr_t(addr), length);
+    }
+    // Do op.
+    int res = madvise(addr, length, advice);
+    // Logging must not clobber the operation's errno.
+    const int op_errno = errno;
+    // Do logging. Nothing changed if it failed.
+    if (res == 0 && releases) {
+        stat_mgr->capture(
+            new mmcu_memory_op_entry(
+                MMCU_HOOK_MADVISE,
+                uintptr_t(addr),
+                length
+            )
+        );
+    }
+    else if (res == 0 && advice_frees_lazily(advice)) {
+        stat_mgr->capture_lazy_free(uintptr_t(addr), length);
+    }
     // Reactivate hooks.
     rt->activate_all_mem_hooks();
+    errno = op_errno;
     //
     return res;
 }
@@ -12,12 +12,22 @@
 extern "C" {
 #endif
 
+/**
+ * Returns whether or not an allocation of the given size should be recorded.
+ * Always true unless allocation sampling (MMCU_SAMPLE_BYTES) is enabled.
+ */
+int
+mmcu_mem_hooks_sample_alloc(
+    size_t size
+);
+
 /**
  *
  */
 void *
 mmcu_mem_hooks_malloc_hook(
-    size_t size
+    size_t size,
+    const void *caller
 );
 
 /**
@@ -26,7 +36,8 @@ mmcu_mem_hooks_malloc_hook(
 void *
 mmcu_mem_hooks_calloc_hook(
     size_t nmemb,
-    size_t size
+    size_t size,
+    const void *caller
 );
 
 /**
@@ -35,7 +46,8 @@ mmcu_mem_hooks_calloc_hook(
 void *
 mmcu_mem_hooks_realloc_hook(
     void *ptr,
-    size_t size
+    size_t size,
+    const void *caller
 );
 
 /**
@@ -45,7 +57,8 @@ int
 mmcu_mem_hooks_posix_memalign_hook(
     void **memptr,
     size_t alignment,
-    size_t size
+    size_t size,
+    const void *caller
 );
 
 /**
@@ -78,6 +91,82 @@ mmcu_mem_hooks_munmap_hook(
     size_t length
 );
 
+/**
+ *
+ */
+void *
+mmcu_mem_hooks_mremap_hook(
+    void *old_address,
+    size_t old_size,
+    size_t new_size,
+    int flags,
+    void *new_address
+);
+
+/**
+ *
+ */
+int
+mmcu_mem_hooks_madvise_hook(
+    void *addr,
+    size_t length,
+    int advice
+);
+
+/**
+ * Returns whether or not the given pointer was allocated in header mode
+ * (MMCU_ALLOC_HEADERS). Always false when header mode is disabled.
+ */
+int
+mmcu_mem_hooks_is_tagged(
+    void *ptr
+);
+
+/**
+ * Serializes with all memory hooks, so that tool state can be changed from
+ * outside of them.
+ */
+void
+mmcu_mem_hooks_lock(void);
+
+/**
+ *
+ */
+void
+mmcu_mem_hooks_unlock(void);
+
+/**
+ * Returns 0 if the given pointer is definitely not a tracked heap allocation.
+ * Doesn't lock, so frees of memory MPI didn't allocate can skip the hook.
+ */
+int
+mmcu_mem_hooks_maybe_tracked(
+    void *ptr
+);
+
+/**
+ * Frees a tagged pointer while not tracing.
+ */
+void
+mmcu_mem_hooks_untraced_free(
+    void *ptr
+);
+
+/**
+ * Reallocates a tagged pointer while not tracing.
+ */
+void *
+mmcu_mem_hooks_untraced_realloc(
+    void *ptr,
+    size_t size
+);
+
+/**
+ * Returns the number of tagged pointers freed while not tracing.
+ */
+uint64_t
+mmcu_mem_hooks_num_untraced_tagged_frees(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -5,9 +5,13 @@
 
 #include "mpimcu-mem-hooks.h"
 #include "mpimcu-rt.h"
+#include "mpimcu-alloc-header.h"
 
 #include <stdlib.h>
+#include <malloc.h>
+#include <stdarg.h>
 #include <dlfcn.h>
+#include <sys/mman.h>
 
 extern void *__libc_malloc(size_t size);
 extern void *__libc_calloc(size_t nmemb, size_t size);
@@ -21,8 +25,9 @@ void *
 malloc(size_t size)
 {
     mmcu_mem_hook_mgr_t *mgr = mmcu_rt_get_mem_hook_mgr();
-    if (mmcu_mem_hook_mgr_hook_active(mgr, MMCU_HOOK_MALLOC)) {
-        return mmcu_mem_hooks_malloc_hook(size);
+    if (mmcu_mem_hook_mgr_hook_active(mgr, MMCU_HOOK_MALLOC) &&
+        mmcu_mem_hooks_sample_alloc(size)) {
+        return mmcu_mem_hooks_malloc_hook(size, __builtin_return_address(0));
     }
     return __libc_malloc(size);
 }
@@ -34,8 +39,11 @@ void *
 calloc(size_t nmemb, size_t size)
 {
     mmcu_mem_hook_mgr_t *mgr = mmcu_rt_get_mem_hook_mgr();
-    if (mmcu_mem_hook_mgr_hook_active(mgr, MMCU_HOOK_CALLOC)) {
-        return mmcu_mem_hooks_calloc_hook(nmemb, size);
+    if (mmcu_mem_hook_mgr_hook_active(mgr, MMCU_HOOK_CALLOC) &&
+        mmcu_mem_hooks_sample_alloc(nmemb * size)) {
+        return mmcu_mem_hooks_calloc_hook(
+                   nmemb, size, __builtin_return_address(0)
+               );
     }
     return __libc_calloc(nmemb, size);
 }
@@ -50,7 +58,13 @@ realloc(
 ) {
     mmcu_mem_hook_mgr_t *mgr = mmcu_rt_get_mem_hook_mgr();
     if (mmcu_mem_hook_mgr_hook_active(mgr, MMCU_HOOK_REALLOC)) {
-        return mmcu_mem_hooks_realloc_hook(ptr, size);
+        return mmcu_mem_hooks_realloc_hook(
+                   ptr, size, __builtin_return_address(0)
+               );
+    }
+    // Allocated in header mode, so glibc can't see the real block.
+    if (mmcu_mem_hooks_is_tagged(ptr)) {
+        return mmcu_mem_hooks_untraced_realloc(ptr, size);
     }
     return __libc_realloc(ptr, size);
 }
@@ -63,13 +77,45 @@ free(void *ptr)
 {
     mmcu_mem_hook_mgr_t *mgr = mmcu_rt_get_mem_hook_mgr();
     if (mmcu_mem_hook_mgr_hook_active(mgr, MMCU_HOOK_FREE)) {
-        mmcu_mem_hooks_free_hook(ptr);
+        // Frees of memory MPI didn't allocate skip the hook entirely.
+        if (mmcu_mem_hooks_is_tagged(ptr) ||
+            mmcu_mem_hooks_maybe_tracked(ptr)) {
+            mmcu_mem_hooks_free_hook(ptr);
+        }
+        else {
+            __libc_free(ptr);
+        }
+    }
+    // Allocated in header mode, so glibc can't see the real block.
+    else if (mmcu_mem_hooks_is_tagged(ptr)) {
+        mmcu_mem_hooks_untraced_free(ptr);
     }
     else {
         __libc_free(ptr);
     }
 }
 
+/**
+ *
+ */
+size_t
+malloc_usable_size(void *ptr)
+{
+    typedef size_t (*op_fn_t)(void *);
+    static op_fn_t fun = NULL;
+    //
+    if (!fun) {
+        fun = (op_fn_t)dlsym(RTLD_NEXT, "malloc_usable_size");
+    }
+    // Don't count the header.
+    if (mmcu_mem_hooks_is_tagged(ptr)) {
+        mmcu_alloc_header_t *hdr = mmcu_alloc_header_get(ptr);
+        return fun(mmcu_alloc_header_block(hdr)) -
+               mmcu_alloc_header_offset(hdr);
+    }
+    return fun(ptr);
+}
+
 /**
  *
  */
@@ -83,8 +129,11 @@ posix_memalign(
     static op_fn_t fun = NULL;
     //
     mmcu_mem_hook_mgr_t *mgr = mmcu_rt_get_mem_hook_mgr();
-    if (mmcu_mem_hook_mgr_hook_active(mgr, MMCU_HOOK_POSIX_MEMALIGN)) {
-        return mmcu_mem_hooks_posix_memalign_hook(memptr, alignment, size);
+    if (mmcu_mem_hook_mgr_hook_active(mgr, MMCU_HOOK_POSIX_MEMALIGN) &&
+        mmcu_mem_hooks_sample_alloc(size)) {
+        return mmcu_mem_hooks_posix_memalign_hook(
+                   memptr, alignment, size, __builtin_return_address(0)
+               );
     }
     if (!fun) {
         fun = (op_fn_t)dlsym(RTLD_NEXT, "posix_memalign");
@@ -139,3 +188,59 @@ munmap(
     }
     return fun(addr, length);
 }
+
+/**
+ *
+ */
+void *
+mremap(
+    void *old_address,
+    size_t old_size,
+    size_t new_size,
+    int flags,
+    ...
+) {
+    typedef void *(*op_fn_t)(void *, size_t, size_t, int, ...);
+    static op_fn_t fun = NULL;
+    // The new address is only passed with MREMAP_FIXED.
+    void *new_address = NULL;
+    if (flags & MREMAP_FIXED) {
+        va_list ap;
+        va_start(ap, flags);
+        new_address = va_arg(ap, void *);
+        va_end(ap);
+    }
+    //
+    mmcu_mem_hook_mgr_t *mgr = mmcu_rt_get_mem_hook_mgr();
+    if (mmcu_mem_hook_mgr_hook_active(mgr, MMCU_HOOK_MREMAP)) {
+        return mmcu_mem_hooks_mremap_hook(
+                   old_address, old_size, new_size, flags, new_address
+               );
+    }
+    if (!fun) {
+        fun = (op_fn_t)dlsym(RTLD_NEXT, "mremap");
+    }
+    return fun(old_address, old_size, new_size, flags, new_address);
+}
+
+/**
+ *
+ */
+int
+madvise(
+    void *addr,
+    size_t length,
+    int advice
+) {
+    typedef int (*op_fn_t)(void *, size_t, int);
+    static op_fn_t fun = NULL;
+    //
+    mmcu_mem_hook_mgr_t *mgr = mmcu_rt_get_mem_hook_mgr();
+    if (mmcu_mem_hook_mgr_hook_active(mgr, MMCU_HOOK_MADVISE)) {
+        return mmcu_mem_hooks_madvise_hook(addr, length, advice);
+    }
+    if (!fun) {
+        fun = (op_fn_t)dlsym(RTLD_NEXT, "madvise");
+    }
+    return fun(addr, length, advice);
+}
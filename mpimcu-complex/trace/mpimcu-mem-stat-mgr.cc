@@ -5,9 +5,23 @@
 
 #include "mpimcu-mem-stat-mgr.h"
 
+namespace {
+// Set once the singleton exists.
+std::atomic<mmcu_mem_stat_mgr *> created(nullptr);
+}
+
 mmcu_mem_stat_mgr *
 mmcu_mem_stat_mgr::the_mmcu_mem_stat_mgr(void)
 {
-    static mmcu_mem_stat_mgr singleton;
-    return &singleton;
+    // Never destroyed: allocations made by other exit-time destructors may
+    // still reach capture() after static destruction has started.
+    static mmcu_mem_stat_mgr *singleton = new mmcu_mem_stat_mgr();
+    created.store(singleton, std::memory_order_release);
+    return singleton;
+}
+
+mmcu_mem_stat_mgr *
+mmcu_mem_stat_mgr::the_mmcu_mem_stat_mgr_if_created(void)
+{
+    return created.load(std::memory_order_acquire);
 }
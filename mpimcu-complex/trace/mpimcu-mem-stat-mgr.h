@@ -8,26 +8,52 @@
 #include "mpimcu-rt.h"
 #include "mpimcu-mem-hook-state.h"
 #include "mpimcu-timer.h"
+#include "mpimcu-numa.h"
+#include "mpimcu-malloc-stats.h"
+#include "mpimcu-addr-filter.h"
+#include "mpimcu-request-table.h"
+#include "mpimcu-mem-hooks.h"
+#include "mpimcu-seqlock.h"
+#include "mpimcu-telemetry.h"
+#include "mpimcu.h"
 
 #include <iostream>
 #include <cstdint>
 #include <unordered_map>
+#include <map>
 #include <deque>
+#include <vector>
+#include <tuple>
 #include <cassert>
 #include <cstdlib>
 #include <cstdio>
 #include <string>
+#include <algorithm>
+#include <atomic>
 
 #include <limits.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <math.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stddef.h>
+#include <time.h>
 
 class mmcu_memory_op_entry {
 public:
     // Memory opteration ID.
     uint8_t opid;
+    // MPI call during which the operation happened (MMCU_MPI_CALL_*).
+    uint8_t mpi_call_id = MMCU_MPI_CALL_NONE;
+    // Number of allocations this one stands for. Greater than 1 only for
+    // sampled allocations (see MMCU_SAMPLE_BYTES).
+    float sample_weight = 1.0f;
     // Address associated with memory operation.
     uintptr_t addr;
     // If applicable, size associated with memory operation. Singed size_t
@@ -36,6 +62,12 @@ public:
     // If applicable, 'old' address associated with memory operation. Mostly for
     // things like realloc.
     uintptr_t old_addr;
+    // If applicable, usable size of the allocation (malloc_usable_size).
+    size_t usable_size = 0;
+    // If applicable, return address of the allocation call.
+    uintptr_t callsite = 0;
+    // If applicable, time at which the allocation or mapping was captured.
+    double captured_at = 0.0;
 
     /**
      *
@@ -49,6 +81,322 @@ public:
       , addr(addr)
       , size(size)
       , old_addr(old_addr) { }
+
+    /**
+     * Returns the estimated number of bytes this operation stands for.
+     */
+    ssize_t
+    est_size(void) const {
+        if (sample_weight == 1.0f) return size;
+        return ssize_t(double(size) * double(sample_weight));
+    }
+
+    /**
+     * Returns the variance that est_size() adds to an estimated total. With
+     * P(sampled) = 1 / w, that is size^2 * (1 - p) / p^2.
+     */
+    double
+    est_size_var(void) const {
+        const double w = sample_weight;
+        return double(size) * double(size) * w * (w - 1.0);
+    }
+};
+
+/**
+ * Allocation totals for one MPI call or call site. Estimated when allocation
+ * sampling is enabled.
+ */
+class mmcu_alloc_stats {
+public:
+    // Number of recorded allocations.
+    uint64_t n_recorded = 0;
+    // Estimated number of allocations.
+    double n_allocs = 0.0;
+    // Estimated bytes allocated.
+    double alloc_b = 0.0;
+    // Variance of alloc_b. 0 when every allocation is recorded.
+    double alloc_var = 0.0;
+    // Estimated bytes currently live.
+    ssize_t live_b = 0;
+    //
+    ssize_t high_live_b = 0;
+    // live_b as of peak number peak_gen, saved by the first change after it.
+    // Copy-on-write, so new peaks cost nothing here.
+    uint64_t peak_gen = 0;
+    //
+    ssize_t peak_live_b = 0;
+
+    /**
+     * Saves live_b if this is the first change since the given peak.
+     */
+    void
+    save_peak(
+        uint64_t gen
+    ) {
+        if (peak_gen == gen) return;
+        peak_gen = gen;
+        peak_live_b = live_b;
+    }
+
+    /**
+     * Returns live_b as of the given peak, which must be the latest one.
+     */
+    ssize_t
+    get_peak_live_b(
+        uint64_t gen
+    ) const {
+        return peak_gen == gen ? peak_live_b : live_b;
+    }
+
+    /**
+     * gen is the number of the latest peak.
+     */
+    void
+    add_alloc(
+        const mmcu_memory_op_entry *ope,
+        uint64_t gen
+    ) {
+        save_peak(gen);
+        const ssize_t est_b = ope->est_size();
+        n_recorded++;
+        n_allocs += ope->sample_weight;
+        alloc_b += double(est_b);
+        alloc_var += ope->est_size_var();
+        live_b += est_b;
+        if (live_b > high_live_b) high_live_b = live_b;
+    }
+
+    /**
+     *
+     */
+    void
+    add_free(
+        const mmcu_memory_op_entry *ope,
+        uint64_t gen
+    ) {
+        save_peak(gen);
+        live_b -= ope->est_size();
+    }
+
+    /**
+     *
+     */
+    void
+    merge(
+        const mmcu_alloc_stats &that
+    ) {
+        n_recorded += that.n_recorded;
+        n_allocs += that.n_allocs;
+        alloc_b += that.alloc_b;
+        alloc_var += that.alloc_var;
+        live_b += that.live_b;
+    }
+};
+
+/**
+ * Heap allocations still live at MPI_Finalize for one group (e.g., an MPI
+ * call or module). Estimated when allocation sampling is enabled.
+ */
+class mmcu_leak_stats {
+public:
+    // Number of recorded allocations.
+    uint64_t n_recorded = 0;
+    // Estimated number of allocations.
+    double n_allocs = 0.0;
+    // Estimated bytes.
+    ssize_t live_b = 0;
+    // Capture time of the oldest allocation.
+    double oldest_at = 0.0;
+
+    /**
+     *
+     */
+    void
+    add(
+        const mmcu_memory_op_entry *ope
+    ) {
+        if (n_recorded == 0 || ope->captured_at < oldest_at) {
+            oldest_at = ope->captured_at;
+        }
+        n_recorded++;
+        n_allocs += ope->sample_weight;
+        live_b += ope->est_size();
+    }
+
+    /**
+     *
+     */
+    void
+    merge(
+        const mmcu_leak_stats &that
+    ) {
+        if (that.n_recorded == 0) return;
+        if (n_recorded == 0 || that.oldest_at < oldest_at) {
+            oldest_at = that.oldest_at;
+        }
+        n_recorded += that.n_recorded;
+        n_allocs += that.n_allocs;
+        live_b += that.live_b;
+    }
+};
+
+/**
+ * Fixed-size log2 histograms of heap allocation sizes and lifetimes for one
+ * MPI call. Counts are estimated when allocation sampling is enabled.
+ */
+class mmcu_alloc_histo {
+public:
+    //
+    static constexpr int n_bins = 48;
+    // Bin i counts allocations of (2^(i - 1), 2^i] B.
+    double size_counts[n_bins] = {};
+    // Bin i counts frees of allocations that lived (2^(i - 1), 2^i] us.
+    double lifetime_counts[n_bins] = {};
+
+    /**
+     * Returns the bin of the given value: ceil(log2(v)), clamped.
+     */
+    static int
+    get_bin(
+        uint64_t v
+    ) {
+        if (v <= 1) return 0;
+        const int b = 64 - __builtin_clzll(v - 1);
+        return b < n_bins ? b : n_bins - 1;
+    }
+
+    /**
+     *
+     */
+    void
+    add_alloc(
+        const mmcu_memory_op_entry *ope
+    ) {
+        size_counts[get_bin(uint64_t(ope->size))] += ope->sample_weight;
+    }
+
+    /**
+     * now is the time of the free.
+     */
+    void
+    add_free(
+        const mmcu_memory_op_entry *ope,
+        double now
+    ) {
+        const double lifetime_us = std::max(
+            0.0, (now - ope->captured_at) * 1e6
+        );
+        lifetime_counts[get_bin(uint64_t(lifetime_us))] += ope->sample_weight;
+    }
+};
+
+class mmcu_mmap_entry : public mmcu_memory_op_entry {
+public:
+    // Length of the mapping.
+    size_t map_len;
+    // How the region's resident size is determined (MMCU_RES_BACKEND_*).
+    uint8_t res_backend;
+    // Resident size (B) when the mapping was first captured.
+    size_t res_at_capture_b;
+    // Generation of the last operation that touched the region. Matches
+    // pss_gen while the cached size (see size) is current.
+    uint64_t mod_gen;
+    // Generation at which size was last read.
+    uint64_t pss_gen;
+    // Time at which size was last read.
+    double pss_read_at;
+    // Index of the shared-memory segment backing the region, or -1.
+    int32_t shm_seg_id;
+
+    /**
+     *
+     */
+    mmcu_mmap_entry(
+        uintptr_t addr,
+        size_t map_len,
+        uint8_t res_backend,
+        size_t res_b,
+        double now
+    ) : mmcu_memory_op_entry(MMCU_HOOK_MMAP_PSS_UPDATE, addr, res_b)
+      , map_len(map_len)
+      , res_backend(res_backend)
+      , res_at_capture_b(res_b)
+      , mod_gen(0)
+      , pss_gen(0)
+      , pss_read_at(now)
+      , shm_seg_id(-1) {
+        // When the mapping was first captured.
+        captured_at = now;
+    }
+
+    /**
+     *
+     */
+    uintptr_t
+    addr_end(void) const {
+        return addr + map_len;
+    }
+};
+
+/**
+ * A shared, file-backed mapping (e.g., a shared-memory transport segment in
+ * /dev/shm) as seen by this rank.
+ */
+class mmcu_shm_segment {
+public:
+    // Path to the backing file.
+    std::string path;
+    // Inode of the backing file.
+    uint64_t inode;
+    // Number of our tracked regions that currently map it.
+    size_t n_regions = 0;
+    // Bytes of it we currently map.
+    size_t mapped_b = 0;
+    //
+    size_t mapped_high_b = 0;
+    // Our current proportional share of its resident pages.
+    ssize_t pss_b = 0;
+    //
+    ssize_t pss_high_b = 0;
+
+    /**
+     *
+     */
+    mmcu_shm_segment(
+        const std::string &path,
+        uint64_t inode
+    ) : path(path)
+      , inode(inode) { }
+};
+
+/**
+ * A shared-memory segment as seen by all the ranks on a node. Each segment is
+ * counted once, no matter how many ranks map it.
+ */
+class mmcu_node_shm_segment {
+public:
+    // Path to the backing file.
+    std::string path;
+    // Inode of the backing file.
+    uint64_t inode;
+    // Number of ranks on the node that map it.
+    int n_ranks = 0;
+    // Largest extent mapped by any rank.
+    size_t size_b = 0;
+    // Resident bytes. PSS is split across mappers, so the sum over the
+    // node's ranks counts each resident page once.
+    ssize_t resident_b = 0;
+    // This rank's share of resident_b.
+    ssize_t rank_pss_b = 0;
+
+    /**
+     *
+     */
+    mmcu_node_shm_segment(
+        const std::string &path,
+        uint64_t inode
+    ) : path(path)
+      , inode(inode) { }
 };
 
 class mmcu_proc_smaps_entry {
@@ -61,6 +409,10 @@ public:
     size_t pss_in_b;
     // Whether or not the region permissions say it is shared.
     bool reg_shared;
+    // Whether or not the region is backed by a file (non-zero inode).
+    bool reg_file_backed;
+    // Inode of the backing file, if any.
+    uint64_t inode;
     // Path to backing store, if backed by a file.
     char path[PATH_MAX];
 
@@ -72,6 +424,8 @@ public:
         addr_end = 0;
         pss_in_b = 0;
         reg_shared = false;
+        reg_file_backed = false;
+        inode = 0;
         memset(path, '\0', sizeof(path));
     }
 
@@ -120,6 +474,46 @@ class mmcu_proc_smaps_parser {
         str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
     }
 
+    /**
+     * Returns whether or not the given line is a field line (e.g., 'Pss: 81
+     * kB') instead of the first line of an entry. Field names end in ':' and
+     * contain no spaces, while the first line of an entry starts with an
+     * address range.
+     */
+    static bool
+    is_field_line(
+        const char *lb
+    ) {
+        const char *colp = strchr(lb, ':');
+        const char *spp = strchr(lb, ' ');
+        return colp && (!spp || colp < spp);
+    }
+
+    /**
+     * Tokenizes the first line of an entry. Missing tokens (e.g., the path of
+     * an anonymous mapping) are returned as empty strings and trailing
+     * newlines are removed.
+     */
+    static void
+    tokenize_entry_line(
+        char *lb,
+        char toks[MMCU_PROC_MAPS_LAST][PATH_MAX]
+    ) {
+        static const uint8_t n_tok = MMCU_PROC_MAPS_LAST;
+        //
+        char *tokp = nullptr, *strp = lb;
+        for (uint8_t i = 0; i < n_tok; ++i) {
+            toks[i][0] = '\0';
+        }
+        for (uint8_t i = 0;
+             i < n_tok && (NULL != (tokp = strtok(strp, " \n")));
+             ++i
+        ) {
+            strp = nullptr;
+            strncpy(toks[i], tokp, PATH_MAX - 1);
+            toks[i][PATH_MAX - 1] = '\0';
+        }
+    }
 
 public:
 
@@ -132,8 +526,6 @@ public:
         mmcu_proc_smaps_entry &res_entry,
         bool &found_entry
     ) {
-        //
-        static const uint8_t n_tok = MMCU_PROC_MAPS_LAST;
         //
         found_entry = false;
         // First line format.
@@ -144,16 +536,11 @@ public:
         char cline_buff[2 * PATH_MAX];
         // Iterate over it one line at a time.
         while (fgets(cline_buff, sizeof(cline_buff) - 1, mapsf)) {
-            char *tokp = nullptr, *strp = cline_buff;
-            char toks[n_tok][PATH_MAX];
+            // Only the first line of an entry is of interest here.
+            if (is_field_line(cline_buff)) continue;
+            char toks[MMCU_PROC_MAPS_LAST][PATH_MAX];
             // Tokenize.
-            for (uint8_t i = 0;
-                 i < n_tok && (NULL != (tokp = strtok(strp, " ")));
-                 ++i
-            ) {
-                strp = nullptr;
-                strncpy(toks[i], tokp, sizeof(toks[i]) - 1);
-            }
+            tokenize_entry_line(cline_buff, toks);
             // Look for target address.
             uintptr_t addr_start = 0, addr_end = 0;
             get_addr_range(toks[MMCU_PROC_MAPS_ADDR], addr_start, addr_end);
@@ -166,6 +553,10 @@ public:
                 res_entry.reg_shared = entry_has_shared_perms(
                     toks[MMCU_PROC_MAPS_PERMS]
                 );
+                res_entry.inode = strtoull(
+                    toks[MMCU_PROC_MAPS_INODE], NULL, 10
+                );
+                res_entry.reg_file_backed = (res_entry.inode != 0);
                 // Stash path to file backing store only if shared.
                 if (res_entry.reg_shared) {
                     strncpy(
@@ -204,8 +595,9 @@ public:
      *
      */
     static void
-    get_proc_self_smaps_pss_total(
-        ssize_t &pss_total_in_b
+    get_proc_self_smaps_field_totals(
+        const std::vector<std::string> &fields,
+        std::vector<ssize_t> &totals_in_b
     ) {
         /*
          ffffffffff600000-ffffffffff601000 r-xp 00000000 00:00 0                  [vsyscall]
@@ -228,60 +620,67 @@ public:
          Locked:                0 kB
          VmFlags: rd ex
          */
+        // Note: the set and order of fields varies across kernel versions, so
+        // fields are matched by name.
 
         FILE *smapsf = open_smaps();
 
-        ssize_t pss_sum = 0;
-        // Number of tokens for first line of smaps.
-        static const uint8_t n_tok = MMCU_PROC_MAPS_LAST;
+        const size_t n_fields = fields.size();
+        totals_in_b.assign(n_fields, 0);
+        //
+        bool add_to_tally = true;
 
         char lb[2 * PATH_MAX];
         // Iterate over it one line at a time.
         while (fgets(lb, sizeof(lb) - 1, smapsf)) {
-            bool add_pss_to_tally = true;
-            // Let's see if we should skip this entry.
-            char *tokp = nullptr, *strp = lb;
-            char toks[n_tok][PATH_MAX];
-            // Tokenize.
-            for (uint8_t i = 0;
-                 i < n_tok && (NULL != (tokp = strtok(strp, " ")));
-                 ++i
-            ) {
-                strp = nullptr;
-                strncpy(toks[i], tokp, sizeof(toks[i]) - 1);
+            if (is_field_line(lb)) {
+                if (!add_to_tally) continue;
+                //
+                const size_t key_len = size_t(strchr(lb, ':') - lb);
+                for (size_t i = 0; i < n_fields; ++i) {
+                    const std::string &f = fields[i];
+                    if (f.size() == key_len &&
+                        0 == memcmp(f.data(), lb, key_len)) {
+                        totals_in_b[i] += get_field_value_in_b(lb + key_len + 1);
+                        break;
+                    }
+                }
+                continue;
             }
+            // First line of a new entry. Let's see if we should skip it.
+            char toks[MMCU_PROC_MAPS_LAST][PATH_MAX];
+            // Tokenize.
+            tokenize_entry_line(lb, toks);
             // If you change the name of the trace library, update.
             // TODO add a more robust way of naming files we should skip.
             static const std::string skip_suffix("mpimcu-trace.so");
-            std::string path_str(
-                toks[MMCU_PROC_MAPS_PATH_NAME],
-                // Remove \n.
-                strlen(toks[MMCU_PROC_MAPS_PATH_NAME]) - 1
-            );
-            //
-            bool has_suffix = mmcu_proc_smaps_parser::has_suffix(
-                                  path_str,
-                                  skip_suffix
-            );
+            const std::string path_str(toks[MMCU_PROC_MAPS_PATH_NAME]);
             // Has suffix, so skip it.
-            if (has_suffix) {
-                add_pss_to_tally = false;
-            }
-            ssize_t cur_pss = 0;
-            get_pss(smapsf, cur_pss);
-            if (add_pss_to_tally) {
-                pss_sum += cur_pss;
-            }
-            // Skip rest.
-            uint8_t nskip = 15;
-            for (uint8_t i = 0; i < nskip && (fgets(lb, sizeof(lb) - 1, smapsf)); ++i) { }
+            add_to_tally = !mmcu_proc_smaps_parser::has_suffix(
+                               path_str,
+                               skip_suffix
+                           );
         }
         //
-        pss_total_in_b = pss_sum * 1024;
-        //
         fclose(smapsf);
     }
 
+    /**
+     * Returns the value of a field in bytes, given the text after its name
+     * (e.g., '   81 kB'). Values without a kB unit are returned as is.
+     */
+    static ssize_t
+    get_field_value_in_b(
+        const char *val_str
+    ) {
+        char *endp = nullptr;
+        const ssize_t val = (ssize_t)strtoll(val_str, &endp, 10);
+        if (strstr(endp, "kB")) {
+            return val * 1024;
+        }
+        return val;
+    }
+
     /**
      *
      */
@@ -296,49 +695,60 @@ public:
          * Rss:                 256 kB
          * Pss:                  81 kB
          */
-        // Number of lines to ignore before we get to the PSS entry.
-        static const uint8_t ni = 2;
-        static const uint8_t n_tok = 3;
         static const char *errmsg = "ERROR: Invalid /proc/self/smaps format";
         char lb[2 * PATH_MAX];
-        // Skip Size and Rss lines.
-        for (uint8_t i = 0; i < ni && (fgets(lb, sizeof(lb) - 1, mapsf)); ++i) { }
-        // Grab PSS entry.
-        char *gets = fgets(lb, sizeof(lb) - 1, mapsf);
-        if (!gets) {
-            fprintf(stderr, "%s (%s)\n", errmsg, "PSS entry not found");
-            exit(EXIT_FAILURE);
+        // Scan the rest of the entry for its PSS field.
+        while (fgets(lb, sizeof(lb) - 1, mapsf)) {
+            if (!is_field_line(lb)) break;
+            if (0 == strncmp("Pss:", lb, 4)) {
+                get_field_value_in_kb(lb, pss_val);
+                return;
+            }
         }
+        fprintf(stderr, "%s (%s)\n", errmsg, "PSS entry not found");
+        exit(EXIT_FAILURE);
+    }
+
+    /**
+     *
+     */
+    static void
+    get_field_value_in_kb(
+        char *lb,
+        ssize_t &val
+    ) {
+        /**
+         * Format
+         * Pss:                  81 kB
+         */
+        static const uint8_t n_tok = 3;
+        static const char *errmsg = "ERROR: Invalid /proc/self/smaps format";
         char *tokp = nullptr, *strp = lb;
         // Tokenize.
-        char pss_tokens[n_tok][PATH_MAX];
+        char val_tokens[n_tok][128];
+        for (uint8_t i = 0; i < n_tok; ++i) {
+            val_tokens[i][0] = '\0';
+        }
         for (uint8_t i = 0;
-             i < n_tok && (NULL != (tokp = strtok(strp, " ")));
+             i < n_tok && (NULL != (tokp = strtok(strp, " \n")));
              ++i
         ) {
             strp = nullptr;
-            strncpy(pss_tokens[i], tokp, sizeof(pss_tokens[i]) - 1);
-        }
-        // Sanity (expecting Pss:).
-        static const char *ename = "Pss:";
-        if (strncmp(ename, pss_tokens[0], strlen(ename)) != 0) {
-            fprintf(
-                stderr,
-                "%s (%s). Got \'%s\'\n", errmsg,
-                "Invalid entry. Expecting \'Pss:\'",
-                pss_tokens[0]
-            );
-            exit(EXIT_FAILURE);
+            strncpy(val_tokens[i], tokp, sizeof(val_tokens[i]) - 1);
+            val_tokens[i][sizeof(val_tokens[i]) - 1] = '\0';
         }
         // Sanity (expecting kB).
         static const char *units = "kB";
-        if (strncmp(units, pss_tokens[2], strlen(units)) != 0) {
-            fprintf(stderr, "%s (%s)\n", errmsg, "PSS unit mismatch");
+        if (strncmp(units, val_tokens[2], strlen(units)) != 0) {
+            fprintf(
+                stderr, "%s (%s). Got \'%s\'\n", errmsg,
+                "Unit mismatch", val_tokens[0]
+            );
             exit(EXIT_FAILURE);
         }
         // Get the value.
         errno = 0;
-        pss_val = (ssize_t)strtoll(pss_tokens[1], NULL, 10);
+        val = (ssize_t)strtoll(val_tokens[1], NULL, 10);
         int err = errno;
         if (err != 0) {
             perror("strtoll");
@@ -393,418 +803,4477 @@ public:
     }
 };
 
-class mmcu_mem_stat_mgr {
-private:
-    // TODO expose these value as env vars. Make sure that they can't be less
-    // than about 16 (especially the PSS-related ones).
-    static constexpr uint64_t mem_allocd_sample_freq = 1;
-    static constexpr uint64_t mpi_pss_update_freq = 8;
-    static constexpr uint64_t pss_totals_sample_freq = 8;
-    //
-    uint64_t num_captures = 0;
-    //
-    uint64_t n_mem_ops_recorded = 0;
-    //
-    uint64_t n_mpi_pss_samples_requested = 0;
-    //
-    uint64_t n_mpi_pss_samples = 0;
-    //
-    uint64_t n_app_pss_samples = 0;
-    //
-    uint64_t n_mem_alloc_ops = 0;
-    //
-    uint64_t n_mem_free_ops = 0;
-    //
-    ssize_t current_mem_allocd = 0;
-    // MPI-only.
-    ssize_t mpi_high_mem_usage_mark = 0;
-    // MPI plus application.
-    ssize_t pss_high_mem_usage_mark = 0;
-    // Mapping between address and memory operation entries.
-    std::unordered_map<uintptr_t, mmcu_memory_op_entry *> addr2entry;
-    // Mapping between address and mmap/munmap operation entries.
-    std::unordered_map<uintptr_t, mmcu_memory_op_entry *> addr2mmap_entry;
-    // Array of collected memory allocated samples (MPI only).
-    std::deque< std::pair<double, ssize_t> > mem_allocd_samples;
-    // Array of summed PSS samples (total process memory usage).
-    std::deque< std::pair<double, ssize_t> > pss_total_samples;
-    //
-    mmcu_mem_stat_mgr(void) = default;
+/**
+ * Mirrors struct procmap_query from the Linux 6.11 UAPI (linux/fs.h), so we can
+ * build against older kernel headers. Kernel support is probed at runtime.
+ */
+struct mmcu_procmap_query_args {
+    uint64_t size;
+    uint64_t query_flags;
+    uint64_t query_addr;
+    uint64_t vma_start;
+    uint64_t vma_end;
+    uint64_t vma_flags;
+    uint64_t vma_page_size;
+    uint64_t vma_offset;
+    uint64_t inode;
+    uint32_t dev_major;
+    uint32_t dev_minor;
+    uint32_t vma_name_size;
+    uint32_t build_id_size;
+    uint64_t vma_name_addr;
+    uint64_t build_id_addr;
+};
+
+class mmcu_procmap_query {
     //
-    ~mmcu_mem_stat_mgr(void)
-    {
-        // Leaky, but at least we won't crash at exit.
+    enum {
+        MMCU_PROCMAP_QUERY_VMA_SHARED = 0x08
+    };
+
+    /**
+     * The /proc/self/maps file descriptor used for all queries.
+     */
+    static int &
+    maps_fd(void) {
+        static int fd = -1;
+        return fd;
     }
-    //
-    mmcu_mem_stat_mgr(const mmcu_mem_stat_mgr &that) = delete;
-    //
-    mmcu_mem_stat_mgr &
-    operator=(const mmcu_mem_stat_mgr &) = delete;
 
     /**
-     *
+     * Whether or not the running kernel supports PROCMAP_QUERY. Assumed true
+     * until shown otherwise.
      */
-    void
-    increment_num_captures(void) { ++num_captures; }
+    static bool &
+    supported(void) {
+        static bool is_supported = true;
+        return is_supported;
+    }
 
 public:
 
     /**
      *
      */
-    static mmcu_mem_stat_mgr *
-    the_mmcu_mem_stat_mgr(void);
+    static bool
+    available(void) {
+        if (!supported()) return false;
+        //
+        if (maps_fd() == -1) {
+            maps_fd() = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+            if (maps_fd() == -1) {
+                supported() = false;
+            }
+        }
+        return supported();
+    }
 
     /**
-     *
+     * Looks up the VMA covering target_addr without walking the whole address
+     * space. found_entry is false if no VMA covers target_addr or if the
+     * kernel does not support the query (see available()). PSS is not filled
+     * in.
      */
-    void
-    capture(
-        mmcu_memory_op_entry *const ope
+    static void
+    get_proc_self_vma_entry(
+        uintptr_t target_addr,
+        mmcu_proc_smaps_entry &res_entry,
+        bool &found_entry
     ) {
-        increment_num_captures();
+        // _IOWR('f', 17, struct procmap_query)
+        static const unsigned long procmap_query_req = _IOWR(
+            'f', 17, mmcu_procmap_query_args
+        );
         //
-        bool rm_ope = false;
+        found_entry = false;
+        if (!available()) return;
+        //
+        mmcu_procmap_query_args q;
+        memset(&q, 0, sizeof(q));
+        q.size = sizeof(q);
+        // No query flags: only a VMA that covers target_addr will do.
+        q.query_addr = target_addr;
+        q.vma_name_addr = uintptr_t(res_entry.path);
+        q.vma_name_size = sizeof(res_entry.path);
+        //
+        if (0 != ioctl(maps_fd(), procmap_query_req, &q)) {
+            // ENOENT means no VMA covers target_addr. Anything else means the
+            // query isn't supported, so don't try again.
+            if (errno != ENOENT) {
+                supported() = false;
+            }
+            return;
+        }
+        //
+        found_entry = true;
+        res_entry.addr_start = q.vma_start;
+        res_entry.addr_end = q.vma_end;
+        res_entry.reg_shared = (q.vma_flags & MMCU_PROCMAP_QUERY_VMA_SHARED);
+        res_entry.inode = q.inode;
+        res_entry.reg_file_backed = (q.inode != 0);
+        // Match the smaps parser: only keep the path if shared.
+        if (!res_entry.reg_shared) {
+            memset(res_entry.path, '\0', sizeof(res_entry.path));
+        }
+    }
+};
+
+class mmcu_mem_residency {
+    /**
+     * The /proc/self/pagemap file descriptor, or -1 if unavailable.
+     */
+    static int
+    pagemap_fd(void) {
+        static int fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+        return fd;
+    }
+
+public:
+    // How the resident size of a region is determined.
+    enum {
+        // Exact and cheap, but only meaningful while no page is shared (see
+        // get_unshared_resident_bytes()).
+        MMCU_RES_BACKEND_PAGEMAP = 0,
+        // Proportional share of shared pages, but requires reading smaps.
+        MMCU_RES_BACKEND_SMAPS
+    };
+
+    /**
+     * Returns the cheapest exact residency backend for a region.
+     */
+    static uint8_t
+    get_backend(
+        const mmcu_proc_smaps_entry &entry
+    ) {
+        // Pages of private anonymous regions are ours alone, so PSS == RSS,
+        // unless a fork() left them shared copy-on-write.
+        if (!entry.reg_shared && !entry.reg_file_backed) {
+            return MMCU_RES_BACKEND_PAGEMAP;
+        }
+        return MMCU_RES_BACKEND_SMAPS;
+    }
+
+    /**
+     * Returns the number of resident bytes in [addr, addr + len). Uses
+     * /proc/self/pagemap when readable and mincore(2) otherwise.
+     */
+    static size_t
+    get_resident_bytes(
+        uintptr_t addr,
+        size_t len
+    ) {
+        if (pagemap_fd() == -1) {
+            return get_resident_bytes_mincore(addr, len);
+        }
+        return get_resident_bytes_pagemap(addr, len, nullptr);
+    }
+
+    /**
+     * Sets resident_b to the number of resident bytes in [addr, addr + len),
+     * and returns whether that is also their PSS: whether /proc/self/pagemap
+     * marks every resident page as mapped by this process alone. Pages still
+     * shared copy-on-write after fork() are not, and neither is any page on
+     * kernels older than 4.2, which don't report it.
+     */
+    static bool
+    get_unshared_resident_bytes(
+        uintptr_t addr,
+        size_t len,
+        size_t &resident_b
+    ) {
+        resident_b = 0;
+        if (pagemap_fd() == -1) return false;
+        //
+        size_t n_shared = 0;
+        resident_b = get_resident_bytes_pagemap(addr, len, &n_shared);
+        return n_shared == 0;
+    }
+
+    /**
+     * Returns the number of resident bytes in [addr, addr + len) according to
+     * /proc/self/pagemap, which has one 64-bit entry per virtual page. If
+     * n_shared isn't null, also counts the resident pages there that aren't
+     * mapped by this process alone.
+     */
+    static size_t
+    get_resident_bytes_pagemap(
+        uintptr_t addr,
+        size_t len,
+        size_t *n_shared
+    ) {
+        static const uintptr_t pgsz = uintptr_t(sysconf(_SC_PAGESIZE));
+        // Bit 63: page present in RAM.
+        static const uint64_t pm_present = uint64_t(1) << 63;
+        // Bit 56: page exclusively mapped (since Linux 4.2).
+        static const uint64_t pm_exclusive = uint64_t(1) << 56;
+        // Read in chunks so the entries can live on the stack.
+        static const size_t max_pages = 2048;
+        uint64_t ents[max_pages];
+        //
+        const uintptr_t start = addr & ~(pgsz - 1);
+        const uintptr_t end = (addr + len + pgsz - 1) & ~(pgsz - 1);
+        size_t n_resident = 0;
+        for (uintptr_t cur = start; cur < end; ) {
+            const size_t n_pages = std::min(max_pages, size_t((end - cur) / pgsz));
+            const off_t off = off_t((cur / pgsz) * sizeof(uint64_t));
+            const ssize_t nr = pread(
+                pagemap_fd(), ents, n_pages * sizeof(uint64_t), off
+            );
+            if (nr <= 0) break;
+            //
+            const size_t n_read = size_t(nr) / sizeof(uint64_t);
+            for (size_t i = 0; i < n_read; ++i) {
+                if (!(ents[i] & pm_present)) continue;
+                n_resident++;
+                if (n_shared && !(ents[i] & pm_exclusive)) (*n_shared)++;
+            }
+            cur += n_read * pgsz;
+        }
+        return n_resident * pgsz;
+    }
+
+    /**
+     * Returns the number of resident bytes in [addr, addr + len) according to
+     * mincore(2).
+     */
+    static size_t
+    get_resident_bytes_mincore(
+        uintptr_t addr,
+        size_t len
+    ) {
+        static const uintptr_t pgsz = uintptr_t(sysconf(_SC_PAGESIZE));
+        // Query in chunks so the residency vector can live on the stack.
+        static const size_t max_pages = 4096;
+        unsigned char vec[max_pages];
+        //
+        const uintptr_t start = addr & ~(pgsz - 1);
+        const uintptr_t end = (addr + len + pgsz - 1) & ~(pgsz - 1);
+        size_t n_resident = 0;
+        for (uintptr_t cur = start; cur < end; ) {
+            const size_t n_pages = std::min(max_pages, size_t((end - cur) / pgsz));
+            // Range no longer (fully) mapped, so report what we have.
+            if (0 != mincore((void *)cur, n_pages * pgsz, vec)) break;
+            //
+            for (size_t i = 0; i < n_pages; ++i) {
+                n_resident += (vec[i] & 1);
+            }
+            cur += n_pages * pgsz;
+        }
+        return n_resident * pgsz;
+    }
+};
+
+/**
+ * Totals for one application phase (see mmcu_phase_push and MPI_Pcontrol).
+ * Entries of phases with the same name are combined. Nested phases count
+ * toward their enclosing ones.
+ */
+class mmcu_phase {
+public:
+    //
+    std::string name;
+    // Number of times the phase was entered.
+    uint64_t n_entries = 0;
+    // Time spent in the phase (s).
+    double time_s = 0.0;
+    // Highest MPI memory usage seen during the phase.
+    ssize_t mpi_high_b = 0;
+    // Highest sampled PSS seen during the phase.
+    ssize_t pss_high_b = 0;
+    // Change in MPI memory usage from entry to exit, summed over entries.
+    ssize_t mpi_growth_b = 0;
+    // Number of heap allocations and frees captured during the phase.
+    uint64_t n_allocs = 0;
+    //
+    uint64_t n_frees = 0;
+
+    /**
+     *
+     */
+    explicit mmcu_phase(
+        const std::string &name
+    ) : name(name) { }
+};
+
+/**
+ * An entered phase. Only the innermost one is updated by memory operations;
+ * its totals are added to the enclosing one when it is exited.
+ */
+struct mmcu_phase_frame {
+    // Index into the phase list.
+    uint16_t phase = 0;
+    // Whether or not the phase was entered using MPI_Pcontrol.
+    bool pcontrol = false;
+    //
+    double entered_at = 0.0;
+    // MPI memory usage on entry.
+    ssize_t entered_mpi_b = 0;
+    // Highest MPI memory usage and sampled PSS since entry.
+    ssize_t mpi_high_b = 0;
+    //
+    ssize_t pss_high_b = 0;
+    // Heap allocations and frees captured since entry.
+    uint64_t n_allocs = 0;
+    //
+    uint64_t n_frees = 0;
+};
+
+/**
+ * The peers (MPI_COMM_WORLD ranks) this rank has talked to point-to-point, and
+ * how much MPI memory grew during the calls that first contacted them.
+ * Transports often set up per-peer state on first contact.
+ */
+class mmcu_peer_stats {
+public:
+    // One bit per rank. Read without holding the hooks lock.
+    std::vector<uint64_t> contacted;
+    // Number of peers contacted.
+    uint64_t n_peers = 0;
+    // Sum of per-peer growth, and of its squares.
+    double growth_b = 0.0;
+    //
+    double growth_sq_b = 0.0;
+    // Per MPI call that made the first contact.
+    uint64_t n_peers_per_call[MMCU_MPI_CALL_LAST] = {};
+    //
+    ssize_t growth_per_call_b[MMCU_MPI_CALL_LAST] = {};
+
+    /**
+     *
+     */
+    bool
+    is_contacted(
+        int peer
+    ) const {
+        const uint64_t word = __atomic_load_n(
+                                  &contacted[size_t(peer) / 64],
+                                  __ATOMIC_RELAXED
+                              );
+        return (word >> (peer % 64)) & 1;
+    }
+
+    /**
+     * Returns whether the given peer was not contacted before.
+     */
+    bool
+    set_contacted(
+        int peer
+    ) {
+        const uint64_t bit = uint64_t(1) << (peer % 64);
+        return !(__atomic_fetch_or(
+                     &contacted[size_t(peer) / 64], bit, __ATOMIC_RELAXED
+                 ) & bit);
+    }
+
+    /**
+     * Returns the mean growth per peer.
+     */
+    double
+    get_mean_b(void) const {
+        return n_peers ? growth_b / double(n_peers) : 0.0;
+    }
+
+    /**
+     * Returns the variance of get_mean_b().
+     */
+    double
+    get_mean_var(void) const {
+        if (n_peers < 2) return 0.0;
+        const double n = double(n_peers);
+        const double mean = get_mean_b();
+        const double var = (growth_sq_b - n * mean * mean) / (n - 1.0);
+        return std::max(0.0, var) / n;
+    }
+};
+
+/**
+ * What calls of one MPI function with payloads of one size class allocated.
+ */
+class mmcu_payload_stats {
+public:
+    //
+    uint64_t n_calls = 0;
+    // Number of calls during which anything was allocated.
+    uint64_t n_allocating = 0;
+    // Total payload.
+    uint64_t payload_b = 0;
+    // Bytes allocated (heap and mmap) during the calls.
+    uint64_t alloc_b = 0;
+    // Net growth of MPI memory usage during the calls.
+    int64_t growth_b = 0;
+};
+
+/**
+ * A live derived datatype.
+ */
+struct mmcu_datatype_entry {
+    // When it was created.
+    double created_at;
+    // Bytes allocated (heap and mmap) while creating and committing it.
+    uint64_t alloc_b;
+    // Net growth of MPI memory usage while creating and committing it.
+    int64_t growth_b;
+    // MPI call that created it.
+    uint8_t mpi_call_id;
+    //
+    bool committed;
+};
+
+/**
+ * Incremental least-squares fit of a line to (x, y) points, in O(1) memory.
+ * Uses co-moments, so it is stable for large offsets.
+ */
+class mmcu_linear_fit {
+public:
+    //
+    uint64_t n = 0;
+    //
+    double mean_x = 0.0;
+    //
+    double mean_y = 0.0;
+    // Sums of squared deviations and of products of deviations.
+    double sxx = 0.0;
+    //
+    double sxy = 0.0;
+    //
+    double syy = 0.0;
+    // Range of x covered.
+    double first_x = 0.0;
+    //
+    double last_x = 0.0;
+
+    /**
+     *
+     */
+    void
+    add(
+        double x,
+        double y
+    ) {
+        if (n == 0) first_x = x;
+        last_x = x;
+        n++;
+        const double dx = x - mean_x;
+        const double dy = y - mean_y;
+        mean_x += dx / double(n);
+        mean_y += dy / double(n);
+        sxx += dx * (x - mean_x);
+        sxy += dx * (y - mean_y);
+        syy += dy * (y - mean_y);
+    }
+
+    /**
+     * Adds the points of the given fit, which must follow this one's.
+     */
+    void
+    merge(
+        const mmcu_linear_fit &that
+    ) {
+        if (that.n == 0) return;
+        if (n == 0) {
+            *this = that;
+            return;
+        }
+        const double na = double(n), nb = double(that.n);
+        const double nab = na + nb;
+        const double dx = that.mean_x - mean_x;
+        const double dy = that.mean_y - mean_y;
+        sxx += that.sxx + dx * dx * na * nb / nab;
+        sxy += that.sxy + dx * dy * na * nb / nab;
+        syy += that.syy + dy * dy * na * nb / nab;
+        mean_x += dx * nb / nab;
+        mean_y += dy * nb / nab;
+        n += that.n;
+        last_x = that.last_x;
+    }
+
+    /**
+     *
+     */
+    double
+    get_span(void) const {
+        return n ? last_x - first_x : 0.0;
+    }
+
+    /**
+     *
+     */
+    double
+    get_slope(void) const {
+        return sxx > 0.0 ? sxy / sxx : 0.0;
+    }
+
+    /**
+     * Returns the standard error of the slope, assuming independent
+     * residuals.
+     */
+    double
+    get_slope_stderr(void) const {
+        if (n < 3 || sxx <= 0.0) return 0.0;
+        const double rss = std::max(0.0, syy - get_slope() * sxy);
+        return sqrt(rss / double(n - 2) / sxx);
+    }
+};
+
+/**
+ * Watches a series for sustained growth. Fits a line over the whole series
+ * and over a sliding window of the recent past. The window is made of two
+ * half-window blocks, so it covers between one half and one window's worth of
+ * time.
+ */
+class mmcu_growth_detector {
+public:
+    // Over everything added.
+    mmcu_linear_fit all;
+    // Completed and current half-window blocks.
+    mmcu_linear_fit prev_block;
+    //
+    mmcu_linear_fit cur_block;
+    // Length (s) of growth that triggers a warning. 0 disables them.
+    double window_s = 0.0;
+    // Growth rates (B/s) below this don't trigger a warning.
+    double min_rate = 0.0;
+    // Whether the current episode of growth was warned about.
+    bool warned = false;
+    // Number of episodes of growth warned about.
+    uint64_t n_warnings = 0;
+
+    /**
+     * Adds a point (time in s, bytes). Returns true if sustained growth is
+     * newly detected, in which case the recent fit is given.
+     */
+    bool
+    add(
+        double t,
+        double y,
+        mmcu_linear_fit &recent,
+        double z
+    ) {
+        all.add(t, y);
+        if (window_s <= 0.0) return false;
+        //
+        cur_block.add(t, y);
+        if (cur_block.get_span() < window_s / 2.0) return false;
+        // Checked once per block, which is plenty at these time scales.
+        recent = prev_block;
+        recent.merge(cur_block);
+        prev_block = cur_block;
+        cur_block = mmcu_linear_fit();
+        //
+        const double slope = recent.get_slope();
+        const double lower = slope - z * recent.get_slope_stderr();
+        const bool growing = recent.get_span() >= window_s &&
+                             lower > 0.0 && slope >= min_rate;
+        if (!growing) {
+            warned = false;
+            return false;
+        }
+        if (warned) return false;
+        warned = true;
+        n_warnings++;
+        return true;
+    }
+};
+
+/**
+ * Current usage of all the ranks on a node, in memory they all map (see
+ * MPI_Init), for node-level alerts. Holds an alert flag followed by the MPI
+ * and whole-process usage of each rank.
+ */
+class mmcu_node_usage {
+public:
+    //
+    int64_t *shm = nullptr;
+    // Number of ranks on the node.
+    int n_ranks = 0;
+    // This rank's index on the node.
+    int local_rank = 0;
+
+    /**
+     * Returns the size of the shared memory for the given number of ranks.
+     */
+    static size_t
+    get_size(
+        int n_ranks
+    ) {
+        return sizeof(int64_t) * (1 + 2 * size_t(n_ranks));
+    }
+
+    /**
+     * Publishes this rank's usage and returns the node's totals.
+     */
+    void
+    update(
+        ssize_t mpi_b,
+        ssize_t pss_b,
+        ssize_t &node_mpi_b,
+        ssize_t &node_pss_b
+    ) {
+        int64_t *mine = &shm[1 + 2 * local_rank];
+        __atomic_store_n(&mine[0], int64_t(mpi_b), __ATOMIC_RELAXED);
+        __atomic_store_n(&mine[1], int64_t(pss_b), __ATOMIC_RELAXED);
+        //
+        node_mpi_b = node_pss_b = 0;
+        for (int i = 0; i < n_ranks; ++i) {
+            node_mpi_b += __atomic_load_n(&shm[1 + 2 * i], __ATOMIC_RELAXED);
+            node_pss_b += __atomic_load_n(&shm[2 + 2 * i], __ATOMIC_RELAXED);
+        }
+    }
+
+    /**
+     *
+     */
+    void
+    raise_alert(void) {
+        __atomic_store_n(&shm[0], int64_t(1), __ATOMIC_RELAXED);
+    }
+
+    /**
+     * Returns whether any rank on the node raised an alert.
+     */
+    bool
+    alert_raised(void) const {
+        return __atomic_load_n(&shm[0], __ATOMIC_RELAXED) != 0;
+    }
+};
+
+/**
+ * Samples of a series that may change at every MPI call, kept to a bounded
+ * number. When full, every other sample is dropped and from then on only every
+ * other one is kept, so that the samples still span the whole run.
+ */
+template <typename T>
+class mmcu_decimated_samples {
+    // Max number of samples kept. Even, so that halving keeps the stride.
+    size_t max_size;
+    //
+    std::vector<T> samples;
+    // Keep every stride-th sample offered.
+    uint64_t stride = 1;
+    // Number of samples offered so far.
+    uint64_t n_offered = 0;
+
+public:
+    /**
+     *
+     */
+    explicit mmcu_decimated_samples(
+        size_t max_size = 65536
+    ) : max_size(std::max<size_t>(2, max_size & ~size_t(1))) { }
+
+    /**
+     *
+     */
+    void
+    push_back(
+        const T &sample
+    ) {
+        const uint64_t i = n_offered++;
+        if (i % stride != 0) return;
+        if (samples.size() == max_size) {
+            // Samples were kept at multiples of stride: keep the even ones.
+            size_t n = 0;
+            for (size_t j = 0; j < samples.size(); j += 2) {
+                samples[n++] = samples[j];
+            }
+            samples.resize(n);
+            stride *= 2;
+            if (i % stride != 0) return;
+        }
+        samples.push_back(sample);
+    }
+
+    /**
+     * Returns how many offered samples each kept one stands for.
+     */
+    uint64_t
+    get_stride(void) const {
+        return stride;
+    }
+
+    /**
+     *
+     */
+    typename std::vector<T>::const_iterator
+    begin(void) const {
+        return samples.begin();
+    }
+
+    /**
+     *
+     */
+    typename std::vector<T>::const_iterator
+    end(void) const {
+        return samples.end();
+    }
+};
+
+/**
+ * Columnar sample store: one array per field, so capturing more fields
+ * doesn't add per-sample objects.
+ */
+class mmcu_sample_store {
+public:
+    // Field names.
+    std::vector<std::string> fields;
+    // Sample times.
+    std::vector<double> times;
+    // One array of sampled values (B) per field.
+    std::vector< std::vector<ssize_t> > cols;
+    // Highest sampled value (B) per field.
+    std::vector<ssize_t> high_marks;
+    // Application phase (index) of each sample.
+    std::vector<uint16_t> phases;
+
+    /**
+     *
+     */
+    void
+    set_fields(
+        const std::vector<std::string> &field_names
+    ) {
+        fields = field_names;
+        times.clear();
+        phases.clear();
+        cols.assign(fields.size(), std::vector<ssize_t>());
+        high_marks.assign(fields.size(), 0);
+    }
+
+    /**
+     *
+     */
+    void
+    push_back(
+        double time,
+        const std::vector<ssize_t> &vals,
+        uint16_t phase
+    ) {
+        times.push_back(time);
+        phases.push_back(phase);
+        for (size_t i = 0; i < cols.size(); ++i) {
+            cols[i].push_back(vals[i]);
+            if (vals[i] > high_marks[i]) {
+                high_marks[i] = vals[i];
+            }
+        }
+    }
+
+    /**
+     *
+     */
+    size_t
+    size(void) const {
+        return times.size();
+    }
+
+    /**
+     * Emits a '# Fields:' header followed by one line per sample.
+     */
+    void
+    emit(
+        FILE *outf,
+        const char *series_name,
+        mmcu_rt *rt
+    ) const {
+        fprintf(outf, "# Fields:");
+        for (auto &f : fields) {
+            fprintf(outf, " %s", f.c_str());
+        }
+        fprintf(outf, " Phase\n");
+        for (size_t i = 0; i < size(); ++i) {
+            fprintf(
+                outf, "%s %lf", series_name, rt->get_report_time(times[i])
+            );
+            for (auto &col : cols) {
+                fprintf(outf, " %zd", col[i]);
+            }
+            fprintf(outf, " %u\n", unsigned(phases[i]));
+        }
+    }
+};
+
+class mmcu_mem_stat_mgr {
+private:
+    // TODO expose these value as env vars. Make sure that they can't be less
+    // than about 16 (especially the PSS-related ones).
+    static constexpr uint64_t mem_allocd_sample_freq = 1;
+    static constexpr uint64_t mpi_pss_update_freq = 8;
+    // Operations between whole-process samples (MMCU_APP_SAMPLE_FREQ).
+    uint64_t pss_totals_sample_freq = 8;
+    //
+    uint64_t num_captures = 0;
+    //
+    uint64_t n_mem_ops_recorded = 0;
+    //
+    uint64_t n_mpi_pss_samples_requested = 0;
+    //
+    uint64_t n_mpi_pss_samples = 0;
+    //
+    uint64_t n_app_pss_samples = 0;
+    // Number of per-region PSS reads performed.
+    uint64_t n_mmap_pss_queries = 0;
+    // Number of per-region PSS reads avoided because the cached value was
+    // still current.
+    uint64_t n_mmap_pss_cache_hits = 0;
+    // Number of page-releasing madvise operations captured.
+    uint64_t n_mmap_madvise_ops = 0;
+    // Total bytes released from tracked mappings with madvise.
+    ssize_t mmap_madvise_released = 0;
+    // What the madvise being applied releases from each region it covers,
+    // measured before the pages are gone (see begin_madvise).
+    std::vector<std::pair<uintptr_t, ssize_t>> madvise_pending;
+    // Number of MADV_FREE operations captured.
+    uint64_t n_mmap_lazy_free_ops = 0;
+    // Total bytes of tracked mappings marked lazily freeable with MADV_FREE.
+    size_t mmap_lazy_free_b = 0;
+    // Bumped by every operation that touches a tracked mapping.
+    uint64_t mmap_gen = 0;
+    // Max age (s) of a cached per-region PSS value.
+    double pss_cache_max_age = 1.0;
+    // Regions younger than this (s) are always re-read, since that's when
+    // first-touch growth happens.
+    double pss_first_touch_window = 1.0;
+    //
+    uint64_t n_mem_alloc_ops = 0;
+    //
+    uint64_t n_mem_free_ops = 0;
+    // Like the above, but only heap operations (no mmap or munmap), for
+    // mmcu_usage_t.
+    uint64_t n_heap_alloc_ops = 0;
+    //
+    uint64_t n_heap_free_ops = 0;
+    // Number of operations on allocations made in header mode.
+    uint64_t n_tagged_ops = 0;
+    //
+    ssize_t current_mem_allocd = 0;
+    // MPI-only.
+    ssize_t mpi_high_mem_usage_mark = 0;
+    // Variance of current_mem_allocd, which is an estimate when allocations
+    // are sampled.
+    double current_mem_var = 0.0;
+    // Variance of mpi_high_mem_usage_mark.
+    double mpi_high_mem_usage_var = 0.0;
+    // z for two-sided 95% confidence intervals of sampled estimates.
+    static constexpr double sample_ci_z = 1.96;
+    // Per-MPI call heap allocation totals.
+    mmcu_alloc_stats mpi_call_stats[MMCU_MPI_CALL_LAST];
+    // Per-call site heap allocation totals.
+    std::unordered_map<uintptr_t, mmcu_alloc_stats> callsite_stats;
+    // Per-MPI call heap allocation size and lifetime histograms, keyed by the
+    // call during which the allocation was made.
+    mmcu_alloc_histo mpi_call_histos[MMCU_MPI_CALL_LAST];
+    // Number of power-of-two heap allocation size classes. The last one also
+    // holds everything bigger.
+    static constexpr int n_size_classes = mmcu_alloc_histo::n_bins;
+    // Per-size class heap allocation totals.
+    mmcu_alloc_stats size_class_stats[n_size_classes];
+    // Where outstanding allocations at MPI_Finalize come from: MPI_Init
+    // (often caches that are kept on purpose) or later growth.
+    static constexpr int n_leak_origins = 2;
+    // Heap allocations still live at MPI_Finalize, per origin.
+    struct mmcu_leak_report {
+        mmcu_leak_stats totals[n_leak_origins];
+        //
+        mmcu_leak_stats mpi_calls[n_leak_origins][MMCU_MPI_CALL_LAST];
+        //
+        mmcu_leak_stats size_classes[n_leak_origins][n_size_classes];
+        //
+        std::unordered_map<uintptr_t, mmcu_leak_stats> callsites[
+            n_leak_origins
+        ];
+    };
+    // Number of times mpi_high_mem_usage_mark was raised. The per-call,
+    // per-call site, and per-size class live bytes at the latest peak are
+    // recovered using it (see mmcu_alloc_stats::save_peak).
+    uint64_t mpi_peak_gen = 0;
+    // When mpi_high_mem_usage_mark was last raised.
+    double mpi_peak_time = 0.0;
+    // Heap and mmap shares of mpi_high_mem_usage_mark.
+    ssize_t mpi_peak_heap_b = 0;
+    //
+    ssize_t mpi_peak_mmap_b = 0;
+    // smaps field totals at pss_high_mem_usage_mark.
+    std::vector<ssize_t> pss_peak_smaps_vals;
+    // When pss_high_mem_usage_mark was last raised.
+    double pss_peak_time = 0.0;
+    // Application phases. Phase 0 covers everything outside of the others.
+    std::vector<mmcu_phase> phases;
+    // Maps phase names to indices into phases.
+    std::map<std::string, uint16_t> phase_ids;
+    // Entered phases. The bottom one is phase 0 and is never exited.
+    std::vector<mmcu_phase_frame> phase_stack;
+    // Innermost entered phase.
+    uint16_t cur_phase = 0;
+    // Usage published for mmcu_usage_get() until the telemetry page, if
+    // any, takes over.
+    mmcu_usage_block_t usage_local;
+    // Where usage is published.
+    std::atomic<mmcu_usage_block_t *> usage_block;
+    // Live telemetry page (MMCU_TELEMETRY), or nullptr.
+    mmcu_telemetry_page_t *telemetry = nullptr;
+    // Path of the telemetry page.
+    std::string telemetry_path;
+    // Number of snapshots requested so far. Bumped by signal handlers, so
+    // nothing else may be done on the requesting side.
+    std::atomic<uint32_t> n_snapshots_requested;
+    // Value of n_snapshots_requested as of the last snapshot written.
+    uint32_t n_snapshots_handled = 0;
+    // Number of snapshots written so far. Names the next one.
+    uint32_t n_snapshots_written = 0;
+    // Max number of recent samples of each kind in a snapshot.
+    uint64_t snapshot_n_samples = 100;
+    // Alert thresholds (MMCU_ALERT_*). 0 if disabled or already crossed.
+    ssize_t alert_mpi_b = 0;
+    //
+    ssize_t alert_pss_b = 0;
+    //
+    ssize_t alert_node_mpi_b = 0;
+    //
+    ssize_t alert_node_pss_b = 0;
+    // Whether crossing a threshold aborts the job (MMCU_ALERT_ABORT).
+    bool alert_abort = false;
+    // Set once a threshold that aborts the job has been crossed. Read without
+    // the hooks lock.
+    std::atomic<bool> abort_pending{false};
+    // Usage of the ranks on this node, if node-level alerts are enabled.
+    mmcu_node_usage node_usage;
+    // Whether this rank has written its node-level alert snapshot.
+    bool node_alert_handled = false;
+    // Point-to-point peers.
+    mmcu_peer_stats peers;
+    // Bytes allocated (heap and mmap) by MPI so far. Read without holding the
+    // hooks lock.
+    uint64_t total_allocd_b = 0;
+    // Per MPI call and payload size class.
+    mmcu_payload_stats payload_stats[MMCU_MPI_CALL_LAST][n_size_classes];
+    // Live derived datatypes, keyed by handle.
+    std::unordered_map<uint64_t, mmcu_datatype_entry> datatypes;
+    // Per MPI call that created them.
+    uint64_t n_datatypes_created[MMCU_MPI_CALL_LAST] = {};
+    //
+    uint64_t n_datatypes_freed[MMCU_MPI_CALL_LAST] = {};
+    // Bytes allocated while creating and committing them.
+    uint64_t datatype_alloc_b[MMCU_MPI_CALL_LAST] = {};
+    // Net growth of MPI memory usage held by live derived datatypes.
+    int64_t datatypes_live_b = 0;
+    //
+    uint64_t datatypes_high_mark = 0;
+    // (time, live derived datatypes, their growth) samples, taken whenever
+    // either changes.
+    mmcu_decimated_samples< std::tuple<double, uint64_t, int64_t> >
+        datatype_samples;
+    // Outstanding nonblocking point-to-point requests.
+    mmcu_request_table requests;
+    // Per MPI call that created them.
+    uint64_t n_requests_created[MMCU_MPI_CALL_LAST] = {};
+    //
+    uint64_t n_requests_completed[MMCU_MPI_CALL_LAST] = {};
+    // Total lifetime (s) of the completed ones.
+    double request_lifetime_s[MMCU_MPI_CALL_LAST] = {};
+    // Highest number of outstanding requests.
+    uint64_t requests_high_mark = 0;
+    // Number of tracked requests whose handle was handed out again, so they
+    // were completed by a call that isn't wrapped.
+    uint64_t n_requests_reused = 0;
+    // Fit of MPI memory usage to the number of outstanding requests.
+    mmcu_linear_fit request_fit;
+    // (time, outstanding requests, MPI memory usage) samples, taken whenever
+    // the number of outstanding requests changes.
+    mmcu_decimated_samples< std::tuple<double, uint64_t, ssize_t> >
+        request_samples;
+    // Sustained MPI memory growth after MPI_Init.
+    mmcu_growth_detector growth;
+    // Min time (s) between the MPI memory samples fed to it.
+    double growth_sample_period = 1.0;
+    // When it was last fed.
+    double growth_last_time = 0.0;
+    // MPI memory usage at pss_high_mem_usage_mark.
+    ssize_t pss_peak_mpi_b = 0;
+    // MPI plus application.
+    ssize_t pss_high_mem_usage_mark = 0;
+    // Mapped length of all tracked MPI mmaps.
+    ssize_t current_mmap_mapped = 0;
+    // Resident size (PSS) of all tracked MPI mmaps.
+    ssize_t current_mmap_resident = 0;
+    //
+    ssize_t mmap_mapped_high_mark = 0;
+    //
+    ssize_t mmap_resident_high_mark = 0;
+    // Mapping between address and memory operation entries.
+    std::unordered_map<uintptr_t, mmcu_memory_op_entry *> addr2entry;
+    // Addresses in addr2entry, for lock-free rejection of other frees.
+    mmcu_addr_filter addr2entry_filter;
+    // Mapping between start address and mmap entries. Ordered so that the
+    // entries overlapping a given address range can be found.
+    std::map<uintptr_t, mmcu_mmap_entry *> addr2mmap_entry;
+    // Array of collected memory allocated samples (MPI only).
+    // Time, MPI memory usage, and application phase.
+    std::deque< std::tuple<double, ssize_t, uint16_t> > mem_allocd_samples;
+    // Summed smaps field samples (total process memory usage).
+    mmcu_sample_store smaps_samples;
+    // Captured when MMCU_SMAPS_FIELDS is not set.
+    static constexpr const char *smaps_default_fields =
+        "Rss,Pss,Private_Dirty,Shared_Dirty,AnonHugePages,Swap,SwapPss";
+    // Index of Pss in smaps_samples. Always captured.
+    size_t smaps_pss_col = 0;
+    // Scratch space for a single smaps sample.
+    std::vector<ssize_t> smaps_sample_vals;
+    // (time, mapped, resident) samples of tracked MPI mmaps, so first-touch
+    // growth is visible next to mapped length.
+    mmcu_decimated_samples< std::tuple<double, ssize_t, ssize_t> >
+        mmap_usage_samples;
+    // Shared, file-backed segments mapped by the MPI library.
+    std::vector<mmcu_shm_segment> shm_segments;
+    // Mapping between (backing path, inode) and index into shm_segments.
+    std::map<std::pair<std::string, uint64_t>, int32_t> shm_seg_ids;
+    // Node-level view of shared-memory segments (see set_node_shm_segments).
+    std::vector<mmcu_node_shm_segment> node_shm_segments;
+    // Requested bytes of live MPI heap allocations.
+    ssize_t current_malloc_requested = 0;
+    // Usable bytes of live MPI heap allocations (requested plus slack).
+    ssize_t current_malloc_usable = 0;
+    //
+    uint64_t n_memalign_ops = 0;
+    // Usable minus requested bytes over all posix_memalign allocations.
+    size_t memalign_slack = 0;
+    // MPI heap usage next to process-wide allocator state, sampled alongside
+    // the smaps totals.
+    mmcu_sample_store malloc_samples;
+    // Scratch space for a single allocator sample.
+    std::vector<ssize_t> malloc_sample_vals;
+    // Resident bytes of the pages backing live MPI heap allocations, as of
+    // the last forced sample.
+    size_t malloc_resident = 0;
+    // Whether NUMA placement is sampled (MMCU_NUMA).
+    bool numa_enabled = false;
+    // Per-node resident bytes of tracked MPI mmaps and of the whole process,
+    // sampled alongside the smaps totals.
+    mmcu_sample_store numa_samples;
+    // Scratch space for a single NUMA sample.
+    std::vector<ssize_t> numa_sample_vals;
+    // Highest sampled fraction of resident MPI mmap memory on a node other
+    // than the one the rank was running on.
+    double numa_remote_mpi_high_frac = 0.0;
+    //
+    mmcu_mem_stat_mgr(void)
+    {
+        pss_cache_max_age = mmcu_rt::get_env_double(
+            "MMCU_PSS_CACHE_MAX_AGE", pss_cache_max_age
+        );
+        pss_first_touch_window = mmcu_rt::get_env_double(
+            "MMCU_PSS_FIRST_TOUCH_WINDOW", pss_first_touch_window
+        );
+        // Every sample walks smaps, so don't allow going below the default.
+        pss_totals_sample_freq = std::max(
+            pss_totals_sample_freq,
+            mmcu_rt::get_env_uint64(
+                "MMCU_APP_SAMPLE_FREQ", pss_totals_sample_freq
+            )
+        );
+        set_smaps_fields(getenv("MMCU_SMAPS_FIELDS"));
+        push_phase("Main", false);
+        memset(&usage_local, 0, sizeof(usage_local));
+        usage_local.usage.version = MMCU_USAGE_VERSION;
+        usage_local.usage.n_mpi_calls = MMCU_MPI_CALL_LAST;
+        usage_block.store(&usage_local, std::memory_order_release);
+        growth.window_s = mmcu_rt::get_env_double(
+            "MMCU_GROWTH_WARN_DURATION", 3600.0
+        );
+        growth.min_rate = mmcu_rt::get_env_double(
+            "MMCU_GROWTH_WARN_RATE", 1024.0 * 1024.0
+        ) / 3600.0;
+        growth_sample_period = mmcu_rt::get_env_double(
+            "MMCU_GROWTH_SAMPLE_PERIOD", growth_sample_period
+        );
+        n_snapshots_requested.store(0, std::memory_order_relaxed);
+        snapshot_n_samples = mmcu_rt::get_env_uint64(
+            "MMCU_SNAPSHOT_SAMPLES", snapshot_n_samples
+        );
+        malloc_samples.set_fields(
+            {"Requested", "Usable", "Arena", "Arena_In_Use", "Arena_Free"}
+        );
+        numa_enabled = mmcu_rt::get_env_uint64("MMCU_NUMA", 0) != 0;
+        if (numa_enabled) {
+            set_numa_fields();
+        }
+    }
+    //
+    ~mmcu_mem_stat_mgr(void)
+    {
+        // Leaky, but at least we won't crash at exit.
+    }
+    //
+    mmcu_mem_stat_mgr(const mmcu_mem_stat_mgr &that) = delete;
+    //
+    mmcu_mem_stat_mgr &
+    operator=(const mmcu_mem_stat_mgr &) = delete;
+
+    /**
+     *
+     */
+    void
+    increment_num_captures(void) { ++num_captures; }
+
+public:
+
+    /**
+     *
+     */
+    static mmcu_mem_stat_mgr *
+    the_mmcu_mem_stat_mgr(void);
+
+    /**
+     * Like the_mmcu_mem_stat_mgr(), but returns nullptr instead of creating
+     * it. Safe to call from any thread without holding the hooks lock.
+     */
+    static mmcu_mem_stat_mgr *
+    the_mmcu_mem_stat_mgr_if_created(void);
+
+    /**
+     * Copies the latest published usage to the given one. Never blocks the
+     * writer, so safe to call without holding the hooks lock. Retries while
+     * an update is in flight.
+     */
+    void
+    get_usage(
+        mmcu_usage_t *usage
+    ) const {
+        const mmcu_usage_block_t *b =
+            usage_block.load(std::memory_order_acquire);
+        (void)mmcu_seqlock_read(
+            &b->seq,
+            reinterpret_cast<uint64_t *>(usage),
+            reinterpret_cast<const uint64_t *>(&b->usage),
+            usage_nwords
+        );
+    }
+
+    /**
+     * Returns the latest published MPI memory usage (mmcu_usage_t::mpi_b). A
+     * single word, so unlike get_usage() it never retries.
+     */
+    int64_t
+    get_mpi_b(void) const {
+        const mmcu_usage_block_t *b =
+            usage_block.load(std::memory_order_acquire);
+        return __atomic_load_n(&b->usage.mpi_b, __ATOMIC_RELAXED);
+    }
+
+    /**
+     * Creates this rank's live telemetry page, if enabled. From then on,
+     * usage is published there.
+     */
+    void
+    open_telemetry(
+        mmcu_rt *rt
+    ) {
+        if (mmcu_rt::get_env_uint64("MMCU_TELEMETRY", 0) == 0) return;
+        //
+        const char *dir = getenv("MMCU_TELEMETRY_PATH");
+        if (!dir) dir = "/dev/shm";
+        telemetry_path = std::string(dir) + "/" + MMCU_TELEMETRY_PREFIX +
+                         std::to_string(getpid());
+        // Readers only ever see complete headers.
+        const std::string tmp_path = telemetry_path + ".tmp";
+        const size_t size = sizeof(mmcu_telemetry_page_t);
+        //
+        const int fd = open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+            fprintf(
+                stderr,
+                "(pid: %d) WARNING: cannot create telemetry page %s: %s\n",
+                (int)getpid(), tmp_path.c_str(), strerror(errno)
+            );
+            return;
+        }
+        void *addr = MAP_FAILED;
+        if (ftruncate(fd, off_t(size)) == 0) {
+            addr = mmap(
+                nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0
+            );
+        }
+        const int map_errno = errno;
+        close(fd);
+        if (addr == MAP_FAILED) {
+            fprintf(
+                stderr,
+                "(pid: %d) WARNING: cannot map telemetry page %s: %s\n",
+                (int)getpid(), tmp_path.c_str(), strerror(map_errno)
+            );
+            (void)unlink(tmp_path.c_str());
+            return;
+        }
+        //
+        mmcu_telemetry_page_t *page =
+            static_cast<mmcu_telemetry_page_t *>(addr);
+        memset(page, 0, size);
+        page->magic = MMCU_TELEMETRY_MAGIC;
+        page->version = MMCU_TELEMETRY_VERSION;
+        page->size = uint32_t(size);
+        page->pid = int32_t(getpid());
+        page->rank = int32_t(rt->rank);
+        page->numpe = int32_t(rt->numpe);
+        struct timespec wall;
+        clock_gettime(CLOCK_REALTIME, &wall);
+        page->init_wall_time = double(wall.tv_sec) + double(wall.tv_nsec) / 1e9 -
+                               (mmcu_time() - rt->get_init_begin_time());
+        page->init_mono_time = rt->get_init_begin_time();
+        snprintf(
+            page->app_name, sizeof(page->app_name), "%s",
+            rt->get_app_name().c_str()
+        );
+        page->usage_block.usage = usage_local.usage;
+        page->live.state = MMCU_TELEMETRY_STATE_RUNNING;
+        snprintf(
+            page->live.phase_name, sizeof(page->live.phase_name), "%s",
+            phases[cur_phase].name.c_str()
+        );
+        //
+        if (rename(tmp_path.c_str(), telemetry_path.c_str()) != 0) {
+            fprintf(
+                stderr,
+                "(pid: %d) WARNING: cannot publish telemetry page %s: %s\n",
+                (int)getpid(), telemetry_path.c_str(), strerror(errno)
+            );
+            (void)unlink(tmp_path.c_str());
+            munmap(addr, size);
+            return;
+        }
+        telemetry = page;
+        usage_block.store(&page->usage_block, std::memory_order_release);
+    }
+
+    /**
+     * Reads the alert thresholds (MMCU_ALERT_*), which are checked from here
+     * on.
+     */
+    void
+    arm_alerts(void) {
+        alert_mpi_b = ssize_t(mmcu_rt::get_env_uint64("MMCU_ALERT_BYTES", 0));
+        alert_pss_b = ssize_t(
+            mmcu_rt::get_env_uint64("MMCU_ALERT_PSS_BYTES", 0)
+        );
+        alert_node_mpi_b = ssize_t(
+            mmcu_rt::get_env_uint64("MMCU_ALERT_NODE_BYTES", 0)
+        );
+        alert_node_pss_b = ssize_t(
+            mmcu_rt::get_env_uint64("MMCU_ALERT_NODE_PSS_BYTES", 0)
+        );
+        alert_abort = mmcu_rt::get_env_uint64("MMCU_ALERT_ABORT", 0) != 0;
+        // The watermarks may already be past them.
+        if (alert_mpi_b != 0 && mpi_high_mem_usage_mark >= alert_mpi_b) {
+            raise_alert(
+                "MPI memory usage", mpi_high_mem_usage_mark,
+                "MMCU_ALERT_BYTES", alert_mpi_b
+            );
+            alert_mpi_b = 0;
+        }
+        if (alert_pss_b != 0 && pss_high_mem_usage_mark >= alert_pss_b) {
+            raise_alert(
+                "Application + MPI memory usage", pss_high_mem_usage_mark,
+                "MMCU_ALERT_PSS_BYTES", alert_pss_b
+            );
+            alert_pss_b = 0;
+        }
+    }
+
+    /**
+     * Returns whether node-level thresholds are set, in which case
+     * set_node_usage() must be called.
+     */
+    bool
+    node_alerts_armed(void) const {
+        return alert_node_mpi_b != 0 || alert_node_pss_b != 0;
+    }
+
+    /**
+     * Sets (or, given nullptr, unsets) where the usage of the ranks on this
+     * node is shared.
+     */
+    void
+    set_node_usage(
+        int64_t *shm,
+        int n_ranks,
+        int local_rank
+    ) {
+        node_usage.shm = shm;
+        node_usage.n_ranks = n_ranks;
+        node_usage.local_rank = local_rank;
+    }
+
+    /**
+     * Sizes the set of contacted peers. Call before any point-to-point call.
+     */
+    void
+    init_peers(
+        int numpe
+    ) {
+        peers.contacted.assign((size_t(numpe) + 63) / 64, 0);
+    }
+
+    /**
+     * Returns whether the given MPI_COMM_WORLD rank was already talked to.
+     * Safe to call without holding the hooks lock.
+     */
+    bool
+    peer_contacted(
+        int peer
+    ) const {
+        return peer < 0 || size_t(peer) / 64 >= peers.contacted.size() ||
+               peers.is_contacted(peer);
+    }
+
+    /**
+     * Records the growth of MPI memory during a call that may have been the
+     * first to contact the given peers. It is split evenly among the ones that
+     * weren't contacted before.
+     */
+    void
+    add_peer_contacts(
+        const int *contacted,
+        int n_contacted,
+        ssize_t growth_b,
+        uint8_t mpi_call_id
+    ) {
+        uint64_t n_new = 0;
+        for (int i = 0; i < n_contacted; ++i) {
+            if (peer_contacted(contacted[i])) continue;
+            n_new += peers.set_contacted(contacted[i]);
+        }
+        if (n_new == 0) return;
+        //
+        const double per_peer_b = double(growth_b) / double(n_new);
+        peers.n_peers += n_new;
+        peers.growth_b += double(growth_b);
+        peers.growth_sq_b += per_peer_b * per_peer_b * double(n_new);
+        peers.n_peers_per_call[mpi_call_id] += n_new;
+        peers.growth_per_call_b[mpi_call_id] += growth_b;
+    }
+
+    /**
+     * Returns the number of bytes allocated by MPI so far. Safe to call
+     * without holding the hooks lock.
+     */
+    uint64_t
+    get_total_allocd_b(void) const {
+        return __atomic_load_n(&total_allocd_b, __ATOMIC_RELAXED);
+    }
+
+    /**
+     * Records what a call with the given payload allocated, and how much MPI
+     * memory grew during it.
+     */
+    void
+    add_payload_sample(
+        uint8_t mpi_call_id,
+        uint64_t payload_b,
+        uint64_t alloc_b,
+        ssize_t growth_b
+    ) {
+        mmcu_payload_stats &ps =
+            payload_stats[mpi_call_id][get_size_class(payload_b)];
+        ps.n_calls++;
+        ps.n_allocating += (alloc_b != 0);
+        ps.payload_b += payload_b;
+        ps.alloc_b += alloc_b;
+        ps.growth_b += growth_b;
+    }
+
+    /**
+     * Records a derived datatype that was just created, and what was
+     * allocated and how much MPI memory grew while creating it.
+     */
+    void
+    add_datatype(
+        uint64_t key,
+        uint8_t mpi_call_id,
+        uint64_t alloc_b,
+        ssize_t growth_b
+    ) {
+        mmcu_datatype_entry entry;
+        entry.created_at = mmcu_time();
+        entry.alloc_b = alloc_b;
+        entry.growth_b = growth_b;
+        entry.mpi_call_id = mpi_call_id;
+        entry.committed = false;
+        // A handle freed by a call that isn't wrapped may be handed out again.
+        auto got = datatypes.find(key);
+        if (got != datatypes.end()) {
+            datatypes_live_b -= got->second.growth_b;
+            datatypes.erase(got);
+        }
+        datatypes.emplace(key, entry);
+        n_datatypes_created[mpi_call_id]++;
+        datatype_alloc_b[mpi_call_id] += alloc_b;
+        datatypes_live_b += growth_b;
+        datatypes_high_mark = std::max<uint64_t>(
+            datatypes_high_mark, datatypes.size()
+        );
+        add_datatype_sample(entry.created_at);
+    }
+
+    /**
+     * Records the commit of the derived datatype with the given handle.
+     * Datatypes that weren't recorded by add_datatype() are ignored.
+     */
+    void
+    commit_datatype(
+        uint64_t key,
+        uint64_t alloc_b,
+        ssize_t growth_b
+    ) {
+        auto got = datatypes.find(key);
+        if (got == datatypes.end()) return;
+        //
+        mmcu_datatype_entry &entry = got->second;
+        entry.committed = true;
+        entry.alloc_b += alloc_b;
+        entry.growth_b += growth_b;
+        datatype_alloc_b[entry.mpi_call_id] += alloc_b;
+        datatypes_live_b += growth_b;
+        add_datatype_sample(mmcu_time());
+    }
+
+    /**
+     * Records the freeing of the derived datatype with the given handle.
+     * Datatypes that weren't recorded by add_datatype() are ignored.
+     */
+    void
+    free_datatype(
+        uint64_t key
+    ) {
+        auto got = datatypes.find(key);
+        if (got == datatypes.end()) return;
+        //
+        n_datatypes_freed[got->second.mpi_call_id]++;
+        datatypes_live_b -= got->second.growth_b;
+        datatypes.erase(got);
+        add_datatype_sample(mmcu_time());
+    }
+
+    /**
+     * Records a nonblocking point-to-point request that was just created.
+     */
+    void
+    add_request(
+        uint64_t key,
+        uint8_t mpi_call_id,
+        int peer,
+        int tag
+    ) {
+        mmcu_request_entry entry;
+        entry.key = key;
+        entry.created_at = mmcu_time();
+        entry.mpi_b = current_mem_allocd;
+        entry.peer = peer;
+        entry.tag = tag;
+        entry.mpi_call_id = mpi_call_id;
+        n_requests_created[mpi_call_id]++;
+        if (!requests.insert(entry)) {
+            n_requests_reused++;
+            return;
+        }
+        requests_high_mark = std::max<uint64_t>(
+            requests_high_mark, requests.size()
+        );
+        add_request_sample(entry.created_at);
+    }
+
+    /**
+     * Records the completion of the request with the given handle. Requests
+     * that weren't recorded by add_request() are ignored.
+     */
+    void
+    complete_request(
+        uint64_t key
+    ) {
+        mmcu_request_entry entry;
+        if (!requests.remove(key, entry)) return;
+        //
+        const double now = mmcu_time();
+        n_requests_completed[entry.mpi_call_id]++;
+        request_lifetime_s[entry.mpi_call_id] += now - entry.created_at;
+        add_request_sample(now);
+    }
+
+    /**
+     * Asks for a snapshot, which is written at the next safe point (see
+     * write_requested_snapshot). Async-signal-safe.
+     */
+    void
+    request_snapshot(void) {
+        n_snapshots_requested.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /**
+     * Returns whether or not a crossed alert threshold asked for the job to be
+     * aborted. Doesn't take the hooks lock.
+     */
+    bool
+    abort_requested(void) const {
+        return abort_pending.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Marks the telemetry page final and removes its name. It stays mapped,
+     * since it is still where usage is published.
+     */
+    void
+    close_telemetry(void) {
+        if (!telemetry) return;
+        //
+        mmcu_seqlock_write_begin(&telemetry->usage_block.seq);
+        mmcu_seqlock_store(
+            &telemetry->live.state, MMCU_TELEMETRY_STATE_FINALIZED
+        );
+        mmcu_seqlock_write_end(&telemetry->usage_block.seq);
+        (void)unlink(telemetry_path.c_str());
+    }
+
+    /**
+     *
+     */
+    void
+    capture(
+        mmcu_memory_op_entry *const ope
+    ) {
+        increment_num_captures();
+        //
+        bool rm_ope = false;
+        const uintptr_t addr = ope->addr;
+        const uint8_t opid = ope->opid;
+        // Deal with any special cases first.
+        switch (opid) {
+            // realloc is never directly handled.
+            case (MMCU_HOOK_REALLOC):
+                break_down_realloc(ope);
+                return;
+            // mmap requires some extra work to extract its 'real' usage. Note
+            // that this usage will change during the life of the application,
+            // so we need to periodically update mmap entries. We'll do that
+            // later for all captured mmaps. munmap also requires some special
+            // care because mmap captures are stored in a different container.
+            case (MMCU_HOOK_MMAP):
+            case (MMCU_HOOK_MUNMAP):
+            case (MMCU_HOOK_MREMAP):
+            case (MMCU_HOOK_MADVISE):
+                capture_mmap_ops(ope);
+                return;
+        }
+        // Failed allocation or nothing to do.
+        if (addr == 0 || opid == MMCU_HOOK_NOOP) {
+            delete ope;
+            return;
+        }
+        // Now deal with the entry.
+        auto got = addr2entry.find(addr);
+        // Free of something we never saw allocated (e.g., not sampled, or
+        // allocated outside of MPI), so there's nothing to account for.
+        if (got == addr2entry.end() && opid == MMCU_HOOK_FREE) {
+            delete ope;
+            return;
+        }
+        // New entry.
+        if (got == addr2entry.end()) {
+            // Only ask while the allocation is known to be live.
+            ope->usable_size = mmcu_malloc_stats::get_usable_size(addr);
+            addr2entry.insert(std::make_pair(addr, ope));
+            addr2entry_filter.insert(addr);
+        }
+        // Existing entry and free.
+        else if (opid == MMCU_HOOK_FREE) {
+            const mmcu_memory_op_entry *const alloc_ope = got->second;
+            ope->size = alloc_ope->size;
+            ope->usable_size = alloc_ope->usable_size;
+            ope->sample_weight = alloc_ope->sample_weight;
+            ope->mpi_call_id = alloc_ope->mpi_call_id;
+            ope->callsite = alloc_ope->callsite;
+            ope->captured_at = alloc_ope->captured_at;
+            rm_ope = true;
+        }
+        else {
+            static const ssize_t report_thresh = 1024 * 1024;
+            static ssize_t curious_b = 0;
+
+            curious_b += got->second->size;
+
+            if (curious_b >= report_thresh) {
+                fprintf(
+                    stderr,
+                    "(pid: %d) WARNING: "
+                    "Number of \'curious operations\' "
+                    "exceeded threshold of %zd B\n",
+                    (int)getpid(),
+                    report_thresh
+                );
+                curious_b = 0;
+            }
+            delete ope;
+            return;
+        }
+        //
+        update_current_mem_allocd(ope);
+        //
+        update_all_pss_entries();
+        //
+        if (rm_ope) {
+            delete got->second;
+            addr2entry.erase(got);
+            addr2entry_filter.remove(addr);
+            delete ope;
+        }
+    }
+
+    /**
+     * Returns false if the given address is definitely not a tracked heap
+     * allocation. Safe to call without holding the hooks lock.
+     */
+    bool
+    maybe_tracked(
+        uintptr_t addr
+    ) const {
+        return addr2entry_filter.maybe_contains(addr);
+    }
+
+    /**
+     * Accounts for an operation on an allocation made in header mode. The
+     * header carries everything a free needs, so nothing is stored and no
+     * lookup is done.
+     */
+    void
+    capture_tagged(
+        mmcu_memory_op_entry *const ope
+    ) {
+        increment_num_captures();
+        n_tagged_ops++;
+        //
+        update_current_mem_allocd(ope);
+        //
+        update_all_pss_entries();
+    }
+
+    /**
+     * Measures what a page-releasing madvise(2) (MADV_DONTNEED or MADV_REMOVE)
+     * of [addr, addr + len) releases from tracked regions. Called before the
+     * advice is applied, since the pages can't be measured once they are gone.
+     * Nothing is accounted for until the operation is captured, which only
+     * happens if it succeeds.
+     */
+    void
+    begin_madvise(
+        uintptr_t addr,
+        size_t len
+    ) {
+        const uintptr_t end = addr + len;
+        madvise_pending.clear();
+        //
+        auto it = addr2mmap_entry.upper_bound(addr);
+        if (it != addr2mmap_entry.begin()) --it;
+        for ( ; it != addr2mmap_entry.end() && it->first < end; ++it) {
+            const mmcu_mmap_entry *const e = it->second;
+            if (e->addr_end() <= addr) continue;
+            //
+            const uintptr_t ov_start = std::max(addr, e->addr);
+            const uintptr_t ov_end = std::min(end, e->addr_end());
+            ssize_t released = 0;
+            size_t resident_b = 0;
+            if (e->res_backend ==
+                mmcu_mem_residency::MMCU_RES_BACKEND_PAGEMAP &&
+                mmcu_mem_residency::get_unshared_resident_bytes(
+                    ov_start, ov_end - ov_start, resident_b
+                )) {
+                released = ssize_t(resident_b);
+            }
+            // No cheap exact answer, so assume pages are spread evenly.
+            else {
+                released = ssize_t(
+                    double(e->size) * double(ov_end - ov_start) /
+                    double(e->map_len)
+                );
+            }
+            released = std::min(released, e->size);
+            if (released <= 0) continue;
+            //
+            madvise_pending.push_back(std::make_pair(e->addr, released));
+        }
+    }
+
+    /**
+     * Accounts for a successful MADV_FREE of [addr, addr + len). The kernel
+     * only reclaims such pages under memory pressure, and until then they
+     * still count as resident, so nothing is released here. The regions are
+     * marked for re-query, which picks up whatever was reclaimed.
+     */
+    void
+    capture_lazy_free(
+        uintptr_t addr,
+        size_t len
+    ) {
+        increment_num_captures();
+        //
+        const uintptr_t end = addr + len;
+        invalidate_mmap_range(addr, len);
+        //
+        auto it = addr2mmap_entry.upper_bound(addr);
+        if (it != addr2mmap_entry.begin()) --it;
+        for ( ; it != addr2mmap_entry.end() && it->first < end; ++it) {
+            const mmcu_mmap_entry *const e = it->second;
+            if (e->addr_end() <= addr) continue;
+            mmap_lazy_free_b += std::min(end, e->addr_end()) -
+                                std::max(addr, e->addr);
+        }
+        n_mmap_lazy_free_ops++;
+    }
+
+    /**
+     * Enters the phase with the given name. A phase entered with MPI_Pcontrol
+     * ends the one entered by the previous MPI_Pcontrol call, if it is the
+     * innermost.
+     */
+    void
+    push_phase(
+        const char *name,
+        bool pcontrol
+    ) {
+        if (pcontrol && phase_stack.size() > 1 &&
+            phase_stack.back().pcontrol) {
+            pop_phase(true);
+        }
+        //
+        auto got = phase_ids.find(name);
+        if (got == phase_ids.end()) {
+            // Indices must fit in a sample's phase stamp.
+            if (phases.size() > UINT16_MAX) {
+                fprintf(
+                    stderr,
+                    "(pid: %d) WARNING: too many phases, ignoring '%s'\n",
+                    (int)getpid(), name
+                );
+                return;
+            }
+            got = phase_ids.insert(
+                      std::make_pair(name, uint16_t(phases.size()))
+                  ).first;
+            phases.push_back(mmcu_phase(name));
+        }
+        phases[got->second].n_entries++;
+        enter_phase_frame(got->second, pcontrol);
+    }
+
+    /**
+     * Exits the innermost phase. Only phases entered with MPI_Pcontrol are
+     * exited by it.
+     */
+    void
+    pop_phase(
+        bool pcontrol
+    ) {
+        if (phase_stack.size() <= 1) {
+            fprintf(
+                stderr,
+                "(pid: %d) WARNING: phase pop without a matching push\n",
+                (int)getpid()
+            );
+            return;
+        }
+        if (pcontrol && !phase_stack.back().pcontrol) return;
+        //
+        const mmcu_phase_frame frame = phase_stack.back();
+        phase_stack.pop_back();
+        close_phase_frame(frame, mmcu_time());
+        cur_phase = phase_stack.back().phase;
+        publish_telemetry_phase();
+    }
+
+    /**
+     * Returns the segments this rank currently maps, one per line, for
+     * exchange with the other ranks on the node.
+     */
+    std::string
+    pack_shm_segments(void) {
+        update_shm_segments();
+        //
+        std::string packed;
+        char lb[64];
+        for (auto &seg : shm_segments) {
+            if (seg.n_regions == 0) continue;
+            // The path goes last, since it may contain spaces.
+            snprintf(
+                lb, sizeof(lb), "%" PRIu64 " %zu %zd ",
+                seg.inode, seg.mapped_high_b, seg.pss_b
+            );
+            packed += lb + seg.path + "\n";
+        }
+        return packed;
+    }
+
+    /**
+     * Builds the node-level view of shared-memory segments from the
+     * concatenated output of pack_shm_segments() of every rank on the node.
+     */
+    void
+    set_node_shm_segments(
+        const std::string &node_packed
+    ) {
+        node_shm_segments.clear();
+        std::map<std::pair<std::string, uint64_t>, size_t> ids;
+        //
+        size_t pos = 0;
+        while (pos < node_packed.size()) {
+            size_t next = node_packed.find('\n', pos);
+            if (next == std::string::npos) next = node_packed.size();
+            const std::string line = node_packed.substr(pos, next - pos);
+            pos = next + 1;
+            //
+            uint64_t inode = 0;
+            size_t size_b = 0;
+            ssize_t pss_b = 0;
+            int path_off = 0;
+            if (3 != sscanf(
+                    line.c_str(), "%" SCNu64 " %zu %zd %n",
+                    &inode, &size_b, &pss_b, &path_off
+                )) continue;
+            //
+            const auto key = std::make_pair(line.substr(path_off), inode);
+            auto got = ids.find(key);
+            if (got == ids.end()) {
+                got = ids.insert(
+                          std::make_pair(key, node_shm_segments.size())
+                      ).first;
+                node_shm_segments.push_back(
+                    mmcu_node_shm_segment(key.first, inode)
+                );
+            }
+            mmcu_node_shm_segment &nseg = node_shm_segments[got->second];
+            nseg.n_ranks++;
+            nseg.size_b = std::max(nseg.size_b, size_b);
+            nseg.resident_b += pss_b;
+        }
+        //
+        for (auto &seg : shm_segments) {
+            if (seg.n_regions == 0) continue;
+            auto got = ids.find(std::make_pair(seg.path, seg.inode));
+            if (got == ids.end()) continue;
+            node_shm_segments[got->second].rank_pss_b = seg.pss_b;
+        }
+    }
+
+    /**
+     * Returns where reports and snapshots go, or nullptr if unknown.
+     */
+    static const char *
+    get_output_dir(void) {
+        const char *output_dir = getenv("MMCU_REPORT_OUTPUT_PATH");
+        // Not set, so output to pwd.
+        if (!output_dir) {
+            output_dir = getenv("PWD");
+        }
+        return output_dir;
+    }
+
+    /**
+     *
+     */
+    void
+    report(
+        mmcu_rt *rt,
+        bool emit_report
+    ) {
+        using namespace std;
+        //
+        setbuf(stdout, NULL);
+        //
+        if (rt->rank == 0) {
+            printf("\n#########################################################"
+                   "\n# MPI Memory Consumption Analysis Complete ##############"
+                   "\n#########################################################"
+                   "\n");
+        }
+        //
+        if (requests.size() != 0) {
+            fprintf(
+                stderr,
+                "(pid: %d) WARNING: %zu MPI request(s) never completed.\n",
+                (int)getpid(), requests.size()
+            );
+        }
+        if (datatypes.size() != 0) {
+            fprintf(
+                stderr,
+                "(pid: %d) WARNING: %zu derived datatype(s) never freed.\n",
+                (int)getpid(), datatypes.size()
+            );
+        }
+        //
+        if (!emit_report) return;
+        const char *output_dir = get_output_dir();
+        if (!output_dir) {
+            fprintf(stderr, "Error saving report.\n");
+            return;
+        }
+
+        char report_name[PATH_MAX];
+        snprintf(
+            report_name, sizeof(report_name) - 1, "%s/%d.%s",
+            output_dir, rt->rank, "mmcu"
+        );
+
+        FILE *reportf = fopen(report_name, "w+");
+        if (!reportf) {
+            fprintf(stderr, "Error saving report to %s.\n", report_name);
+            return;
+        }
+
+        fprintf(reportf, "# [Run Info Begin]\n");
+
+        fprintf(
+            reportf,
+            "# Report Date Time: %s\n",
+            rt->get_date_time_str_now().c_str()
+        );
+
+        fprintf(reportf, "# Application Name: %s\n", rt->get_app_name().c_str());
+
+        fprintf(reportf, "# Hostname: %s\n", rt->get_hostname().c_str());
+
+        fprintf(reportf, "# MPI_COMM_WORLD Rank: %d\n", rt->rank);
+
+        fprintf(reportf, "# MPI_COMM_WORLD Size: %d\n", rt->numpe);
+        // Time from 0 to what is reported.
+        const double time_to_init = rt->get_init_end_time()
+                                  - rt->get_init_begin_time();
+        fprintf(reportf, "# MPI Init Time (s): %lf\n", time_to_init);
+
+        // Timelines start when rank 0 entered MPI_Init, on its clock.
+        fprintf(
+            reportf,
+            "# MPI Init Start Time (s): %lf\n",
+            rt->get_report_time(rt->get_init_begin_time())
+        );
+
+        fprintf(
+            reportf,
+            "# Clock Offset to Rank 0 (s): %lf\n",
+            rt->get_clock_offset()
+        );
+
+        fprintf(
+            reportf,
+            "# Clock Offset Error (s): %lf\n",
+            rt->get_clock_offset_err()
+        );
+
+        fprintf(
+            reportf,
+            "# Clock Drift to Rank 0 (ppm): %lf\n",
+            rt->get_clock_drift() * 1e6
+        );
+
+        fprintf(
+            reportf,
+            "# Allocation Sampling Interval (B): %" PRIu64 "\n",
+            rt->get_alloc_sample_interval()
+        );
+
+        fprintf(
+            reportf,
+            "# Allocation Sampling Confidence Level: %lf\n",
+            0.95
+        );
+
+        fprintf(
+            reportf,
+            "# Number of Operation Captures Performed: %" PRIu64 "\n",
+            num_captures
+        );
+
+        fprintf(
+            reportf,
+            "# Number of Memory Operations Recorded: %" PRIu64 "\n",
+            n_mem_ops_recorded
+        );
+
+        fprintf(
+            reportf,
+            "# Number of Allocation-Related Operations Recorded: %" PRIu64 "\n",
+            n_mem_alloc_ops
+        );
+
+        fprintf(
+            reportf,
+            "# Number of Deallocation-Related Operations Recorded: %" PRIu64 "\n",
+            n_mem_free_ops
+        );
+
+        fprintf(
+            reportf,
+            "# Number of Tagged Allocation Operations Recorded: %" PRIu64 "\n",
+            n_tagged_ops
+        );
+
+        fprintf(
+            reportf,
+            "# Number of Tagged Allocations Freed Outside of MPI: %" PRIu64 "\n",
+            mmcu_mem_hooks_num_untraced_tagged_frees()
+        );
+
+        fprintf(
+            reportf,
+            "# Number of MPI Library PSS Samples Collected: %" PRIu64 "\n",
+            n_mpi_pss_samples
+        );
+
+        fprintf(
+            reportf,
+            "# Number of Application PSS Samples Collected: %" PRIu64 "\n",
+            n_app_pss_samples
+        );
+
+        fprintf(
+            reportf,
+            "# Number of MPI Library mmap PSS Queries: %" PRIu64 "\n",
+            n_mmap_pss_queries
+        );
+
+        fprintf(
+            reportf,
+            "# Number of MPI Library mmap PSS Cache Hits: %" PRIu64 "\n",
+            n_mmap_pss_cache_hits
+        );
+
+        fprintf(
+            reportf,
+            "# High Memory Usage Watermark (MPI) (MB): %lf\n",
+            tomb(mpi_high_mem_usage_mark)
+        );
+
+        fprintf(
+            reportf,
+            "# High Memory Usage Watermark Error (MPI) (MB): %lf\n",
+            tomb(ci_half_width(mpi_high_mem_usage_var))
+        );
+
+        fprintf(
+            reportf,
+            "# Growth Rate After MPI_Init (MPI) (MB/h): %lf\n",
+            to_mb_per_h(growth.all.get_slope())
+        );
+
+        fprintf(
+            reportf,
+            "# Growth Rate Error After MPI_Init (MPI) (MB/h): %lf\n",
+            to_mb_per_h(sample_ci_z * growth.all.get_slope_stderr())
+        );
+
+        fprintf(
+            reportf,
+            "# Number of Sustained Growth Warnings (MPI): %" PRIu64 "\n",
+            growth.n_warnings
+        );
+
+        fprintf(
+            reportf,
+            "# High Memory Usage Watermark Heap Share (MPI) (MB): %lf\n",
+            tomb(mpi_peak_heap_b)
+        );
+
+        fprintf(
+            reportf,
+            "# High Memory Usage Watermark mmap Share (MPI) (MB): %lf\n",
+            tomb(mpi_peak_mmap_b)
+        );
+
+        fprintf(
+            reportf,
+            "# High Memory Usage Watermark (Application + MPI) (MB): %lf\n",
+            tomb(pss_high_mem_usage_mark)
+        );
+
+        fprintf(
+            reportf,
+            "# High Memory Usage Watermark MPI Share "
+            "(Application + MPI) (MB): %lf\n",
+            tomb(pss_peak_mpi_b)
+        );
+
+        for (size_t i = 0; i < smaps_samples.fields.size(); ++i) {
+            // Already reported above.
+            if (i == smaps_pss_col) continue;
+            fprintf(
+                reportf,
+                "# High smaps %s Watermark (Application + MPI) (MB): %lf\n",
+                smaps_samples.fields[i].c_str(),
+                tomb(smaps_samples.high_marks[i])
+            );
+        }
+
+        fprintf(
+            reportf,
+            "# High mmap Mapped Watermark (MPI) (MB): %lf\n",
+            tomb(mmap_mapped_high_mark)
+        );
+
+        fprintf(
+            reportf,
+            "# High mmap Resident Watermark (MPI) (MB): %lf\n",
+            tomb(mmap_resident_high_mark)
+        );
+
+        fprintf(
+            reportf,
+            "# Number of MPI Library madvise Release Operations: %" PRIu64 "\n",
+            n_mmap_madvise_ops
+        );
+
+        fprintf(
+            reportf,
+            "# Total mmap Released With madvise (MPI) (MB): %lf\n",
+            tomb(mmap_madvise_released)
+        );
+
+        fprintf(
+            reportf,
+            "# Number of MPI Library MADV_FREE Operations: %" PRIu64 "\n",
+            n_mmap_lazy_free_ops
+        );
+
+        fprintf(
+            reportf,
+            "# Total mmap Marked Lazily Freeable With MADV_FREE (MPI) (MB): "
+            "%lf\n",
+            tomb(mmap_lazy_free_b)
+        );
+
+        fprintf(
+            reportf,
+            "# Number of posix_memalign Operations Recorded (MPI): %" PRIu64 "\n",
+            n_memalign_ops
+        );
+
+        fprintf(
+            reportf,
+            "# Number of malloc Arenas (Application + MPI): %zu\n",
+            mmcu_malloc_stats::get_num_arenas()
+        );
+
+        fprintf(
+            reportf,
+            "# High malloc Requested Watermark (MPI) (MB): %lf\n",
+            tomb(malloc_samples.high_marks[0])
+        );
+
+        fprintf(
+            reportf,
+            "# High malloc Usable Watermark (MPI) (MB): %lf\n",
+            tomb(malloc_samples.high_marks[1])
+        );
+
+        fprintf(
+            reportf,
+            "# High malloc Arena Watermark (Application + MPI) (MB): %lf\n",
+            tomb(malloc_samples.high_marks[2])
+        );
+
+        fprintf(
+            reportf,
+            "# High malloc Arena Free Watermark (Application + MPI) (MB): %lf\n",
+            tomb(malloc_samples.high_marks[4])
+        );
+
+        fprintf(
+            reportf,
+            "# Total posix_memalign Slack (MPI) (MB): %lf\n",
+            tomb(memalign_slack)
+        );
+
+        fprintf(
+            reportf,
+            "# Total Resident Pages Backing malloc Allocations (MPI) (MB): %lf\n",
+            tomb(malloc_resident)
+        );
+
+        const mmcu_leak_report leaks = get_leaks();
+        for (int o = 0; o < n_leak_origins; ++o) {
+            fprintf(
+                reportf,
+                "# Number of Outstanding %s Allocations at MPI_Finalize "
+                "(MPI): %.0lf\n",
+                get_leak_origin_name(o), leaks.totals[o].n_allocs
+            );
+            fprintf(
+                reportf,
+                "# Total Outstanding %s Allocations at MPI_Finalize "
+                "(MPI) (MB): %lf\n",
+                get_leak_origin_name(o), tomb(leaks.totals[o].live_b)
+            );
+        }
+
+        fprintf(
+            reportf,
+            "# Number of Point-to-Point Peers Contacted (MPI): %" PRIu64 "\n",
+            peers.n_peers
+        );
+
+        fprintf(
+            reportf,
+            "# Memory Growth Per New Peer (MPI) (B): %lf\n",
+            peers.get_mean_b()
+        );
+
+        fprintf(
+            reportf,
+            "# Memory Growth Per New Peer Error (MPI) (B): %lf\n",
+            ci_half_width(peers.get_mean_var())
+        );
+
+        fprintf(
+            reportf,
+            "# Projected Full-Mesh Peer Memory (MPI) (MB): %lf\n",
+            peers.get_mean_b() * double(rt->numpe - 1) / 1024.0 / 1024.0
+        );
+
+        uint64_t n_requests = 0;
+        for (int i = 0; i < MMCU_MPI_CALL_LAST; ++i) {
+            n_requests += n_requests_created[i];
+        }
+        fprintf(
+            reportf,
+            "# Number of Requests Created (MPI): %" PRIu64 "\n",
+            n_requests
+        );
+
+        fprintf(
+            reportf,
+            "# High Outstanding Requests Watermark (MPI): %" PRIu64 "\n",
+            requests_high_mark
+        );
+
+        fprintf(
+            reportf,
+            "# Memory Per Outstanding Request (MPI) (B): %lf\n",
+            request_fit.get_slope()
+        );
+
+        fprintf(
+            reportf,
+            "# Memory Per Outstanding Request Error (MPI) (B): %lf\n",
+            sample_ci_z * request_fit.get_slope_stderr()
+        );
+
+        fprintf(
+            reportf,
+            "# Number of Requests Never Completed (MPI): %zu\n",
+            requests.size()
+        );
+
+        uint64_t n_datatypes = 0;
+        for (int i = 0; i < MMCU_MPI_CALL_LAST; ++i) {
+            n_datatypes += n_datatypes_created[i];
+        }
+        fprintf(
+            reportf,
+            "# Number of Derived Datatypes Created (MPI): %" PRIu64 "\n",
+            n_datatypes
+        );
+
+        fprintf(
+            reportf,
+            "# High Live Derived Datatypes Watermark (MPI): %" PRIu64 "\n",
+            datatypes_high_mark
+        );
+
+        fprintf(
+            reportf,
+            "# Number of Derived Datatypes Never Freed (MPI): %zu\n",
+            datatypes.size()
+        );
+
+        fprintf(
+            reportf,
+            "# Total Derived Datatype Memory Never Freed (MPI) (MB): %lf\n",
+            double(datatypes_live_b) / 1024.0 / 1024.0
+        );
+
+        size_t n_rank_segs = 0;
+        for (auto &seg : shm_segments) {
+            n_rank_segs += (seg.n_regions != 0);
+        }
+        ssize_t rank_seg_pss_b = 0;
+        size_t node_seg_size_b = 0;
+        ssize_t node_seg_resident_b = 0;
+        for (auto &nseg : node_shm_segments) {
+            rank_seg_pss_b += nseg.rank_pss_b;
+            node_seg_size_b += nseg.size_b;
+            node_seg_resident_b += nseg.resident_b;
+        }
+
+        fprintf(
+            reportf,
+            "# Number of Shared-Memory Segments Mapped (MPI): %zu\n",
+            n_rank_segs
+        );
+
+        fprintf(
+            reportf,
+            "# Number of Shared-Memory Segments On Node (MPI): %zu\n",
+            node_shm_segments.size()
+        );
+
+        fprintf(
+            reportf,
+            "# Total Shared-Memory Segment Size On Node (MPI) (MB): %lf\n",
+            tomb(node_seg_size_b)
+        );
+
+        fprintf(
+            reportf,
+            "# Total Shared-Memory Segment Resident On Node (MPI) (MB): %lf\n",
+            tomb(node_seg_resident_b)
+        );
+
+        fprintf(
+            reportf,
+            "# Total Shared-Memory Segment Share (MPI) (MB): %lf\n",
+            tomb(rank_seg_pss_b)
+        );
+
+        if (numa_enabled) {
+            const int n_nodes = mmcu_numa::get_num_nodes();
+            for (int n = 0; n < n_nodes; ++n) {
+                fprintf(
+                    reportf,
+                    "# High NUMA Node %d Watermark (MPI mmap) (MB): %lf\n",
+                    n, tomb(numa_samples.high_marks[1 + n])
+                );
+            }
+            for (int n = 0; n < n_nodes; ++n) {
+                fprintf(
+                    reportf,
+                    "# High NUMA Node %d Watermark "
+                    "(Application + MPI) (MB): %lf\n",
+                    n, tomb(numa_samples.high_marks[1 + n_nodes + n])
+                );
+            }
+            fprintf(
+                reportf,
+                "# High NUMA Remote Fraction (MPI mmap): %lf\n",
+                numa_remote_mpi_high_frac
+            );
+        }
+
+        fprintf(reportf, "# [Run Info End]\n");
+
+        ////////////////////////////////////////////////////////////////////////
+        fprintf(
+            reportf,
+            "# MPI Library Memory Usage (B) Over Time "
+            "(Since MPI_Init):\n"
+        );
+        for (auto &i : mem_allocd_samples) {
+            fprintf(
+                reportf, "%s %lf %zd %u\n",
+                "MPI_MEM_USAGE",
+                rt->get_report_time(std::get<0>(i)),
+                std::get<1>(i),
+                unsigned(std::get<2>(i))
+            );
+        }
+
+        fprintf(
+            reportf,
+            "# Application Memory Usage (B) Over Time "
+            "(Since MPI_Init):\n"
+        );
+        const std::vector<ssize_t> &pss_col = smaps_samples.cols[
+                                                  smaps_pss_col
+                                              ];
+        for (size_t i = 0; i < smaps_samples.size(); ++i) {
+            fprintf(
+                reportf, "%s %lf %zd %u\n",
+                "ALL_MEM_USAGE",
+                rt->get_report_time(smaps_samples.times[i]),
+                pss_col[i],
+                unsigned(smaps_samples.phases[i])
+            );
+        }
+
+        fprintf(
+            reportf,
+            "# Application smaps Field Totals (B) Over Time "
+            "(Since MPI_Init):\n"
+        );
+        smaps_samples.emit(reportf, "SMAPS_USAGE", rt);
+
+        report_alloc_breakdowns(reportf);
+
+        report_peak_composition(reportf, rt);
+
+        report_peers(reportf, rt);
+
+        report_requests(reportf, rt);
+
+        report_payloads(reportf);
+
+        report_datatypes(reportf, rt);
+
+        report_leaks(reportf, leaks);
+
+        report_alloc_histos(reportf);
+
+        report_phases(reportf);
+
+        fprintf(
+            reportf,
+            "# MPI Library Heap and Application Allocator Memory (B) Over "
+            "Time (Since MPI_Init):\n"
+        );
+        malloc_samples.emit(reportf, "MALLOC_USAGE", rt);
+
+        fprintf(
+            reportf,
+            "# MPI Library mmap Mapped and Resident Memory (B) Over Time "
+            "(Since MPI_Init) (One Sample Per %" PRIu64 " Changes):\n",
+            mmap_usage_samples.get_stride()
+        );
+        for (auto &i : mmap_usage_samples) {
+            fprintf(
+                reportf, "%s %lf %zd %zd\n",
+                "MPI_MMAP_USAGE",
+                rt->get_report_time(std::get<0>(i)),
+                std::get<1>(i),
+                std::get<2>(i)
+            );
+        }
+
+        fprintf(
+            reportf,
+            "# Shared-Memory Segments On Node (MPI) (Counted Once Per "
+            "Node):\n"
+        );
+        fprintf(
+            reportf,
+            "# Fields: Inode Ranks Size_B Resident_B Rank_Share_B Path\n"
+        );
+        for (auto &nseg : node_shm_segments) {
+            fprintf(
+                reportf, "%s %" PRIu64 " %d %zu %zd %zd %s\n",
+                "SHM_SEGMENT",
+                nseg.inode,
+                nseg.n_ranks,
+                nseg.size_b,
+                nseg.resident_b,
+                nseg.rank_pss_b,
+                nseg.path.c_str()
+            );
+        }
+
+        if (numa_enabled) {
+            fprintf(
+                reportf,
+                "# MPI Library mmap and Application Memory (B) Per NUMA Node "
+                "Over Time (Since MPI_Init):\n"
+            );
+            numa_samples.emit(reportf, "NUMA_MEM_USAGE", rt);
+        }
+
+        fclose(reportf);
+
+        if (rt->rank == 0) {
+            printf("# Report written to %s\n", output_dir);
+        }
+    }
+
+    /**
+     *
+     */
+    void
+    update_mem_stats(bool sample = false) {
+        if (current_mem_allocd > mpi_high_mem_usage_mark) {
+            mpi_high_mem_usage_mark = current_mem_allocd;
+            mpi_high_mem_usage_var = current_mem_var;
+            // Only scalars here: the breakdowns are saved lazily.
+            mpi_peak_gen++;
+            mpi_peak_time = mmcu_time();
+            mpi_peak_heap_b = current_malloc_requested;
+            mpi_peak_mmap_b = current_mem_allocd - current_malloc_requested;
+            //
+            if (alert_mpi_b != 0 && current_mem_allocd >= alert_mpi_b) {
+                raise_alert(
+                    "MPI memory usage", current_mem_allocd,
+                    "MMCU_ALERT_BYTES", alert_mpi_b
+                );
+                alert_mpi_b = 0;
+            }
+        }
+        //
+        if (sample || n_mem_ops_recorded++ % mem_allocd_sample_freq == 0) {
+            const double now = mmcu_time();
+            mem_allocd_samples.push_back(
+                std::make_tuple(now, current_mem_allocd, cur_phase)
+            );
+            if (now - growth_last_time >= growth_sample_period) {
+                add_growth_sample(now);
+            }
+        }
+        // Only the innermost phase: the others are updated when it ends.
+        mmcu_phase_frame &frame = phase_stack.back();
+        if (current_mem_allocd > frame.mpi_high_b) {
+            frame.mpi_high_b = current_mem_allocd;
+        }
+        // Gather total process memory usage also.
+        if (sample || n_mem_ops_recorded % pss_totals_sample_freq == 0) {
+            n_app_pss_samples++;
+            //
+            get_proc_self_smaps_field_totals(smaps_sample_vals);
+            smaps_samples.push_back(mmcu_time(), smaps_sample_vals, cur_phase);
+            const ssize_t pss_total = smaps_sample_vals[smaps_pss_col];
+            //
+            if (pss_total > frame.pss_high_b) {
+                frame.pss_high_b = pss_total;
+            }
+            //
+            if (telemetry) {
+                publish_telemetry_sample(smaps_samples.times.back(), pss_total);
+            }
+            //
+            if (pss_total > pss_high_mem_usage_mark) {
+                pss_high_mem_usage_mark = pss_total;
+                // Reuses storage, so this doesn't allocate after the first.
+                pss_peak_smaps_vals.assign(
+                    smaps_sample_vals.begin(), smaps_sample_vals.end()
+                );
+                pss_peak_time = smaps_samples.times.back();
+                pss_peak_mpi_b = current_mem_allocd;
+                //
+                if (alert_pss_b != 0 && pss_total >= alert_pss_b) {
+                    raise_alert(
+                        "Application + MPI memory usage", pss_total,
+                        "MMCU_ALERT_PSS_BYTES", alert_pss_b
+                    );
+                    alert_pss_b = 0;
+                }
+            }
+            //
+            if (node_usage.shm) {
+                check_node_alerts(pss_total);
+            }
+            //
+            sample_malloc_stats();
+            //
+            if (numa_enabled) {
+                sample_numa();
+            }
+        }
+
+        if (sample) {
+            update_all_pss_entries(sample);
+            malloc_resident = get_malloc_resident_bytes();
+            publish_usage(MMCU_MPI_CALL_NONE);
+        }
+        write_requested_snapshot();
+    }
+
+    /**
+     * Writes a snapshot if one was asked for since the last one. Signal
+     * handlers only ask for snapshots: they are written here, where it is safe
+     * to allocate and to walk the tables. Call with the hooks lock held.
+     */
+    void
+    write_requested_snapshot(void) {
+        const uint32_t n_requested = n_snapshots_requested.load(
+                                         std::memory_order_relaxed
+                                     );
+        if (n_requested == n_snapshots_handled) return;
+        //
+        n_snapshots_handled = n_requested;
+        write_snapshot("Signal", snapshot_n_samples);
+    }
+
+private:
+    //
+    static constexpr size_t usage_nwords = sizeof(mmcu_usage_t) / 8;
+    static_assert(
+        sizeof(mmcu_usage_t) % 8 == 0, "mmcu_usage_t must be 64-bit words"
+    );
+    static_assert(
+        sizeof(mmcu_telemetry_live_t) % 8 == 0,
+        "mmcu_telemetry_live_t must be 64-bit words"
+    );
+    // mmcu_telemetry_try_read() reads usage and live as one block.
+    static_assert(
+        offsetof(mmcu_telemetry_page_t, live) ==
+        offsetof(mmcu_telemetry_page_t, usage_block) +
+        offsetof(mmcu_usage_block_t, usage) + sizeof(mmcu_usage_t),
+        "mmcu_telemetry_page_t::live must follow the usage"
+    );
+    static_assert(
+        MMCU_MPI_CALL_LAST <= MMCU_USAGE_MAX_MPI_CALLS,
+        "mmcu_usage_t::mpi_call_b is too small"
+    );
+
+    /**
+     * Makes the current totals visible to mmcu_usage_get(). Only the given
+     * MPI call's entry is refreshed, since an operation changes one at most.
+     */
+    void
+    publish_usage(
+        uint8_t mpi_call_id
+    ) {
+        static const double init_time =
+            mmcu_rt::the_mmcu_rt()->get_init_begin_time();
+        double now = mmcu_time() - init_time;
+        uint64_t now_bits;
+        memcpy(&now_bits, &now, sizeof(now_bits));
+        const ssize_t pss_b =
+            n_app_pss_samples ? smaps_sample_vals[smaps_pss_col] : 0;
+        //
+        mmcu_usage_block_t *b = usage_block.load(std::memory_order_relaxed);
+        mmcu_usage_t &u = b->usage;
+        mmcu_seqlock_write_begin(&b->seq);
+        mmcu_seqlock_store(&u.time, now_bits);
+        mmcu_seqlock_store(&u.mpi_b, current_mem_allocd);
+        mmcu_seqlock_store(&u.mpi_high_b, mpi_high_mem_usage_mark);
+        mmcu_seqlock_store(&u.pss_b, pss_b);
+        mmcu_seqlock_store(&u.pss_high_b, pss_high_mem_usage_mark);
+        mmcu_seqlock_store(&u.n_allocs, n_heap_alloc_ops);
+        mmcu_seqlock_store(&u.n_frees, n_heap_free_ops);
+        mmcu_seqlock_store(
+            &u.mpi_call_b[mpi_call_id], mpi_call_stats[mpi_call_id].live_b
+        );
+        mmcu_seqlock_write_end(&b->seq);
+    }
+
+    /**
+     * Appends a whole-process sample to the telemetry page's ring.
+     */
+    void
+    publish_telemetry_sample(
+        double at,
+        ssize_t pss_b
+    ) {
+        mmcu_telemetry_live_t &live = telemetry->live;
+        const uint64_t n = live.n_samples;
+        mmcu_telemetry_sample_t &smp =
+            live.samples[n % MMCU_TELEMETRY_N_SAMPLES];
+        double since_init = at - mmcu_rt::the_mmcu_rt()->get_init_begin_time();
+        uint64_t since_init_bits;
+        memcpy(&since_init_bits, &since_init, sizeof(since_init_bits));
+        //
+        mmcu_seqlock_write_begin(&telemetry->usage_block.seq);
+        mmcu_seqlock_store(&smp.time, since_init_bits);
+        mmcu_seqlock_store(&smp.mpi_b, current_mem_allocd);
+        mmcu_seqlock_store(&smp.pss_b, pss_b);
+        mmcu_seqlock_store(&smp.phase, cur_phase);
+        mmcu_seqlock_store(&live.n_samples, n + 1);
+        mmcu_seqlock_write_end(&telemetry->usage_block.seq);
+    }
+
+    /**
+     * Shows the innermost phase on the telemetry page.
+     */
+    void
+    publish_telemetry_phase(void) {
+        if (!telemetry) return;
+        //
+        uint64_t words[MMCU_TELEMETRY_NAME_LEN / 8];
+        memset(words, 0, sizeof(words));
+        const std::string &name = phases[cur_phase].name;
+        memcpy(words, name.c_str(), std::min(name.size(), sizeof(words) - 1));
+        //
+        char *dst = telemetry->live.phase_name;
+        mmcu_seqlock_write_begin(&telemetry->usage_block.seq);
+        for (size_t i = 0; i < MMCU_TELEMETRY_NAME_LEN / 8; ++i) {
+            mmcu_seqlock_store(dst + 8 * i, words[i]);
+        }
+        mmcu_seqlock_write_end(&telemetry->usage_block.seq);
+    }
+
+    /**
+     *
+     */
+    void
+    update_all_pss_entries(bool samp = false)
+    {
+        if (!samp && n_mpi_pss_samples_requested++ % mpi_pss_update_freq != 0) {
+            return;
+        }
+
+        n_mpi_pss_samples++;
+
+        const double now = mmcu_time();
+        for (auto &me : addr2mmap_entry) {
+            mmcu_mmap_entry *const e = me.second;
+            // Forced samples always re-read everything.
+            if (!samp && !mmap_entry_pss_stale(e, now)) {
+                n_mmap_pss_cache_hits++;
+                continue;
+            }
+            const ssize_t old_size = e->size;
+            // Next capture the new PSS value.
+            const ssize_t new_size = get_mmap_entry_pss(e);
+            n_mmap_pss_queries++;
+            e->pss_gen = e->mod_gen;
+            e->pss_read_at = now;
+            // Free up old size.
+            e->size = -old_size;
+            update_current_mem_allocd(e, true /* internal_bookkeeping */);
+            // Now include new size.
+            e->size = new_size;
+            current_mmap_resident += new_size - old_size;
+            //
+            update_current_mem_allocd(e);
+        }
+        //
+        update_mmap_stats();
+        update_shm_segments();
+    }
+
+    /**
+     * Returns the index of the segment backing the given shared mapping,
+     * registering it if it's new.
+     */
+    int32_t
+    get_shm_segment_id(
+        const mmcu_proc_smaps_entry &entry
+    ) {
+        std::string path(entry.path);
+        // Segments are usually unlinked once every rank has attached.
+        static const std::string deleted(" (deleted)");
+        if (path.size() >= deleted.size() &&
+            0 == path.compare(
+                path.size() - deleted.size(), deleted.size(), deleted
+            )) {
+            path.erase(path.size() - deleted.size());
+        }
+        const auto key = std::make_pair(path, entry.inode);
+        auto got = shm_seg_ids.find(key);
+        if (got != shm_seg_ids.end()) return got->second;
+        //
+        const int32_t id = int32_t(shm_segments.size());
+        shm_segments.push_back(mmcu_shm_segment(path, entry.inode));
+        shm_seg_ids.insert(std::make_pair(key, id));
+        return id;
+    }
+
+    /**
+     * Recomputes the per-segment totals from the tracked regions.
+     */
+    void
+    update_shm_segments(void) {
+        if (shm_segments.empty()) return;
+        //
+        for (auto &seg : shm_segments) {
+            seg.n_regions = 0;
+            seg.mapped_b = 0;
+            seg.pss_b = 0;
+        }
+        for (auto &me : addr2mmap_entry) {
+            const mmcu_mmap_entry *const e = me.second;
+            if (e->shm_seg_id == -1) continue;
+            mmcu_shm_segment &seg = shm_segments[e->shm_seg_id];
+            seg.n_regions++;
+            seg.mapped_b += e->map_len;
+            seg.pss_b += e->size;
+        }
+        for (auto &seg : shm_segments) {
+            seg.mapped_high_b = std::max(seg.mapped_high_b, seg.mapped_b);
+            seg.pss_high_b = std::max(seg.pss_high_b, seg.pss_b);
+        }
+    }
+
+    /**
+     * Returns whether or not the cached PSS of the given region must be
+     * re-read.
+     */
+    bool
+    mmap_entry_pss_stale(
+        const mmcu_mmap_entry *const e,
+        double now
+    ) {
+        // Touched since the last read.
+        if (e->mod_gen != e->pss_gen) return true;
+        // Still in its first-touch window.
+        if (now - e->captured_at < pss_first_touch_window) return true;
+        //
+        return (now - e->pss_read_at) >= pss_cache_max_age;
+    }
+
+    /**
+     * Marks all tracked regions overlapping [addr, addr + len) for re-query.
+     */
+    void
+    invalidate_mmap_range(
+        uintptr_t addr,
+        size_t len
+    ) {
+        const uintptr_t end = addr + len;
+        ++mmap_gen;
+        // Start at the last region that begins at or before addr.
+        auto it = addr2mmap_entry.upper_bound(addr);
+        if (it != addr2mmap_entry.begin()) --it;
+        for ( ; it != addr2mmap_entry.end() && it->first < end; ++it) {
+            mmcu_mmap_entry *const e = it->second;
+            if (e->addr_end() > addr) {
+                e->mod_gen = mmap_gen;
+            }
+        }
+    }
+
+    /**
+     * Stops tracking the given region and releases what was accounted for it.
+     */
+    void
+    remove_mmap_entry(
+        std::map<uintptr_t, mmcu_mmap_entry *>::iterator got
+    ) {
+        mmcu_mmap_entry *const mme = got->second;
+        //
+        current_mmap_mapped -= mme->map_len;
+        current_mmap_resident -= mme->size;
+        update_mmap_stats();
+        //
+        addr2mmap_entry.erase(got);
+        // Release what we accounted for, not the length being unmapped.
+        mmcu_memory_op_entry rm_ope(MMCU_HOOK_MUNMAP, mme->addr, mme->size);
+        delete mme;
+        //
+        update_current_mem_allocd(&rm_ope);
+    }
+
+    /**
+     * Starts tracking the given region. Anything still tracked at its start
+     * address is released first, so it is neither leaked nor counted twice.
+     */
+    void
+    insert_mmap_entry(
+        mmcu_mmap_entry *const mme
+    ) {
+        auto res = addr2mmap_entry.insert(std::make_pair(mme->addr, mme));
+        if (res.second) return;
+        //
+        remove_mmap_entry(res.first);
+        addr2mmap_entry.insert(std::make_pair(mme->addr, mme));
+    }
+
+    /**
+     * Drops [addr, end) from the given region, which it only partly covers.
+     * What is left is trimmed in place, re-keyed at its new start, or split in
+     * two if the hole is in the middle. The resident size of each part is
+     * estimated assuming pages are spread evenly, and the parts are marked for
+     * re-query.
+     */
+    void
+    trim_mmap_entry(
+        std::map<uintptr_t, mmcu_mmap_entry *>::iterator got,
+        uintptr_t addr,
+        uintptr_t end
+    ) {
+        mmcu_mmap_entry *const mme = got->second;
+        const size_t old_len = mme->map_len;
+        const ssize_t old_res = mme->size;
+        const size_t head_len = addr > mme->addr ? addr - mme->addr : 0;
+        const size_t tail_len = end < mme->addr_end()
+                              ? mme->addr_end() - end : 0;
+        const ssize_t head_res = ssize_t(
+            double(old_res) * double(head_len) / double(old_len)
+        );
+        const ssize_t tail_res = ssize_t(
+            double(old_res) * double(tail_len) / double(old_len)
+        );
+        //
+        if (head_len && tail_len) {
+            mmcu_mmap_entry *const tail = new mmcu_mmap_entry(*mme);
+            tail->addr = end;
+            tail->map_len = tail_len;
+            tail->size = tail_res;
+            insert_mmap_entry(tail);
+        }
+        // Only the tail is left, so it needs a new key.
+        else if (tail_len) {
+            addr2mmap_entry.erase(got);
+            mme->addr = end;
+            mme->map_len = tail_len;
+            mme->size = tail_res;
+            insert_mmap_entry(mme);
+        }
+        if (head_len) {
+            mme->map_len = head_len;
+            mme->size = head_res;
+        }
+        //
+        const ssize_t released = old_res - head_res - tail_res;
+        current_mmap_mapped -= old_len - head_len - tail_len;
+        current_mmap_resident -= released;
+        update_mmap_stats();
+        if (mme->shm_seg_id != -1) {
+            update_shm_segments();
+        }
+        if (released == 0) return;
+        //
+        mmcu_memory_op_entry update_ope(
+            MMCU_HOOK_MMAP_PSS_UPDATE, mme->addr, -released
+        );
+        update_current_mem_allocd(&update_ope);
+    }
+
+    /**
+     * Stops tracking [addr, addr + len). Regions it fully covers are removed
+     * and the ones it partially covers are trimmed.
+     */
+    void
+    unmap_mmap_range(
+        uintptr_t addr,
+        size_t len
+    ) {
+        const uintptr_t end = addr + len;
+        invalidate_mmap_range(addr, len);
+        // Start at the last region that begins at or before addr. Trimmed
+        // parts never start before end, so they aren't visited again.
+        auto it = addr2mmap_entry.upper_bound(addr);
+        if (it != addr2mmap_entry.begin()) --it;
+        while (it != addr2mmap_entry.end() && it->first < end) {
+            auto cur = it++;
+            const mmcu_mmap_entry *const mme = cur->second;
+            if (mme->addr_end() <= addr) continue;
+            //
+            if (mme->addr >= addr && mme->addr_end() <= end) {
+                remove_mmap_entry(cur);
+            }
+            else {
+                trim_mmap_entry(cur, addr, end);
+            }
+        }
+    }
+
+    /**
+     *
+     */
+    void
+    update_mmap_stats(void) {
+        if (current_mmap_mapped > mmap_mapped_high_mark) {
+            mmap_mapped_high_mark = current_mmap_mapped;
+        }
+        if (current_mmap_resident > mmap_resident_high_mark) {
+            mmap_resident_high_mark = current_mmap_resident;
+        }
+        mmap_usage_samples.push_back(
+            std::make_tuple(
+                mmcu_time(), current_mmap_mapped, current_mmap_resident
+            )
+        );
+    }
+
+    /**
+     *
+     */
+    void
+    capture_mmap_ops(
+        mmcu_memory_op_entry *const ope
+    ) {
+        const uintptr_t addr = ope->addr;
+        const uint8_t opid = ope->opid;
+        //
+        switch (opid) {
+            case (MMCU_HOOK_MMAP):
+                if (addr == uintptr_t(MAP_FAILED)) {
+                    delete ope;
+                    return;
+                }
+                // Anything we tracked in this range was replaced (MAP_FIXED).
+                unmap_mmap_range(addr, ope->size);
+                capture_new_mmap(ope);
+                return;
+            case (MMCU_HOOK_MUNMAP):
+                unmap_mmap_range(addr, ope->size);
+                delete ope;
+                return;
+            case (MMCU_HOOK_MREMAP):
+                capture_mremap(ope);
+                delete ope;
+                return;
+            case (MMCU_HOOK_MADVISE):
+                capture_madvise(ope);
+                delete ope;
+                return;
+        }
+    }
+
+    /**
+     * Accounts for pages given back to the kernel with a successful
+     * MADV_DONTNEED or MADV_REMOVE in tracked regions, as measured by
+     * begin_madvise(). Their size is removed from each region's estimate right
+     * away and the regions are marked for re-query.
+     */
+    void
+    capture_madvise(
+        mmcu_memory_op_entry *const ope
+    ) {
+        invalidate_mmap_range(ope->addr, ope->size);
+        //
+        for (const auto &pending : madvise_pending) {
+            auto got = addr2mmap_entry.find(pending.first);
+            if (got == addr2mmap_entry.end()) continue;
+            //
+            mmcu_mmap_entry *const e = got->second;
+            const ssize_t released = std::min(pending.second, e->size);
+            if (released <= 0) continue;
+            //
+            e->size -= released;
+            current_mmap_resident -= released;
+            mmap_madvise_released += released;
+            //
+            mmcu_memory_op_entry update_ope(
+                MMCU_HOOK_MMAP_PSS_UPDATE, e->addr, -released
+            );
+            update_current_mem_allocd(&update_ope);
+        }
+        madvise_pending.clear();
+        n_mmap_madvise_ops++;
+        update_mmap_stats();
+    }
+
+    /**
+     *
+     */
+    void
+    capture_new_mmap(
+        mmcu_memory_op_entry *const ope
+    ) {
+        const uintptr_t addr = ope->addr;
+        // Grab PSS stats.
+        mmcu_proc_smaps_entry maps_entry;
+        bool found_entry = false;
+        get_proc_self_mmap_entry(addr, ope->size, maps_entry, found_entry);
+        // Failed mmap (or the mapping is already gone), so don't track it.
+        if (!found_entry) {
+            delete ope;
+            return;
+        }
+        // The mmap length is initially captured, so track PSS from here on.
+        mmcu_mmap_entry *const mme = new mmcu_mmap_entry(
+            addr,
+            ope->size,
+            mmcu_mem_residency::get_backend(maps_entry),
+            maps_entry.pss_in_b,
+            mmcu_time()
+        );
+        delete ope;
+        //
+        if (maps_entry.reg_shared && maps_entry.reg_file_backed) {
+            mme->shm_seg_id = get_shm_segment_id(maps_entry);
+        }
+        // Add updated entry to map.
+        insert_mmap_entry(mme);
+        // A new alloc operation not accounted for in capture because mmap
+        // isn't recognized as a first-class operation.
+        n_mem_alloc_ops++;
+        //
+        current_mmap_mapped += mme->map_len;
+        add_total_allocd_b(mme->map_len);
+        current_mmap_resident += mme->size;
+        update_mmap_stats();
+        if (mme->shm_seg_id != -1) {
+            update_shm_segments();
+        }
+        //
+        update_current_mem_allocd(mme);
+    }
+
+    /**
+     * Moves or resizes a tracked region. Its PSS is re-read at the next
+     * refresh. A region we didn't track is captured as a new mapping.
+     */
+    void
+    capture_mremap(
+        mmcu_memory_op_entry *const ope
+    ) {
+        const uintptr_t new_addr = ope->addr;
+        const size_t new_len = ope->size;
+        //
+        auto got = addr2mmap_entry.find(ope->old_addr);
+        if (got == addr2mmap_entry.end()) {
+            mmcu_memory_op_entry *const mope = new mmcu_memory_op_entry(*ope);
+            mope->opid = MMCU_HOOK_MMAP;
+            mope->old_addr = 0;
+            unmap_mmap_range(new_addr, new_len);
+            capture_new_mmap(mope);
+            return;
+        }
+        //
+        mmcu_mmap_entry *const mme = got->second;
+        addr2mmap_entry.erase(got);
+        // Anything we tracked at the destination was replaced.
+        unmap_mmap_range(new_addr, new_len);
+        //
+        current_mmap_mapped += ssize_t(new_len) - ssize_t(mme->map_len);
+        mme->addr = new_addr;
+        mme->map_len = new_len;
+        mme->mod_gen = ++mmap_gen;
+        insert_mmap_entry(mme);
+        update_mmap_stats();
+    }
+
+    /**
+     *
+     */
+    void
+    break_down_realloc(
+        mmcu_memory_op_entry *const ope
+    ) {
         const uintptr_t addr = ope->addr;
+        const uintptr_t old_addr = ope->old_addr;
+        const size_t size = ope->size;
+        // Acts like free. Checked first, since NULL is returned.
+        if (size == 0 && old_addr) {
+            auto got = addr2entry.find(old_addr);
+            if (got != addr2entry.end()) {
+                ope->opid = MMCU_HOOK_FREE;
+                // Will be looked up in terms of addr, so update.
+                ope->addr = old_addr;
+            }
+            // Probably an application bug, so do nothing.
+            else {
+                ope->opid = MMCU_HOOK_NOOP;
+            }
+        }
+        // Returned NULL, so old_addr was unchanged.
+        else if (!addr) {
+            // Nothing to do.
+            ope->opid = MMCU_HOOK_NOOP;
+        }
+        // Acts like malloc.
+        else if (!old_addr) {
+            ope->opid = MMCU_HOOK_MALLOC;
+        }
+        // Area pointed to was moved.
+        else if (old_addr != addr) {
+            // New region was first created. Gets its own entry, since ope is
+            // reused for the free below.
+            mmcu_memory_op_entry *const mope = new mmcu_memory_op_entry(*ope);
+            mope->opid = MMCU_HOOK_MALLOC;
+            mope->old_addr = 0;
+            capture(mope);
+            // Old region was freed.
+            ope->opid = MMCU_HOOK_FREE;
+            // Will be looked up in terms of addr, so update.
+            ope->addr = old_addr;
+            // The final capture will be done below.
+        }
+        // Area pointed to was not moved, but perhaps some other shuffling was
+        // done.
+        else {
+            // I'm not sure if this is the best way to capture this... Ideas..?
+            // First remove old entry. old_addr and addr should be equal.
+            // This first bit should decrement memory usage by the old size.
+            // Gets its own entry, since capture() may consume it.
+            mmcu_memory_op_entry *const fope = new mmcu_memory_op_entry(*ope);
+            fope->opid = MMCU_HOOK_FREE;
+            capture(fope);
+            // Now increment memory usage by the new size.
+            ope->opid = MMCU_HOOK_MALLOC;
+        }
+        capture(ope);
+    }
+
+    /**
+     *
+     */
+    double
+    tomb(size_t inb) {
+        return (double(inb) / 1024.0 / 1024.0);
+    }
+
+    /**
+     * Converts a rate in B/s, which may be negative, to MB/h.
+     */
+    static double
+    to_mb_per_h(double b_per_s) {
+        return b_per_s * 3600.0 / 1024.0 / 1024.0;
+    }
+
+    /**
+     *
+     */
+    void
+    update_current_mem_allocd(
+        mmcu_memory_op_entry *const ope,
+        bool internal_bookkeeping = false
+    ) {
         const uint8_t opid = ope->opid;
-        // Deal with any special cases first.
+        // Estimated when allocations are sampled.
+        const size_t size = ope->est_size();
+        const size_t usable_size = size_t(
+            double(ope->usable_size) * double(ope->sample_weight)
+        );
+
         switch (opid) {
-            // realloc is never directly handled.
-            case (MMCU_HOOK_REALLOC):
-                break_down_realloc(ope);
-                return;
-            // mmap requires some extra work to extract its 'real' usage. Note
-            // that this usage will change during the life of the application,
-            // so we need to periodically update mmap entries. We'll do that
-            // later for all captured mmaps. munmap also requires some special
-            // care because mmap captures are stored in a different container.
-            case (MMCU_HOOK_MMAP):
+            case (MMCU_HOOK_POSIX_MEMALIGN):
+                n_memalign_ops++;
+                if (usable_size > size) {
+                    memalign_slack += usable_size - size;
+                }
+                // Fall through.
+            case (MMCU_HOOK_MALLOC):
+            case (MMCU_HOOK_CALLOC):
+                n_mem_alloc_ops++;
+                n_heap_alloc_ops++;
+                phase_stack.back().n_allocs++;
+                current_mem_allocd += size;
+                current_mem_var += ope->est_size_var();
+                current_malloc_requested += size;
+                current_malloc_usable += usable_size;
+                add_total_allocd_b(size);
+                mpi_call_stats[ope->mpi_call_id].add_alloc(ope, mpi_peak_gen);
+                callsite_stats[ope->callsite].add_alloc(ope, mpi_peak_gen);
+                size_class_stats[get_size_class(ope->size)].add_alloc(
+                    ope, mpi_peak_gen
+                );
+                mpi_call_histos[ope->mpi_call_id].add_alloc(ope);
+                break;
+            case (MMCU_HOOK_FREE):
+                current_mem_var -= ope->est_size_var();
+                current_malloc_requested -= size;
+                current_malloc_usable -= usable_size;
+                mpi_call_stats[ope->mpi_call_id].add_free(ope, mpi_peak_gen);
+                callsite_stats[ope->callsite].add_free(ope, mpi_peak_gen);
+                phase_stack.back().n_frees++;
+                n_heap_free_ops++;
+                size_class_stats[get_size_class(ope->size)].add_free(
+                    ope, mpi_peak_gen
+                );
+                mpi_call_histos[ope->mpi_call_id].add_free(ope, mmcu_time());
+                // Fall through.
             case (MMCU_HOOK_MUNMAP):
-                capture_mmap_ops(ope);
-                return;
+                n_mem_free_ops++;
+                current_mem_allocd -= size;
+                break;
+            case (MMCU_HOOK_MMAP_PSS_UPDATE):
+                // Here size may be positive or negative.
+                current_mem_allocd += size;
+                break;
+            case (MMCU_HOOK_NOOP):
+                // Nothing to do.
+                break;
+            default:
+                // Note: MMCU_HOOK_REALLOC and MMCU_HOOK_MMAP are always broken
+                // down in terms of other operations, so they will never reach
+                // this code path.
+                assert(false && "Invalid opid");
+        }
+        //
+        if (!internal_bookkeeping) {
+            update_mem_stats();
+            publish_usage(ope->mpi_call_id);
+        }
+    }
+
+    /**
+     *
+     */
+    void
+    get_proc_self_smaps_entry(
+        uintptr_t target_addr,
+        mmcu_proc_smaps_entry &res_entry,
+        bool &found_entry
+    ) {
+        found_entry = false;
+        static const int n_tries = 5;
+        for (int i = 0; i < n_tries && !found_entry; ++i) {
+            mmcu_proc_smaps_parser::get_proc_self_smaps_entry(
+                target_addr, res_entry, found_entry
+            );
+        }
+        if (!found_entry) {
+            fprintf(
+                stderr,
+                "(pid: %d) WARNING: "
+                "missing /proc/self/smaps entry!\n",
+                (int)getpid()
+            );
+        }
+    }
+
+    /**
+     * Like get_proc_self_smaps_entry(), but for a new mapping of the given
+     * length. When PROCMAP_QUERY is available, the covering VMA is looked up
+     * directly and the PSS of private anonymous mappings is taken to be their
+     * resident size if none of their pages is shared, so no smaps walk is
+     * needed. Other mappings still get their PSS from smaps.
+     */
+    void
+    get_proc_self_mmap_entry(
+        uintptr_t target_addr,
+        size_t length,
+        mmcu_proc_smaps_entry &res_entry,
+        bool &found_entry
+    ) {
+        mmcu_procmap_query::get_proc_self_vma_entry(
+            target_addr, res_entry, found_entry
+        );
+        // No kernel support, so fall back to the smaps scan.
+        if (!mmcu_procmap_query::available()) {
+            get_proc_self_smaps_entry(target_addr, res_entry, found_entry);
+            return;
+        }
+        if (!found_entry) return;
+        // The VMA may extend past the new mapping if the kernel merged it with
+        // a neighbor, so only consider our part of it.
+        const uintptr_t end = std::min(
+            uintptr_t(res_entry.addr_end), target_addr + length
+        );
+        const size_t our_len = end - target_addr;
+        // PSS == RSS for private anonymous memory, unless a fork() left
+        // pages shared copy-on-write. Then only smaps knows their share.
+        size_t resident_b = 0;
+        if (mmcu_mem_residency::get_backend(res_entry) ==
+            mmcu_mem_residency::MMCU_RES_BACKEND_PAGEMAP &&
+            mmcu_mem_residency::get_unshared_resident_bytes(
+                target_addr, our_len, resident_b
+            )) {
+            res_entry.pss_in_b = resident_b;
+            return;
+        }
+        //
+        mmcu_proc_smaps_entry smaps_entry;
+        bool found_smaps_entry = false;
+        mmcu_proc_smaps_parser::get_proc_self_smaps_entry(
+            res_entry.addr_start, smaps_entry, found_smaps_entry
+        );
+        if (found_smaps_entry) {
+            const size_t vma_len = smaps_entry.addr_end - smaps_entry.addr_start;
+            // Scale by the portion of the VMA that is ours.
+            res_entry.pss_in_b = size_t(
+                double(smaps_entry.pss_in_b) * double(our_len) / double(vma_len)
+            );
+        }
+    }
+
+    /**
+     * Returns the current PSS (B) of a tracked mapping using the cheapest
+     * exact method for its region type.
+     */
+    size_t
+    get_mmap_entry_pss(
+        const mmcu_mmap_entry *const e
+    ) {
+        size_t resident_b = 0;
+        if (e->res_backend == mmcu_mem_residency::MMCU_RES_BACKEND_PAGEMAP &&
+            mmcu_mem_residency::get_unshared_resident_bytes(
+                e->addr, e->map_len, resident_b
+            )) {
+            return resident_b;
+        }
+        // Some pages are shared: smaps has their proportional share.
+        mmcu_proc_smaps_entry maps_entry;
+        bool found_entry = false;
+        get_proc_self_mmap_entry(e->addr, e->map_len, maps_entry, found_entry);
+        return maps_entry.pss_in_b;
+    }
+
+    /**
+     * Returns the half-width of the confidence interval of an estimate with
+     * the given variance.
+     */
+    static double
+    ci_half_width(
+        double var
+    ) {
+        return var > 0.0 ? sample_ci_z * sqrt(var) : 0.0;
+    }
+
+    /**
+     * Returns the name of the module (shared object or executable) that
+     * contains the given address.
+     */
+    static std::string
+    get_module_name(
+        uintptr_t addr
+    ) {
+        Dl_info info;
+        if (addr == 0 || 0 == dladdr((void *)addr, &info) ||
+            !info.dli_fname) {
+            return "Unknown";
+        }
+        const char *base = strrchr(info.dli_fname, '/');
+        return base ? base + 1 : info.dli_fname;
+    }
+
+    /**
+     * Emits heap allocation totals per MPI call and per module. Estimated,
+     * with error bars, when allocation sampling is enabled.
+     */
+    void
+    report_alloc_breakdowns(
+        FILE *reportf
+    ) {
+        fprintf(
+            reportf,
+            "# MPI Library Heap Allocations Per MPI Function:\n"
+        );
+        fprintf(
+            reportf,
+            "# Fields: Function Recorded Allocations Allocated_B "
+            "Allocated_Error_B Live_B High_Live_B\n"
+        );
+        for (int i = 0; i < MMCU_MPI_CALL_LAST; ++i) {
+            const mmcu_alloc_stats &st = mpi_call_stats[i];
+            if (st.n_recorded == 0) continue;
+            fprintf(
+                reportf, "%s %s %" PRIu64 " %.0lf %.0lf %.0lf %zd %zd\n",
+                "MPI_CALL_ALLOCS",
+                mmcu_mpi_call_name(i),
+                st.n_recorded,
+                st.n_allocs,
+                st.alloc_b,
+                ci_half_width(st.alloc_var),
+                st.live_b,
+                st.high_live_b
+            );
+        }
+        // Call sites are only resolved here, so dladdr() stays off the
+        // capture path.
+        std::map<std::string, mmcu_alloc_stats> module_stats;
+        for (auto &i : callsite_stats) {
+            module_stats[get_module_name(i.first)].merge(i.second);
+        }
+        fprintf(
+            reportf,
+            "# MPI Library Heap Allocations Per Module:\n"
+        );
+        fprintf(
+            reportf,
+            "# Fields: Module Recorded Allocations Allocated_B "
+            "Allocated_Error_B Live_B\n"
+        );
+        for (auto &i : module_stats) {
+            const mmcu_alloc_stats &st = i.second;
+            fprintf(
+                reportf, "%s %s %" PRIu64 " %.0lf %.0lf %.0lf %zd\n",
+                "MODULE_ALLOCS",
+                i.first.c_str(),
+                st.n_recorded,
+                st.n_allocs,
+                st.alloc_b,
+                ci_half_width(st.alloc_var),
+                st.live_b
+            );
+        }
+    }
+
+    /**
+     *
+     */
+    static const char *
+    get_leak_origin_name(
+        int origin
+    ) {
+        return origin == 0 ? "MPI_Init" : "Post-MPI_Init";
+    }
+
+    /**
+     * Groups the heap allocations that are still live in a single pass over
+     * addr2entry. Allocations made in header mode aren't stored there, so
+     * they aren't included.
+     */
+    mmcu_leak_report
+    get_leaks(void) {
+        mmcu_leak_report leaks;
+        for (auto &i : addr2entry) {
+            const mmcu_memory_op_entry *const ope = i.second;
+            const int o = (ope->mpi_call_id == MMCU_MPI_CALL_INIT) ? 0 : 1;
+            leaks.totals[o].add(ope);
+            leaks.mpi_calls[o][ope->mpi_call_id].add(ope);
+            leaks.size_classes[o][get_size_class(ope->size)].add(ope);
+            leaks.callsites[o][ope->callsite].add(ope);
+        }
+        return leaks;
+    }
+
+    /**
+     * Emits heap allocations still live at MPI_Finalize per MPI call, module,
+     * and size class, separating MPI_Init's from later ones.
+     */
+    void
+    report_leaks(
+        FILE *reportf,
+        const mmcu_leak_report &leaks
+    ) {
+        const double now = mmcu_time();
+        //
+        fprintf(
+            reportf,
+            "# MPI Library Heap Allocations Outstanding at MPI_Finalize "
+            "Per MPI Function:\n"
+        );
+        fprintf(
+            reportf,
+            "# Fields: Origin Function Recorded Allocations Live_B "
+            "Oldest_Age_s\n"
+        );
+        for (int o = 0; o < n_leak_origins; ++o) {
+            for (int i = 0; i < MMCU_MPI_CALL_LAST; ++i) {
+                const mmcu_leak_stats &ls = leaks.mpi_calls[o][i];
+                if (ls.n_recorded == 0) continue;
+                fprintf(
+                    reportf, "%s %s %s %" PRIu64 " %.0lf %zd %lf\n",
+                    "LEAK_MPI_CALL",
+                    get_leak_origin_name(o),
+                    mmcu_mpi_call_name(i),
+                    ls.n_recorded,
+                    ls.n_allocs,
+                    ls.live_b,
+                    now - ls.oldest_at
+                );
+            }
+        }
+        //
+        fprintf(
+            reportf,
+            "# MPI Library Heap Allocations Outstanding at MPI_Finalize "
+            "Per Module:\n"
+        );
+        fprintf(
+            reportf,
+            "# Fields: Origin Module Recorded Allocations Live_B "
+            "Oldest_Age_s\n"
+        );
+        for (int o = 0; o < n_leak_origins; ++o) {
+            // Call sites are only resolved here, once each.
+            std::map<std::string, mmcu_leak_stats> modules;
+            for (auto &i : leaks.callsites[o]) {
+                modules[get_module_name(i.first)].merge(i.second);
+            }
+            for (auto &i : modules) {
+                const mmcu_leak_stats &ls = i.second;
+                fprintf(
+                    reportf, "%s %s %s %" PRIu64 " %.0lf %zd %lf\n",
+                    "LEAK_MODULE",
+                    get_leak_origin_name(o),
+                    i.first.c_str(),
+                    ls.n_recorded,
+                    ls.n_allocs,
+                    ls.live_b,
+                    now - ls.oldest_at
+                );
+            }
+        }
+        //
+        fprintf(
+            reportf,
+            "# MPI Library Heap Allocations Outstanding at MPI_Finalize "
+            "Per Size Class:\n"
+        );
+        fprintf(
+            reportf,
+            "# Fields: Origin Max_Size_B Recorded Allocations Live_B "
+            "Oldest_Age_s\n"
+        );
+        for (int o = 0; o < n_leak_origins; ++o) {
+            for (int i = 0; i < n_size_classes; ++i) {
+                const mmcu_leak_stats &ls = leaks.size_classes[o][i];
+                if (ls.n_recorded == 0) continue;
+                fprintf(
+                    reportf, "%s %s %" PRIu64 " %" PRIu64 " %.0lf %zd %lf\n",
+                    "LEAK_SIZE_CLASS",
+                    get_leak_origin_name(o),
+                    uint64_t(1) << i,
+                    ls.n_recorded,
+                    ls.n_allocs,
+                    ls.live_b,
+                    now - ls.oldest_at
+                );
+            }
+        }
+    }
+
+    /**
+     * Emits the non-empty bins of the per-MPI call heap allocation size and
+     * lifetime histograms.
+     */
+    void
+    report_alloc_histos(
+        FILE *reportf
+    ) {
+        fprintf(
+            reportf,
+            "# MPI Library Heap Allocation Sizes Per MPI Function:\n"
+        );
+        fprintf(reportf, "# Fields: Function Max_Size_B Allocations\n");
+        for (int i = 0; i < MMCU_MPI_CALL_LAST; ++i) {
+            const mmcu_alloc_histo &h = mpi_call_histos[i];
+            for (int b = 0; b < mmcu_alloc_histo::n_bins; ++b) {
+                if (h.size_counts[b] == 0.0) continue;
+                fprintf(
+                    reportf, "%s %s %" PRIu64 " %.0lf\n",
+                    "MPI_CALL_SIZE_HISTO",
+                    mmcu_mpi_call_name(i),
+                    uint64_t(1) << b,
+                    h.size_counts[b]
+                );
+            }
+        }
+        //
+        fprintf(
+            reportf,
+            "# MPI Library Heap Allocation Lifetimes Per MPI Function:\n"
+        );
+        fprintf(reportf, "# Fields: Function Max_Lifetime_us Frees\n");
+        for (int i = 0; i < MMCU_MPI_CALL_LAST; ++i) {
+            const mmcu_alloc_histo &h = mpi_call_histos[i];
+            for (int b = 0; b < mmcu_alloc_histo::n_bins; ++b) {
+                if (h.lifetime_counts[b] == 0.0) continue;
+                fprintf(
+                    reportf, "%s %s %" PRIu64 " %.0lf\n",
+                    "MPI_CALL_LIFETIME_HISTO",
+                    mmcu_mpi_call_name(i),
+                    uint64_t(1) << b,
+                    h.lifetime_counts[b]
+                );
+            }
+        }
+    }
+
+    /**
+     * Returns the power-of-two size class of the given allocation size: class
+     * i holds sizes in (2^(i - 1), 2^i].
+     */
+    static int
+    get_size_class(
+        size_t size
+    ) {
+        return mmcu_alloc_histo::get_bin(uint64_t(size));
+    }
+
+    /**
+     *
+     */
+    void
+    enter_phase_frame(
+        uint16_t phase,
+        bool pcontrol
+    ) {
+        mmcu_phase_frame frame;
+        frame.phase = phase;
+        frame.pcontrol = pcontrol;
+        frame.entered_at = mmcu_time();
+        frame.entered_mpi_b = current_mem_allocd;
+        frame.mpi_high_b = current_mem_allocd;
+        // Until the phase's first sample, the last one is the best we have.
+        if (n_app_pss_samples != 0) {
+            frame.pss_high_b = smaps_sample_vals[smaps_pss_col];
         }
-        // Now deal with the entry.
-        auto got = addr2entry.find(addr);
-        // New entry.
-        if (got == addr2entry.end()) {
-            addr2entry.insert(std::make_pair(addr, ope));
+        phase_stack.push_back(frame);
+        cur_phase = phase;
+        publish_telemetry_phase();
+    }
+
+    /**
+     * Adds the totals of the given exited frame to its phase and to the
+     * enclosing frame.
+     */
+    void
+    close_phase_frame(
+        const mmcu_phase_frame &frame,
+        double now
+    ) {
+        mmcu_phase &phase = phases[frame.phase];
+        phase.mpi_high_b = std::max(phase.mpi_high_b, frame.mpi_high_b);
+        phase.pss_high_b = std::max(phase.pss_high_b, frame.pss_high_b);
+        // If the phase encloses itself, the outer entry will count this.
+        bool nested_in_self = false;
+        for (auto &f : phase_stack) {
+            nested_in_self |= (f.phase == frame.phase);
         }
-        // Existing entry and free.
-        else if (opid == MMCU_HOOK_FREE) {
-            ope->size = got->second->size;
-            rm_ope = true;
+        if (!nested_in_self) {
+            phase.time_s += now - frame.entered_at;
+            phase.mpi_growth_b += current_mem_allocd - frame.entered_mpi_b;
+            phase.n_allocs += frame.n_allocs;
+            phase.n_frees += frame.n_frees;
         }
-        else {
-            static const ssize_t report_thresh = 1024 * 1024;
-            static ssize_t curious_b = 0;
-
-            curious_b += got->second->size;
+        //
+        if (phase_stack.empty()) return;
+        mmcu_phase_frame &outer = phase_stack.back();
+        outer.mpi_high_b = std::max(outer.mpi_high_b, frame.mpi_high_b);
+        outer.pss_high_b = std::max(outer.pss_high_b, frame.pss_high_b);
+        outer.n_allocs += frame.n_allocs;
+        outer.n_frees += frame.n_frees;
+    }
 
-            if (curious_b >= report_thresh) {
-                fprintf(
-                    stderr,
-                    "(pid: %d) WARNING: "
-                    "Number of \'curious operations\' "
-                    "exceeded threshold of %zd B\n",
-                    (int)getpid(),
-                    report_thresh
-                );
-                curious_b = 0;
-            }
-            return;
+    /**
+     * Emits per-phase totals. Phases that are still entered are exited first.
+     */
+    void
+    report_phases(
+        FILE *reportf
+    ) {
+        const double now = mmcu_time();
+        while (!phase_stack.empty()) {
+            const mmcu_phase_frame frame = phase_stack.back();
+            phase_stack.pop_back();
+            close_phase_frame(frame, now);
         }
+        // Phase 0 is never exited for good.
+        enter_phase_frame(0, false);
         //
-        update_current_mem_allocd(ope);
+        fprintf(reportf, "# Application Phases:\n");
+        fprintf(
+            reportf,
+            "# Fields: Phase Entries Time_s MPI_High_B Total_High_B "
+            "MPI_Growth_B Allocations Frees Name\n"
+        );
+        for (size_t i = 0; i < phases.size(); ++i) {
+            const mmcu_phase &phase = phases[i];
+            fprintf(
+                reportf,
+                "%s %zu %" PRIu64 " %lf %zd %zd %zd %" PRIu64 " %" PRIu64
+                " %s\n",
+                "PHASE",
+                i,
+                phase.n_entries,
+                phase.time_s,
+                phase.mpi_high_b,
+                phase.pss_high_b,
+                phase.mpi_growth_b,
+                phase.n_allocs,
+                phase.n_frees,
+                phase.name.c_str()
+            );
+        }
+    }
+
+    /**
+     * Emits the growth of MPI memory at first contact with a peer, and what it
+     * projects to when every rank talks to every other one.
+     */
+    void
+    report_peers(
+        FILE *reportf,
+        mmcu_rt *rt
+    ) {
+        // Largest job size projected to.
+        static const int64_t max_numpe = int64_t(1) << 20;
         //
-        update_all_pss_entries();
+        fprintf(
+            reportf,
+            "# MPI Library Memory Growth at First Contact With a Peer Per MPI "
+            "Function:\n"
+        );
+        fprintf(reportf, "# Fields: Function New_Peers Growth_B\n");
+        for (int i = 0; i < MMCU_MPI_CALL_LAST; ++i) {
+            if (peers.n_peers_per_call[i] == 0) continue;
+            fprintf(
+                reportf, "%s %s %" PRIu64 " %zd\n",
+                "PEER_FIRST_CONTACT",
+                mmcu_mpi_call_name(i),
+                peers.n_peers_per_call[i],
+                peers.growth_per_call_b[i]
+            );
+        }
         //
-        if (rm_ope) {
-            addr2entry.erase(got);
+        fprintf(
+            reportf,
+            "# Projected MPI Library Peer Memory (B) With Every Other Rank "
+            "Contacted:\n"
+        );
+        fprintf(reportf, "# Fields: Ranks Peer_B Peer_Error_B\n");
+        if (peers.n_peers == 0) return;
+        const double mean_b = peers.get_mean_b();
+        const double err_b = ci_half_width(peers.get_mean_var());
+        std::vector<int64_t> sizes = {int64_t(rt->numpe)};
+        for (int64_t n = 2; n <= max_numpe; n *= 2) {
+            if (n > rt->numpe) sizes.push_back(n);
+        }
+        for (const int64_t n : sizes) {
+            fprintf(
+                reportf, "%s %" PRId64 " %.0lf %.0lf\n",
+                "PEER_PROJECTION", n,
+                mean_b * double(n - 1), err_b * double(n - 1)
+            );
         }
     }
 
     /**
-     *
+     * Emits the number of outstanding requests over time next to MPI memory
+     * usage, per-call request totals, and the requests never completed.
      */
     void
-    report(
-        mmcu_rt *rt,
-        bool emit_report
+    report_requests(
+        FILE *reportf,
+        mmcu_rt *rt
     ) {
-        using namespace std;
+        // Max number of requests never completed that are listed.
+        static const size_t max_listed = 256;
         //
-        setbuf(stdout, NULL);
+        fprintf(
+            reportf,
+            "# Outstanding Requests and MPI Library Memory Usage (B) Over "
+            "Time (Since MPI_Init) (One Sample Per %" PRIu64 " Changes):\n",
+            request_samples.get_stride()
+        );
+        fprintf(reportf, "# Fields: Outstanding MPI_B\n");
+        for (auto &i : request_samples) {
+            fprintf(
+                reportf, "%s %lf %" PRIu64 " %zd\n",
+                "MPI_REQUESTS",
+                rt->get_report_time(std::get<0>(i)),
+                std::get<1>(i),
+                std::get<2>(i)
+            );
+        }
         //
-        if (rt->rank == 0) {
-            printf("\n#########################################################"
-                   "\n# MPI Memory Consumption Analysis Complete ##############"
-                   "\n#########################################################"
-                   "\n");
+        std::vector<mmcu_request_entry> never_completed;
+        never_completed.reserve(requests.size());
+        requests.for_each(
+            [&](const mmcu_request_entry &e) { never_completed.push_back(e); }
+        );
+        uint64_t n_never_completed[MMCU_MPI_CALL_LAST] = {};
+        for (const auto &e : never_completed) {
+            n_never_completed[e.mpi_call_id]++;
         }
         //
-        if (!emit_report) return;
-        char *output_dir = getenv("MMCU_REPORT_OUTPUT_PATH");
-        // Not set, so output to pwd.
-        if (!output_dir) {
-            output_dir = getenv("PWD");
+        fprintf(reportf, "# MPI Requests Per MPI Function:\n");
+        fprintf(
+            reportf,
+            "# Fields: Function Created Completed Never_Completed "
+            "Mean_Lifetime_s\n"
+        );
+        for (int i = 0; i < MMCU_MPI_CALL_LAST; ++i) {
+            if (n_requests_created[i] == 0) continue;
+            fprintf(
+                reportf, "%s %s %" PRIu64 " %" PRIu64 " %" PRIu64 " %lf\n",
+                "REQUEST_STATS",
+                mmcu_mpi_call_name(i),
+                n_requests_created[i],
+                n_requests_completed[i],
+                n_never_completed[i],
+                n_requests_completed[i] ?
+                    request_lifetime_s[i] / double(n_requests_completed[i]) :
+                    0.0
+            );
         }
-        if (!output_dir) {
-            fprintf(stderr, "Error saving report.\n");
-            return;
+        //
+        std::sort(
+            never_completed.begin(), never_completed.end(),
+            [](const mmcu_request_entry &a, const mmcu_request_entry &b) {
+                return a.created_at < b.created_at;
+            }
+        );
+        const size_t n_listed = std::min(never_completed.size(), max_listed);
+        fprintf(
+            reportf,
+            "# MPI Requests Never Completed (Oldest %zu of %zu):\n",
+            n_listed, never_completed.size()
+        );
+        fprintf(
+            reportf, "# Fields: Function Peer Tag Created_At MPI_B\n"
+        );
+        for (size_t i = 0; i < n_listed; ++i) {
+            const mmcu_request_entry &e = never_completed[i];
+            fprintf(
+                reportf, "%s %s %d %d %lf %" PRId64 "\n",
+                "UNCOMPLETED_REQUEST",
+                mmcu_mpi_call_name(e.mpi_call_id),
+                int(e.peer),
+                int(e.tag),
+                rt->get_report_time(e.created_at),
+                e.mpi_b
+            );
         }
+    }
 
-        char report_name[PATH_MAX];
-        snprintf(
-            report_name, sizeof(report_name) - 1, "%s/%d.%s",
-            output_dir, rt->rank, "mmcu"
+    /**
+     * Emits what calls allocated per payload size class. Eager protocols
+     * allocate in proportion to the payload, up to the eager limit; past it,
+     * rendezvous allocates little per call.
+     */
+    void
+    report_payloads(
+        FILE *reportf
+    ) {
+        fprintf(
+            reportf,
+            "# MPI Library Memory Allocated Per MPI Function and Payload "
+            "Size:\n"
         );
-
-        FILE *reportf = fopen(report_name, "w+");
-        if (!reportf) {
-            fprintf(stderr, "Error saving report to %s.\n", report_name);
-            return;
+        fprintf(
+            reportf,
+            "# Fields: Function Max_Payload_B Calls Allocating_Calls "
+            "Payload_B Alloc_B Growth_B Mean_Alloc_B\n"
+        );
+        for (int i = 0; i < MMCU_MPI_CALL_LAST; ++i) {
+            for (int b = 0; b < n_size_classes; ++b) {
+                const mmcu_payload_stats &ps = payload_stats[i][b];
+                if (ps.n_calls == 0) continue;
+                fprintf(
+                    reportf,
+                    "%s %s %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64
+                    " %" PRIu64 " %" PRId64 " %.0lf\n",
+                    "PAYLOAD_SIZE_CLASS",
+                    mmcu_mpi_call_name(i),
+                    uint64_t(1) << b,
+                    ps.n_calls,
+                    ps.n_allocating,
+                    ps.payload_b,
+                    ps.alloc_b,
+                    ps.growth_b,
+                    double(ps.alloc_b) / double(ps.n_calls)
+                );
+            }
         }
+    }
 
-        fprintf(reportf, "# [Run Info Begin]\n");
-
+    /**
+     * Emits the number of live derived datatypes and the memory they hold
+     * over time, per-call datatype totals, and the datatypes never freed.
+     */
+    void
+    report_datatypes(
+        FILE *reportf,
+        mmcu_rt *rt
+    ) {
+        // Max number of datatypes never freed that are listed.
+        static const size_t max_listed = 256;
+        //
         fprintf(
             reportf,
-            "# Report Date Time: %s\n",
-            rt->get_date_time_str_now().c_str()
+            "# Live Derived Datatypes and Their MPI Library Memory Usage (B) "
+            "Over Time (Since MPI_Init) (One Sample Per %" PRIu64
+            " Changes):\n",
+            datatype_samples.get_stride()
         );
-
-        fprintf(reportf, "# Application Name: %s\n", rt->get_app_name().c_str());
-
-        fprintf(reportf, "# Hostname: %s\n", rt->get_hostname().c_str());
-
-        fprintf(reportf, "# MPI_COMM_WORLD Rank: %d\n", rt->rank);
-
-        fprintf(reportf, "# MPI_COMM_WORLD Size: %d\n", rt->numpe);
-        // Time from 0 to what is reported.
-        const double time_to_init = rt->get_init_end_time()
-                                  - rt->get_init_begin_time();
-        fprintf(reportf, "# MPI Init Time (s): %lf\n", time_to_init);
-
+        fprintf(reportf, "# Fields: Live Growth_B\n");
+        for (auto &i : datatype_samples) {
+            fprintf(
+                reportf, "%s %lf %" PRIu64 " %" PRId64 "\n",
+                "DATATYPE_USAGE",
+                rt->get_report_time(std::get<0>(i)),
+                std::get<1>(i),
+                std::get<2>(i)
+            );
+        }
+        //
+        std::vector<mmcu_datatype_entry> never_freed;
+        never_freed.reserve(datatypes.size());
+        uint64_t n_never_freed[MMCU_MPI_CALL_LAST] = {};
+        int64_t never_freed_b[MMCU_MPI_CALL_LAST] = {};
+        for (const auto &dt : datatypes) {
+            never_freed.push_back(dt.second);
+            n_never_freed[dt.second.mpi_call_id]++;
+            never_freed_b[dt.second.mpi_call_id] += dt.second.growth_b;
+        }
+        //
+        fprintf(reportf, "# Derived Datatypes Per MPI Function:\n");
         fprintf(
             reportf,
-            "# Number of Operation Captures Performed: %" PRIu64 "\n",
-            num_captures
+            "# Fields: Function Created Freed Never_Freed Alloc_B "
+            "Never_Freed_Growth_B\n"
         );
-
+        for (int i = 0; i < MMCU_MPI_CALL_LAST; ++i) {
+            if (n_datatypes_created[i] == 0) continue;
+            fprintf(
+                reportf,
+                "%s %s %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64
+                " %" PRId64 "\n",
+                "DATATYPE_STATS",
+                mmcu_mpi_call_name(i),
+                n_datatypes_created[i],
+                n_datatypes_freed[i],
+                n_never_freed[i],
+                datatype_alloc_b[i],
+                never_freed_b[i]
+            );
+        }
+        //
+        std::sort(
+            never_freed.begin(), never_freed.end(),
+            [](const mmcu_datatype_entry &a, const mmcu_datatype_entry &b) {
+                return a.created_at < b.created_at;
+            }
+        );
+        const size_t n_listed = std::min(never_freed.size(), max_listed);
         fprintf(
             reportf,
-            "# Number of Memory Operations Recorded: %" PRIu64 "\n",
-            n_mem_ops_recorded
+            "# Derived Datatypes Never Freed (Oldest %zu of %zu):\n",
+            n_listed, never_freed.size()
         );
-
         fprintf(
             reportf,
-            "# Number of Allocation-Related Operations Recorded: %" PRIu64 "\n",
-            n_mem_alloc_ops
+            "# Fields: Function Created_At Committed Alloc_B Growth_B\n"
         );
+        for (size_t i = 0; i < n_listed; ++i) {
+            const mmcu_datatype_entry &e = never_freed[i];
+            fprintf(
+                reportf, "%s %s %lf %d %" PRIu64 " %" PRId64 "\n",
+                "DATATYPE_LEAK",
+                mmcu_mpi_call_name(e.mpi_call_id),
+                rt->get_report_time(e.created_at),
+                int(e.committed),
+                e.alloc_b,
+                e.growth_b
+            );
+        }
+    }
 
+    /**
+     * Emits what made up the MPI and the whole-process high watermarks. The
+     * MPI breakdowns are the live heap bytes at the latest peak.
+     */
+    void
+    report_peak_composition(
+        FILE *reportf,
+        mmcu_rt *rt
+    ) {
+        // Not all of them, since there can be many.
+        static const size_t max_callsites = 32;
+        //
         fprintf(
             reportf,
-            "# Number of Deallocation-Related Operations Recorded: %" PRIu64 "\n",
-            n_mem_free_ops
+            "# MPI Library Heap Live at High Memory Usage Watermark "
+            "(%lf s Since MPI_Init) Per MPI Function:\n",
+            mpi_peak_gen ? rt->get_report_time(mpi_peak_time) : 0.0
         );
-
+        fprintf(reportf, "# Fields: Function Live_B\n");
+        for (int i = 0; i < MMCU_MPI_CALL_LAST; ++i) {
+            const ssize_t live_b = mpi_call_stats[i].get_peak_live_b(
+                                       mpi_peak_gen
+                                   );
+            if (live_b == 0) continue;
+            fprintf(
+                reportf, "%s %s %zd\n",
+                "PEAK_MPI_CALL_LIVE", mmcu_mpi_call_name(i), live_b
+            );
+        }
+        //
         fprintf(
             reportf,
-            "# Number of MPI Library PSS Samples Collected: %" PRIu64 "\n",
-            n_mpi_pss_samples
+            "# MPI Library Heap Live at High Memory Usage Watermark "
+            "Per Size Class:\n"
         );
-
+        fprintf(reportf, "# Fields: Max_Size_B Live_B\n");
+        for (int i = 0; i < n_size_classes; ++i) {
+            const ssize_t live_b = size_class_stats[i].get_peak_live_b(
+                                       mpi_peak_gen
+                                   );
+            if (live_b == 0) continue;
+            fprintf(
+                reportf, "%s %" PRIu64 " %zd\n",
+                "PEAK_SIZE_CLASS_LIVE", uint64_t(1) << i, live_b
+            );
+        }
+        //
+        std::vector<std::pair<ssize_t, uintptr_t>> sites;
+        for (auto &i : callsite_stats) {
+            const ssize_t live_b = i.second.get_peak_live_b(mpi_peak_gen);
+            if (live_b == 0) continue;
+            sites.push_back(std::make_pair(live_b, i.first));
+        }
+        std::sort(sites.rbegin(), sites.rend());
+        if (sites.size() > max_callsites) {
+            sites.resize(max_callsites);
+        }
         fprintf(
             reportf,
-            "# Number of Application PSS Samples Collected: %" PRIu64 "\n",
-            n_app_pss_samples
+            "# MPI Library Heap Live at High Memory Usage Watermark "
+            "Per Call Site (Top %zu):\n",
+            max_callsites
         );
-
+        fprintf(reportf, "# Fields: Call_Site Module Live_B\n");
+        for (auto &i : sites) {
+            fprintf(
+                reportf, "%s 0x%" PRIxPTR " %s %zd\n",
+                "PEAK_CALLSITE_LIVE",
+                i.second,
+                get_module_name(i.second).c_str(),
+                i.first
+            );
+        }
+        //
         fprintf(
             reportf,
-            "# High Memory Usage Watermark (MPI) (MB): %lf\n",
+            "# Application smaps Field Totals (B) at High Memory Usage "
+            "Watermark (%lf s Since MPI_Init):\n",
+            pss_peak_smaps_vals.empty() ?
+                0.0 : rt->get_report_time(pss_peak_time)
+        );
+        fprintf(reportf, "# Fields: Field Total_B\n");
+        for (size_t i = 0; i < pss_peak_smaps_vals.size(); ++i) {
+            fprintf(
+                reportf, "%s %s %zd\n",
+                "PEAK_SMAPS",
+                smaps_samples.fields[i].c_str(),
+                pss_peak_smaps_vals[i]
+            );
+        }
+    }
+
+    /**
+     * Writes the state of this rank as of now to the next numbered snapshot
+     * file, with at most the given number of recent samples of each kind.
+     * Returns the file's name, or an empty string if it couldn't be written.
+     */
+    std::string
+    write_snapshot(
+        const char *reason,
+        uint64_t max_samples
+    ) {
+        const uint32_t snapshot_id = n_snapshots_written++;
+        //
+        mmcu_rt *rt = mmcu_rt::the_mmcu_rt();
+        const char *output_dir = get_output_dir();
+        if (!output_dir) {
+            fprintf(
+                stderr, "(pid: %d) WARNING: cannot save snapshot %u.\n",
+                (int)getpid(), snapshot_id
+            );
+            return "";
+        }
+        char snapshot_name[PATH_MAX];
+        snprintf(
+            snapshot_name, sizeof(snapshot_name) - 1, "%s/%d.%s.%u",
+            output_dir, rt->rank, "mmcu.snapshot", snapshot_id
+        );
+        FILE *snapf = fopen(snapshot_name, "w+");
+        if (!snapf) {
+            fprintf(
+                stderr, "(pid: %d) WARNING: cannot save snapshot to %s: %s\n",
+                (int)getpid(), snapshot_name, strerror(errno)
+            );
+            return "";
+        }
+        //
+        const ssize_t pss_b =
+            n_app_pss_samples ? smaps_sample_vals[smaps_pss_col] : 0;
+        //
+        fprintf(snapf, "# [Snapshot Begin]\n");
+        fprintf(snapf, "# Snapshot Number: %u\n", snapshot_id);
+        fprintf(snapf, "# Snapshot Reason: %s\n", reason);
+        fprintf(
+            snapf, "# Snapshot Date Time: %s\n",
+            rt->get_date_time_str_now().c_str()
+        );
+        fprintf(snapf, "# Application Name: %s\n", rt->get_app_name().c_str());
+        fprintf(snapf, "# MPI_COMM_WORLD Rank: %d\n", rt->rank);
+        fprintf(
+            snapf, "# Time Since MPI_Init (s): %lf\n",
+            rt->get_report_time(mmcu_time())
+        );
+        fprintf(
+            snapf, "# Current Application Phase: %s\n",
+            phases[cur_phase].name.c_str()
+        );
+        fprintf(
+            snapf,
+            "# Number of Allocation-Related Operations Recorded: %" PRIu64 "\n",
+            n_mem_alloc_ops
+        );
+        fprintf(
+            snapf,
+            "# Number of Deallocation-Related Operations Recorded: %" PRIu64
+            "\n",
+            n_mem_free_ops
+        );
+        fprintf(
+            snapf, "# Current Memory Usage (MPI) (MB): %lf\n",
+            tomb(current_mem_allocd)
+        );
+        fprintf(
+            snapf, "# Current Memory Usage Error (MPI) (MB): %lf\n",
+            tomb(ci_half_width(current_mem_var))
+        );
+        fprintf(
+            snapf, "# Current Heap Usage (MPI) (MB): %lf\n",
+            tomb(current_malloc_requested)
+        );
+        fprintf(
+            snapf, "# Current mmap Mapped (MPI) (MB): %lf\n",
+            tomb(current_mmap_mapped)
+        );
+        fprintf(
+            snapf, "# Current mmap Resident (MPI) (MB): %lf\n",
+            tomb(current_mmap_resident)
+        );
+        fprintf(
+            snapf, "# High Memory Usage Watermark (MPI) (MB): %lf\n",
             tomb(mpi_high_mem_usage_mark)
         );
-
+        // As of the latest sample.
+        fprintf(
+            snapf,
+            "# Current Memory Usage (Application + MPI) (MB): %lf\n",
+            tomb(pss_b)
+        );
         fprintf(
-            reportf,
+            snapf,
             "# High Memory Usage Watermark (Application + MPI) (MB): %lf\n",
             tomb(pss_high_mem_usage_mark)
         );
-
-        fprintf(reportf, "# [Run Info End]\n");
-
-        ////////////////////////////////////////////////////////////////////////
-        const double init_time = rt->get_init_begin_time();
         fprintf(
-            reportf,
-            "# MPI Library Memory Usage (B) Over Time "
-            "(Since MPI_Init):\n"
+            snapf, "# Outstanding Requests (MPI): %zu\n", requests.size()
         );
-        for (auto &i : mem_allocd_samples) {
+        fprintf(
+            snapf, "# Live Derived Datatypes (MPI): %zu\n", datatypes.size()
+        );
+        fprintf(snapf, "# [Snapshot End]\n");
+        //
+        const size_t n_mpi = std::min<uint64_t>(
+            mem_allocd_samples.size(), max_samples
+        );
+        fprintf(
+            snapf,
+            "# Recent MPI Library Memory Usage (B) (Since MPI_Init) "
+            "(Last %zu):\n",
+            n_mpi
+        );
+        for (size_t i = mem_allocd_samples.size() - n_mpi;
+             i < mem_allocd_samples.size(); ++i) {
+            const auto &smp = mem_allocd_samples[i];
             fprintf(
-                reportf, "%s %lf %zd\n",
+                snapf, "%s %lf %zd %u\n",
                 "MPI_MEM_USAGE",
-                i.first - init_time,
-                i.second
+                rt->get_report_time(std::get<0>(smp)),
+                std::get<1>(smp),
+                unsigned(std::get<2>(smp))
             );
         }
-
+        const size_t n_pss = std::min<uint64_t>(
+            smaps_samples.size(), max_samples
+        );
         fprintf(
-            reportf,
-            "# Application Memory Usage (B) Over Time "
-            "(Since MPI_Init):\n"
+            snapf,
+            "# Recent Application Memory Usage (B) (Since MPI_Init) "
+            "(Last %zu):\n",
+            n_pss
         );
-        for (auto &i : pss_total_samples) {
+        const std::vector<ssize_t> &pss_col = smaps_samples.cols[
+                                                  smaps_pss_col
+                                              ];
+        for (size_t i = smaps_samples.size() - n_pss;
+             i < smaps_samples.size(); ++i) {
             fprintf(
-                reportf, "%s %lf %zd\n",
+                snapf, "%s %lf %zd %u\n",
                 "ALL_MEM_USAGE",
-                i.first - init_time,
-                i.second
+                rt->get_report_time(smaps_samples.times[i]),
+                pss_col[i],
+                unsigned(smaps_samples.phases[i])
             );
         }
+        //
+        report_live_allocs(snapf);
+        //
+        report_peak_composition(snapf, rt);
+        //
+        fclose(snapf);
+        fprintf(
+            stderr, "(pid: %d) Snapshot written to %s\n",
+            (int)getpid(), snapshot_name
+        );
+        return snapshot_name;
+    }
 
-        fclose(reportf);
+    /**
+     *
+     */
+    void
+    add_total_allocd_b(
+        uint64_t b
+    ) {
+        // Only written with the hooks lock held.
+        __atomic_store_n(
+            &total_allocd_b, total_allocd_b + b, __ATOMIC_RELAXED
+        );
+    }
 
-        if (rt->rank == 0) {
-            printf("# Report written to %s\n", output_dir);
-        }
+    /**
+     * Samples the number of live derived datatypes and the memory they hold.
+     */
+    void
+    add_datatype_sample(
+        double now
+    ) {
+        datatype_samples.push_back(
+            std::make_tuple(now, uint64_t(datatypes.size()), datatypes_live_b)
+        );
     }
 
     /**
-     *
+     * Samples the number of outstanding requests next to MPI memory usage.
      */
     void
-    update_mem_stats(bool sample = false) {
-        if (current_mem_allocd > mpi_high_mem_usage_mark) {
-            mpi_high_mem_usage_mark = current_mem_allocd;
-        }
+    add_request_sample(
+        double now
+    ) {
+        const uint64_t n = requests.size();
+        request_samples.push_back(
+            std::make_tuple(now, n, current_mem_allocd)
+        );
+        request_fit.add(double(n), double(current_mem_allocd));
+    }
+
+    /**
+     * Feeds the current MPI memory usage to the growth detector, and warns
+     * if it has been growing for too long.
+     */
+    void
+    add_growth_sample(
+        double now
+    ) {
+        growth_last_time = now;
+        // Leave MPI_Init out: what it allocates is mostly one-time setup.
+        const double init_end = mmcu_rt::the_mmcu_rt()->get_init_end_time();
+        if (init_end == 0.0 || now < init_end) return;
         //
-        if (sample || n_mem_ops_recorded++ % mem_allocd_sample_freq == 0) {
-            mem_allocd_samples.push_back(
-                std::make_pair(mmcu_time(), current_mem_allocd)
-            );
-        }
-        // Gather total process memory usage also.
-        if (sample || n_mem_ops_recorded % pss_totals_sample_freq == 0) {
-            n_app_pss_samples++;
-            //
-            ssize_t pss_total = 0;
-            get_proc_self_smaps_pss_total(pss_total);
-            pss_total_samples.push_back(
-                std::make_pair(mmcu_time(), pss_total)
-            );
-            //
-            if (pss_total > pss_high_mem_usage_mark) {
-                pss_high_mem_usage_mark = pss_total;
-            }
-        }
+        mmcu_linear_fit recent;
+        if (!growth.add(
+                now - init_end, double(current_mem_allocd),
+                recent, sample_ci_z
+            )) return;
+        fprintf(
+            stderr,
+            "(pid: %d) WARNING: rank %d: MPI memory usage has been growing "
+            "at %lf MB/h (+/- %lf MB/h) for the last %.0lf s "
+            "(now %lf MB).\n",
+            (int)getpid(), mmcu_rt::the_mmcu_rt()->rank,
+            to_mb_per_h(recent.get_slope()),
+            to_mb_per_h(sample_ci_z * recent.get_slope_stderr()),
+            recent.get_span(), tomb(current_mem_allocd)
+        );
+    }
 
-        if (sample) {
-            update_all_pss_entries(sample);
+    /**
+     * Reports a crossed alert threshold with a snapshot that has the whole
+     * timeline. If asked to, also has the job aborted (see abort_requested)
+     * before the OOM killer gets a chance to.
+     */
+    void
+    raise_alert(
+        const char *what,
+        ssize_t value_b,
+        const char *threshold_name,
+        ssize_t threshold_b
+    ) {
+        const int rank = mmcu_rt::the_mmcu_rt()->rank;
+        char reason[256];
+        snprintf(
+            reason, sizeof(reason), "%s (%lf MB) crossed %s (%lf MB)",
+            what, tomb(value_b), threshold_name, tomb(threshold_b)
+        );
+        fprintf(
+            stderr, "(pid: %d) WARNING: rank %d: %s\n",
+            (int)getpid(), rank, reason
+        );
+        const std::string snapshot_name = write_snapshot(
+                                              reason, UINT64_MAX
+                                          );
+        //
+        if (alert_abort) {
+            fprintf(
+                stderr,
+                "(pid: %d) ERROR: rank %d: aborting the job, since "
+                "MMCU_ALERT_ABORT is set. %s (see %s).\n",
+                (int)getpid(), rank, reason, snapshot_name.c_str()
+            );
+            abort_pending.store(true, std::memory_order_relaxed);
         }
     }
 
-private:
-
     /**
-     *
+     * Publishes this rank's usage to the node and checks the node-level
+     * thresholds. Every rank on the node writes a snapshot once any of them
+     * has crossed one.
      */
     void
-    update_all_pss_entries(bool samp = false)
-    {
-        if (!samp && n_mpi_pss_samples_requested++ % mpi_pss_update_freq != 0) {
-            return;
+    check_node_alerts(
+        ssize_t pss_b
+    ) {
+        ssize_t node_mpi_b = 0, node_pss_b = 0;
+        node_usage.update(current_mem_allocd, pss_b, node_mpi_b, node_pss_b);
+        //
+        if (alert_node_mpi_b != 0 && node_mpi_b >= alert_node_mpi_b) {
+            node_usage.raise_alert();
+            node_alert_handled = true;
+            raise_alert(
+                "Node MPI memory usage", node_mpi_b,
+                "MMCU_ALERT_NODE_BYTES", alert_node_mpi_b
+            );
+            alert_node_mpi_b = 0;
         }
-
-        n_mpi_pss_samples++;
-
-        for (auto &me : addr2mmap_entry) {
-            mmcu_memory_op_entry *const e = me.second;
-            switch (e->opid) {
-                case(MMCU_HOOK_MMAP_PSS_UPDATE): {
-                    const ssize_t old_size = e->size;
-                    // Next capture the new PSS value.
-                    mmcu_proc_smaps_entry maps_entry;
-                    get_proc_self_smaps_entry(e->addr, maps_entry);
-                    const ssize_t new_size = maps_entry.pss_in_b;
-                    // Free up old size.
-                    e->size = -old_size;
-                    update_current_mem_allocd(e, true /* internal_bookkeeping */);
-                    // Now include new size.
-                    e->size = new_size;
-                    break;
-                }
-                case(MMCU_HOOK_MUNMAP):
-                    // Nothing to do.
-                    break;
-                default:
-                    fprintf(
-                        stderr,
-                        "(pid: %d) WARNING: unexpected opid (%d)\n",
-                        (int)getpid(),
-                        (int)e->opid
-                    );
-                    // Bail.
-                    return;
-            }
-            //
-            update_current_mem_allocd(e);
+        if (alert_node_pss_b != 0 && node_pss_b >= alert_node_pss_b) {
+            node_usage.raise_alert();
+            node_alert_handled = true;
+            raise_alert(
+                "Node Application + MPI memory usage", node_pss_b,
+                "MMCU_ALERT_NODE_PSS_BYTES", alert_node_pss_b
+            );
+            alert_node_pss_b = 0;
+        }
+        if (!node_alert_handled && node_usage.alert_raised()) {
+            node_alert_handled = true;
+            (void)write_snapshot("Node-level alert", UINT64_MAX);
         }
     }
 
     /**
-     *
+     * Emits what the MPI library's live heap bytes are made up of now.
      */
     void
-    capture_mmap_ops(
-        mmcu_memory_op_entry *const ope
+    report_live_allocs(
+        FILE *reportf
     ) {
-        bool rm_ope = false;
-        const uintptr_t addr = ope->addr;
-        const uint8_t opid = ope->opid;
+        // Not all of them, since there can be many.
+        static const size_t max_callsites = 32;
         //
-        auto got = addr2mmap_entry.find(addr);
-        // New entry.
-        if (got == addr2mmap_entry.end()) {
-            assert(opid == MMCU_HOOK_MMAP);
-            // Grab PSS stats.
-            mmcu_proc_smaps_entry maps_entry;
-            get_proc_self_smaps_entry(addr, maps_entry);
-            // Update opid.
-            ope->opid = MMCU_HOOK_MMAP_PSS_UPDATE;
-            // Update size.
-            // The mmap length is initially captured, so update to PSS.
-            ope->size = maps_entry.pss_in_b;
-            // Add updated entry to map.
-            addr2mmap_entry.insert(std::make_pair(addr, ope));
-            // A new alloc operation not accounted for in capture because mmap
-            // isn't recognized as a first-class operation.
-            n_mem_alloc_ops++;
-        }
-        // Existing entry and munmap.
-        else if (opid == MMCU_HOOK_MUNMAP) {
-            // munmap already has the size, unlike free.
-            rm_ope = true;
-        }
-        // Something went wrong.
-        else {
+        fprintf(
+            reportf,
+            "# MPI Library Heap Live Per MPI Function:\n"
+        );
+        fprintf(reportf, "# Fields: Function Live_B High_Live_B\n");
+        for (int i = 0; i < MMCU_MPI_CALL_LAST; ++i) {
+            const mmcu_alloc_stats &st = mpi_call_stats[i];
+            if (st.live_b == 0) continue;
             fprintf(
-                stderr,
-                "(pid: %d) WARNING: "
-                "existing entry (%p) not a munmap (OP: %d)\n",
-                (int)getpid(),
-                (void *)addr,
-                (int)opid
+                reportf, "%s %s %zd %zd\n",
+                "LIVE_MPI_CALL", mmcu_mpi_call_name(i),
+                st.live_b, st.high_live_b
             );
-            return;
         }
         //
-        update_current_mem_allocd(ope);
+        fprintf(
+            reportf,
+            "# MPI Library Heap Live Per Size Class:\n"
+        );
+        fprintf(reportf, "# Fields: Max_Size_B Live_B\n");
+        for (int i = 0; i < n_size_classes; ++i) {
+            const ssize_t live_b = size_class_stats[i].live_b;
+            if (live_b == 0) continue;
+            fprintf(
+                reportf, "%s %" PRIu64 " %zd\n",
+                "LIVE_SIZE_CLASS", uint64_t(1) << i, live_b
+            );
+        }
         //
-        if (rm_ope) {
-            addr2mmap_entry.erase(got);
+        std::vector<std::pair<ssize_t, uintptr_t>> sites;
+        for (auto &i : callsite_stats) {
+            if (i.second.live_b == 0) continue;
+            sites.push_back(std::make_pair(i.second.live_b, i.first));
+        }
+        std::sort(sites.rbegin(), sites.rend());
+        if (sites.size() > max_callsites) {
+            sites.resize(max_callsites);
+        }
+        fprintf(
+            reportf,
+            "# MPI Library Heap Live Per Call Site (Top %zu):\n",
+            max_callsites
+        );
+        fprintf(reportf, "# Fields: Call_Site Module Live_B\n");
+        for (auto &i : sites) {
+            fprintf(
+                reportf, "%s 0x%" PRIxPTR " %s %zd\n",
+                "LIVE_CALLSITE",
+                i.second,
+                get_module_name(i.second).c_str(),
+                i.first
+            );
         }
     }
 
@@ -812,142 +5281,144 @@ private:
      *
      */
     void
-    break_down_realloc(
-        mmcu_memory_op_entry *const ope
-    ) {
-        const uintptr_t addr = ope->addr;
-        const uintptr_t old_addr = ope->old_addr;
-        const size_t size = ope->size;
-        // Returned NULL, so old_addr was unchanged.
-        if (!addr) {
-            // Nothing to do.
-            ope->opid = MMCU_HOOK_NOOP;
+    sample_malloc_stats(void) {
+        const mmcu_malloc_stats ms = mmcu_malloc_stats::sample();
+        malloc_sample_vals = {
+            current_malloc_requested,
+            current_malloc_usable,
+            ssize_t(ms.arena_b),
+            ssize_t(ms.in_use_b),
+            ssize_t(ms.free_b)
+        };
+        malloc_samples.push_back(mmcu_time(), malloc_sample_vals, cur_phase);
+    }
+
+    /**
+     * Returns the resident bytes of the pages that back live MPI heap
+     * allocations. Pages shared with application allocations are counted in
+     * full, so this is an upper bound.
+     */
+    size_t
+    get_malloc_resident_bytes(void) {
+        static const uintptr_t pgsz = sysconf(_SC_PAGESIZE);
+        //
+        std::vector< std::pair<uintptr_t, uintptr_t> > runs;
+        runs.reserve(addr2entry.size());
+        for (auto &i : addr2entry) {
+            const mmcu_memory_op_entry *const e = i.second;
+            if (e->usable_size == 0) continue;
+            runs.push_back(std::make_pair(
+                e->addr & ~(pgsz - 1),
+                (e->addr + e->usable_size + pgsz - 1) & ~(pgsz - 1)
+            ));
         }
-        // Acts like free.
-        else if (size == 0 && old_addr) {
-            auto got = addr2entry.find(old_addr);
-            if (got != addr2entry.end()) {
-                ope->opid = MMCU_HOOK_FREE;
-                // Will be looked up in terms of addr, so update.
-                ope->addr = old_addr;
-            }
-            // Probably an application bug, so do nothing.
-            else {
-                ope->opid = MMCU_HOOK_NOOP;
+        std::sort(runs.begin(), runs.end());
+        // Coalesce, so that each page is only counted once.
+        size_t resident_b = 0;
+        for (size_t i = 0; i < runs.size(); ) {
+            uintptr_t start = runs[i].first, end = runs[i].second;
+            for (++i; i < runs.size() && runs[i].first <= end; ++i) {
+                end = std::max(end, runs[i].second);
             }
+            resident_b += mmcu_mem_residency::get_resident_bytes(
+                              start, end - start
+                          );
         }
-        // Acts like malloc.
-        else if (!old_addr) {
-            ope->opid = MMCU_HOOK_MALLOC;
-        }
-        // Area pointed to was moved.
-        else if (old_addr != addr) {
-            // New region was first created.
-            ope->opid = MMCU_HOOK_MALLOC;
-            capture(ope);
-            // Old region was freed.
-            ope->opid = MMCU_HOOK_FREE;
-            // Will be looked up in terms of addr, so update.
-            ope->addr = old_addr;
-            // The final capture will be done below.
-        }
-        // Area pointed to was not moved, but perhaps some other shuffling was
-        // done.
-        else {
-            // I'm not sure if this is the best way to capture this... Ideas..?
-            // First remove old entry. old_addr and addr should be equal.
-            // This first bit should decrement memory usage by the old size.
-            ope->opid = MMCU_HOOK_FREE;
-            capture(ope);
-            // Now increment memory usage by the new size.
-            ope->opid = MMCU_HOOK_MALLOC;
-            ope->size = size;
-        }
-        capture(ope);
+        return resident_b;
     }
 
     /**
-     *
+     * NUMA sample layout: the local node, then the MPI mmap bytes on each
+     * node, then the process bytes on each node.
      */
-    double
-    tomb(size_t inb) {
-        return (double(inb) / 1024.0 / 1024.0);
+    void
+    set_numa_fields(void) {
+        const int n_nodes = mmcu_numa::get_num_nodes();
+        std::vector<std::string> fields(1, "Local_Node");
+        for (int n = 0; n < n_nodes; ++n) {
+            fields.push_back("MPI_N" + std::to_string(n));
+        }
+        for (int n = 0; n < n_nodes; ++n) {
+            fields.push_back("ALL_N" + std::to_string(n));
+        }
+        numa_samples.set_fields(fields);
     }
 
     /**
      *
      */
     void
-    update_current_mem_allocd(
-        mmcu_memory_op_entry *const ope,
-        bool internal_bookkeeping = false
-    ) {
-        const uint8_t opid = ope->opid;
-        const size_t size = ope->size;
-
-        switch (opid) {
-            case (MMCU_HOOK_MALLOC):
-            case (MMCU_HOOK_CALLOC):
-            case (MMCU_HOOK_POSIX_MEMALIGN):
-                n_mem_alloc_ops++;
-                current_mem_allocd += size;
-                break;
-            case (MMCU_HOOK_FREE):
-            case (MMCU_HOOK_MUNMAP):
-                n_mem_free_ops++;
-                current_mem_allocd -= size;
-                break;
-            case (MMCU_HOOK_MMAP_PSS_UPDATE):
-                // Here size may be positive or negative.
-                current_mem_allocd += size;
-                break;
-            case (MMCU_HOOK_NOOP):
-                // Nothing to do.
-                break;
-            default:
-                // Note: MMCU_HOOK_REALLOC and MMCU_HOOK_MMAP are always broken
-                // down in terms of other operations, so they will never reach
-                // this code path.
-                assert(false && "Invalid opid");
+    sample_numa(void) {
+        const size_t n_nodes = mmcu_numa::get_num_nodes();
+        const int local_node = mmcu_numa::get_local_node();
+        //
+        std::vector<ssize_t> mpi_b(n_nodes, 0), all_b(n_nodes, 0);
+        for (auto &i : addr2mmap_entry) {
+            mmcu_numa::add_region_node_bytes(
+                i.second->addr, i.second->map_len, mpi_b
+            );
         }
+        mmcu_numa::get_proc_self_node_totals(all_b);
         //
-        if (!internal_bookkeeping) {
-            update_mem_stats();
+        numa_sample_vals.assign(1, local_node);
+        auto &vals = numa_sample_vals;
+        vals.insert(vals.end(), mpi_b.begin(), mpi_b.end());
+        vals.insert(vals.end(), all_b.begin(), all_b.end());
+        numa_samples.push_back(mmcu_time(), numa_sample_vals, cur_phase);
+        //
+        ssize_t mpi_total = 0, mpi_remote = 0;
+        for (size_t n = 0; n < n_nodes; ++n) {
+            mpi_total += mpi_b[n];
+            if (int(n) != local_node) mpi_remote += mpi_b[n];
+        }
+        if (mpi_total > 0) {
+            const double frac = double(mpi_remote) / double(mpi_total);
+            if (frac > numa_remote_mpi_high_frac) {
+                numa_remote_mpi_high_frac = frac;
+            }
         }
     }
 
     /**
-     *
+     * Sets the smaps fields to capture from a comma-separated list.
      */
     void
-    get_proc_self_smaps_entry(
-        uintptr_t target_addr,
-        mmcu_proc_smaps_entry &res_entry
+    set_smaps_fields(
+        const char *field_list
     ) {
-        bool found_entry = false;
-        static const int n_tries = 5;
-        for (int i = 0; i < n_tries && !found_entry; ++i) {
-            mmcu_proc_smaps_parser::get_proc_self_smaps_entry(
-                target_addr, res_entry, found_entry
-            );
+        std::vector<std::string> fields;
+        //
+        const std::string fl(field_list ? field_list : smaps_default_fields);
+        size_t pos = 0;
+        while (pos <= fl.size()) {
+            size_t next = fl.find(',', pos);
+            if (next == std::string::npos) next = fl.size();
+            const std::string f = fl.substr(pos, next - pos);
+            if (!f.empty() &&
+                std::find(fields.begin(), fields.end(), f) == fields.end()) {
+                fields.push_back(f);
+            }
+            pos = next + 1;
         }
-        if (!found_entry) {
-            fprintf(
-                stderr,
-                "(pid: %d) WARNING: "
-                "missing /proc/self/smaps entry!\n",
-                (int)getpid()
-            );
+        //
+        auto pssi = std::find(fields.begin(), fields.end(), "Pss");
+        if (pssi == fields.end()) {
+            pssi = fields.insert(fields.begin(), "Pss");
         }
+        smaps_pss_col = size_t(pssi - fields.begin());
+        //
+        smaps_samples.set_fields(fields);
     }
 
     /**
      *
      */
     void
-    get_proc_self_smaps_pss_total(
-        ssize_t &pss_total_in_b
+    get_proc_self_smaps_field_totals(
+        std::vector<ssize_t> &totals_in_b
     ) {
-        mmcu_proc_smaps_parser::get_proc_self_smaps_pss_total(pss_total_in_b);
+        mmcu_proc_smaps_parser::get_proc_self_smaps_field_totals(
+            smaps_samples.fields, totals_in_b
+        );
     }
 };
@@ -0,0 +1,80 @@
+/*
+ * Copyright (c)      2017 Los Alamos National Security, LLC.
+ *                         All rights reserved.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Wrapped MPI calls. Keep in sync with mpimcu-pmpi.cc. */
+#define MMCU_MPI_CALLS(X)        \
+    X(NONE, "None")              \
+    X(INIT, "MPI_Init")          \
+    X(IRECV, "MPI_Irecv")        \
+    X(SEND, "MPI_Send")          \
+    X(RECV, "MPI_Recv")          \
+    X(ISEND, "MPI_Isend")        \
+    X(SENDRECV, "MPI_Sendrecv")  \
+    X(WAIT, "MPI_Wait")          \
+    X(WAITALL, "MPI_Waitall")    \
+    X(IPROBE, "MPI_Iprobe")      \
+    X(ISSEND, "MPI_Issend")      \
+    X(SSEND, "MPI_Ssend")        \
+    X(COMM_SIZE, "MPI_Comm_size") \
+    X(COMM_RANK, "MPI_Comm_rank") \
+    X(BARRIER, "MPI_Barrier")    \
+    X(ALLREDUCE, "MPI_Allreduce") \
+    X(BCAST, "MPI_Bcast")        \
+    X(REDUCE, "MPI_Reduce")      \
+    X(WTIME, "MPI_Wtime")        \
+    X(ADDRESS, "MPI_Address")    \
+    X(COMM_SPLIT, "MPI_Comm_split") \
+    X(COMM_FREE, "MPI_Comm_free") \
+    X(ABORT, "MPI_Abort")        \
+    X(TYPE_COMMIT, "MPI_Type_commit") \
+    X(TYPE_FREE, "MPI_Type_free") \
+    X(TYPE_CONTIGUOUS, "MPI_Type_contiguous") \
+    X(TYPE_STRUCT, "MPI_Type_struct") \
+    X(TYPE_VECTOR, "MPI_Type_vector") \
+    X(WAITANY, "MPI_Waitany")    \
+    X(WAITSOME, "MPI_Waitsome")  \
+    X(TEST, "MPI_Test")          \
+    X(TESTANY, "MPI_Testany")    \
+    X(TESTSOME, "MPI_Testsome")  \
+    X(TESTALL, "MPI_Testall")    \
+    X(REQUEST_FREE, "MPI_Request_free") \
+    X(TYPE_CREATE_STRUCT, "MPI_Type_create_struct") \
+    X(TYPE_DUP, "MPI_Type_dup")  \
+    X(FINALIZE, "MPI_Finalize")
+
+#define MMCU_MPI_CALL_ENUM(id, name) MMCU_MPI_CALL_##id,
+enum {
+    MMCU_MPI_CALLS(MMCU_MPI_CALL_ENUM)
+    MMCU_MPI_CALL_LAST
+};
+#undef MMCU_MPI_CALL_ENUM
+
+/**
+ * Returns the name of the given MPI call ID.
+ */
+static inline const char *
+mmcu_mpi_call_name(
+    uint8_t call_id
+) {
+#define MMCU_MPI_CALL_NAME(id, name) name,
+    static const char *names[] = {
+        MMCU_MPI_CALLS(MMCU_MPI_CALL_NAME)
+    };
+#undef MMCU_MPI_CALL_NAME
+    if (call_id >= MMCU_MPI_CALL_LAST) return "Unknown";
+    return names[call_id];
+}
+
+#ifdef __cplusplus
+}
+#endif
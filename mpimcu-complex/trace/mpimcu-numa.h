@@ -0,0 +1,173 @@
+/*
+ * Copyright (c)      2017 Los Alamos National Security, LLC.
+ *                         All rights reserved.
+ */
+
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+
+#include <limits.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/syscall.h>
+
+/**
+ * NUMA placement queries. Everything here is best-effort: on kernels or
+ * machines without NUMA support, all memory is reported on node 0.
+ */
+class mmcu_numa {
+    /**
+     *
+     */
+    static bool
+    has_suffix(
+        const char *str,
+        const char *suffix
+    ) {
+        const size_t str_len = strlen(str);
+        const size_t suffix_len = strlen(suffix);
+        return str_len >= suffix_len &&
+        0 == memcmp(str + str_len - suffix_len, suffix, suffix_len);
+    }
+
+public:
+
+    /**
+     * Returns the number of possible NUMA nodes (at least 1).
+     */
+    static int
+    get_num_nodes(void) {
+        static int n_nodes = -1;
+        if (n_nodes != -1) return n_nodes;
+        //
+        n_nodes = 1;
+        // Formatted as a list of ranges (e.g., '0-1' or '0,2-3').
+        FILE *f = fopen("/sys/devices/system/node/possible", "r");
+        if (!f) return n_nodes;
+        //
+        char lb[256];
+        char *save = NULL;
+        if (fgets(lb, sizeof(lb), f)) {
+            for (char *tok = strtok_r(lb, ",-\n", &save); tok;
+                 tok = strtok_r(NULL, ",-\n", &save)) {
+                n_nodes = std::max(n_nodes, atoi(tok) + 1);
+            }
+        }
+        fclose(f);
+        return n_nodes;
+    }
+
+    /**
+     * Returns the NUMA node of the CPU the caller is currently running on.
+     */
+    static int
+    get_local_node(void) {
+        unsigned cpu = 0, node = 0;
+        if (0 != syscall(SYS_getcpu, &cpu, &node, NULL)) {
+            return 0;
+        }
+        return int(node);
+    }
+
+    /**
+     * Adds the number of resident bytes per NUMA node in [addr, addr + len)
+     * to node_b. Pages that aren't resident aren't counted.
+     */
+    static void
+    add_region_node_bytes(
+        uintptr_t addr,
+        size_t len,
+        std::vector<ssize_t> &node_b
+    ) {
+        static const uintptr_t pgsz = sysconf(_SC_PAGESIZE);
+        // Max number of pages queried by a single move_pages(2) call.
+        static const size_t max_pages = 1024;
+        void *pages[max_pages];
+        int status[max_pages];
+        //
+        const uintptr_t start = addr & ~(pgsz - 1);
+        const uintptr_t end = (addr + len + pgsz - 1) & ~(pgsz - 1);
+        for (uintptr_t cur = start; cur < end; ) {
+            const size_t n_pages = std::min(
+                max_pages, size_t((end - cur) / pgsz)
+            );
+            for (size_t i = 0; i < n_pages; ++i) {
+                pages[i] = (void *)(cur + i * pgsz);
+            }
+            // With no target nodes, move_pages(2) only reports placement.
+            if (0 != syscall(
+                    SYS_move_pages, 0, n_pages, pages, NULL, status, 0
+                )) {
+                // No NUMA support, so everything lives on node 0.
+                if (errno == ENOSYS) {
+                    node_b[0] += ssize_t(n_pages * pgsz);
+                }
+                return;
+            }
+            // Negative status values are errors (e.g., -ENOENT: not present).
+            for (size_t i = 0; i < n_pages; ++i) {
+                const int node = status[i];
+                if (node >= 0 && size_t(node) < node_b.size()) {
+                    node_b[node] += ssize_t(pgsz);
+                }
+            }
+            cur += n_pages * pgsz;
+        }
+    }
+
+    /**
+     * Sums the resident bytes per NUMA node of the whole process in a single
+     * pass over /proc/self/numa_maps.
+     */
+    static void
+    get_proc_self_node_totals(
+        std::vector<ssize_t> &node_b
+    ) {
+        /*
+         55e4c5851000 default file=/usr/bin/head mapped=2 N0=2 kernelpagesize_kB=4
+         */
+        std::fill(node_b.begin(), node_b.end(), 0);
+        //
+        FILE *f = fopen("/proc/self/numa_maps", "r");
+        if (!f) return;
+        //
+        std::vector<ssize_t> entry_pages(node_b.size(), 0);
+        char lb[2 * PATH_MAX];
+        while (fgets(lb, sizeof(lb) - 1, f)) {
+            std::fill(entry_pages.begin(), entry_pages.end(), 0);
+            ssize_t kpgsz_kb = 0;
+            bool skip = false;
+            char *save = NULL;
+            // Not strtok(3): the application may be in the middle of using it.
+            for (char *tok = strtok_r(lb, " \n", &save); tok && !skip;
+                 tok = strtok_r(NULL, " \n", &save)) {
+                if (tok[0] == 'N' && tok[1] >= '0' && tok[1] <= '9') {
+                    char *eq = NULL;
+                    const long node = strtol(tok + 1, &eq, 10);
+                    if (*eq == '=' && node < long(entry_pages.size())) {
+                        entry_pages[node] += strtoll(eq + 1, NULL, 10);
+                    }
+                }
+                else if (0 == strncmp(tok, "kernelpagesize_kB=", 18)) {
+                    kpgsz_kb = strtoll(tok + 18, NULL, 10);
+                }
+                // If you change the name of the trace library, update.
+                else if (0 == strncmp(tok, "file=", 5)) {
+                    skip = has_suffix(tok, "mpimcu-trace.so");
+                }
+            }
+            if (skip) continue;
+            //
+            for (size_t i = 0; i < node_b.size(); ++i) {
+                node_b[i] += entry_pages[i] * kpgsz_kb * 1024;
+            }
+        }
+        fclose(f);
+    }
+};
@@ -3,10 +3,21 @@
  *                         All rights reserved.
  */
 
+#include "mpimcu.h"
 #include "mpimcu-rt.h"
+#include "mpimcu-mem-hooks.h"
 #include "mpimcu-mem-stat-mgr.h"
+#include "mpimcu-handle-cache.h"
 
 #include <signal.h>
+#include <string.h>
+#include <errno.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 #include "mpi.h"
 
@@ -16,6 +27,318 @@
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
+// What was installed for the snapshot signal before our handler.
+static struct sigaction prev_snapshot_action;
+// Writes requested snapshots of ranks that make no memory operations.
+static std::thread snapshot_poller;
+//
+static std::mutex snapshot_poller_mutex;
+//
+static std::condition_variable snapshot_poller_cv;
+//
+static bool snapshot_poller_stop = false;
+
+/**
+ * Only asks for a snapshot: the hooks may be in the middle of an update. Then
+ * passes the signal on to the handler it replaced, if any.
+ */
+static void
+snapshot_signal_handler(
+    int signum,
+    siginfo_t *info,
+    void *ctx
+) {
+    mmcu_mem_stat_mgr *stat_mgr =
+        mmcu_mem_stat_mgr::the_mmcu_mem_stat_mgr_if_created();
+    if (stat_mgr) stat_mgr->request_snapshot();
+    //
+    const struct sigaction &prev = prev_snapshot_action;
+    if (prev.sa_flags & SA_SIGINFO) {
+        prev.sa_sigaction(signum, info, ctx);
+    }
+    else if (prev.sa_handler != SIG_DFL && prev.sa_handler != SIG_IGN) {
+        prev.sa_handler(signum);
+    }
+}
+
+/**
+ * Writes requested snapshots every period seconds until asked to stop, so a
+ * rank stuck in an MPI call still answers.
+ */
+static void
+poll_snapshot_requests(
+    mmcu_mem_stat_mgr *stat_mgr,
+    double period
+) {
+    const auto wait = std::chrono::duration<double>(period);
+    std::unique_lock<std::mutex> lk(snapshot_poller_mutex);
+    while (!snapshot_poller_cv.wait_for(
+               lk, wait, [] { return snapshot_poller_stop; }
+           )) {
+        lk.unlock();
+        // Takes care of the hook state of this thread, too.
+        mmcu_mem_hooks_lock();
+        stat_mgr->write_requested_snapshot();
+        mmcu_mem_hooks_unlock();
+        lk.lock();
+    }
+}
+
+/**
+ * Installs the snapshot signal handler (MMCU_SNAPSHOT_SIGNAL, 0 by default to
+ * not install one) and starts the snapshot poller
+ * (MMCU_SNAPSHOT_POLL_PERIOD).
+ */
+static void
+install_snapshot_handler(
+    mmcu_mem_stat_mgr *stat_mgr
+) {
+    const int signum = int(
+        mmcu_rt::get_env_uint64("MMCU_SNAPSHOT_SIGNAL", 0)
+    );
+    if (signum == 0) return;
+    //
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = snapshot_signal_handler;
+    sa.sa_flags = SA_RESTART | SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(signum, &sa, &prev_snapshot_action) != 0) {
+        fprintf(
+            stderr,
+            "(pid: %d) WARNING: cannot install snapshot handler for "
+            "signal %d: %s\n",
+            (int)getpid(), signum, strerror(errno)
+        );
+        return;
+    }
+    //
+    const double period = mmcu_rt::get_env_double(
+        "MMCU_SNAPSHOT_POLL_PERIOD", 1.0
+    );
+    if (period <= 0.0) return;
+    snapshot_poller = std::thread(poll_snapshot_requests, stat_mgr, period);
+}
+
+/**
+ * Stops the snapshot poller, if it was started.
+ */
+static void
+stop_snapshot_poller(void)
+{
+    if (!snapshot_poller.joinable()) return;
+    //
+    {
+        std::lock_guard<std::mutex> lk(snapshot_poller_mutex);
+        snapshot_poller_stop = true;
+    }
+    snapshot_poller_cv.notify_one();
+    snapshot_poller.join();
+}
+
+// The ranks on this node, which share a clock.
+static MPI_Comm clock_node_comm = MPI_COMM_NULL;
+// One rank per node. Its rank 0 is MPI_COMM_WORLD's.
+static MPI_Comm clock_leader_comm = MPI_COMM_NULL;
+// Ping-pongs per estimate (MMCU_CLOCK_SYNC_ROUNDS). 0 disables them.
+static int clock_sync_rounds = 0;
+
+/**
+ * Estimates rank 0's clock minus this rank's. One rank per node takes part,
+ * along a binomial tree over the node leaders: in the round with the given
+ * stride, each leader below it serves the one stride above it, answering its
+ * ping-pongs with its own time on rank 0's clock. Rounds take
+ * MMCU_CLOCK_SYNC_ROUNDS ping-pongs each, and there are log2(#nodes) of them.
+ * The exchange with the shortest round trip is kept, and errors add up along
+ * the way. The other ranks on a node take their leader's estimate.
+ * Collective.
+ */
+static void
+sync_clocks(
+    mmcu_rt *rt
+) {
+    if (clock_sync_rounds == 0) return;
+    // Time, offset, and offset error.
+    double est[3] = {mmcu_time(), 0.0, 0.0};
+    if (clock_leader_comm != MPI_COMM_NULL) {
+        int leader_rank = 0, n_leaders = 0;
+        PMPI_Comm_rank(clock_leader_comm, &leader_rank);
+        PMPI_Comm_size(clock_leader_comm, &n_leaders);
+        static const int tag = 0;
+        for (int stride = 1; stride < n_leaders; stride *= 2) {
+            // Has its estimate, so serves the one stride above, if any.
+            if (leader_rank < stride) {
+                const int peer = leader_rank + stride;
+                if (peer >= n_leaders) continue;
+                for (int i = 0; i < clock_sync_rounds; ++i) {
+                    PMPI_Recv(
+                        nullptr, 0, MPI_BYTE, peer, tag, clock_leader_comm,
+                        MPI_STATUS_IGNORE
+                    );
+                    // Time on rank 0's clock, and its error.
+                    const double reply[2] = {mmcu_time() + est[1], est[2]};
+                    PMPI_Send(
+                        reply, 2, MPI_DOUBLE, peer, tag, clock_leader_comm
+                    );
+                }
+            }
+            // Gets its estimate in this round.
+            else if (leader_rank < 2 * stride) {
+                const int peer = leader_rank - stride;
+                double best_rtt = -1.0;
+                for (int i = 0; i < clock_sync_rounds; ++i) {
+                    const double sent_at = mmcu_time();
+                    PMPI_Send(
+                        nullptr, 0, MPI_BYTE, peer, tag, clock_leader_comm
+                    );
+                    double reply[2] = {0.0, 0.0};
+                    PMPI_Recv(
+                        reply, 2, MPI_DOUBLE, peer, tag, clock_leader_comm,
+                        MPI_STATUS_IGNORE
+                    );
+                    const double recvd_at = mmcu_time();
+                    // Assumes the reply was sent halfway through the round
+                    // trip.
+                    const double rtt = recvd_at - sent_at;
+                    if (best_rtt < 0.0 || rtt < best_rtt) {
+                        best_rtt = rtt;
+                        est[0] = (sent_at + recvd_at) / 2.0;
+                        est[1] = reply[0] - est[0];
+                        est[2] = reply[1] + rtt / 2.0;
+                    }
+                }
+            }
+        }
+    }
+    PMPI_Bcast(est, 3, MPI_DOUBLE, 0, clock_node_comm);
+    rt->add_clock_sync(est[0], est[1], est[2]);
+}
+
+/**
+ * Sets up the communicators used to estimate clock offsets, estimates them,
+ * and makes report timelines start when rank 0 entered MPI_Init.
+ */
+static void
+setup_clock_sync(
+    mmcu_rt *rt
+) {
+    clock_sync_rounds = int(
+        mmcu_rt::get_env_uint64("MMCU_CLOCK_SYNC_ROUNDS", 10)
+    );
+    if (clock_sync_rounds == 0 || rt->numpe == 1) {
+        clock_sync_rounds = 0;
+        return;
+    }
+    //
+    PMPI_Comm_split_type(
+        MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL,
+        &clock_node_comm
+    );
+    int node_rank = 0;
+    PMPI_Comm_rank(clock_node_comm, &node_rank);
+    PMPI_Comm_split(
+        MPI_COMM_WORLD, node_rank == 0 ? 0 : MPI_UNDEFINED, rt->rank,
+        &clock_leader_comm
+    );
+    //
+    sync_clocks(rt);
+    //
+    double ref_init_begin_time = rt->get_init_begin_time();
+    PMPI_Bcast(&ref_init_begin_time, 1, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    rt->set_ref_init_begin_time(ref_init_begin_time);
+}
+
+/**
+ * Makes a second estimate, which gives the drift, and frees the
+ * communicators.
+ */
+static void
+teardown_clock_sync(
+    mmcu_rt *rt
+) {
+    if (clock_sync_rounds == 0) return;
+    //
+    sync_clocks(rt);
+    //
+    if (clock_leader_comm != MPI_COMM_NULL) {
+        PMPI_Comm_free(&clock_leader_comm);
+    }
+    PMPI_Comm_free(&clock_node_comm);
+}
+
+/**
+ * Aborts the job if a crossed alert threshold asked for it (MMCU_ALERT_ABORT).
+ * Alerts are raised from the hooks, inside the MPI library and with the hooks
+ * lock held, where calling MPI_Abort isn't safe. So they only set a flag, and
+ * wrappers call this once their MPI call has returned.
+ */
+static void
+abort_if_requested(void)
+{
+    const auto *stat_mgr = mmcu_mem_stat_mgr::the_mmcu_mem_stat_mgr_if_created();
+    if (!stat_mgr || !stat_mgr->abort_requested()) return;
+    //
+    PMPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+}
+
+// Shared by the ranks on a node for node-level alerts.
+static MPI_Comm node_usage_comm = MPI_COMM_NULL;
+//
+static MPI_Win node_usage_win = MPI_WIN_NULL;
+
+/**
+ * Sets up the memory where the ranks on a node share their usage, if
+ * node-level alert thresholds are set. Collective, so the thresholds must be
+ * set for all ranks or none.
+ */
+static void
+setup_node_alerts(
+    mmcu_mem_stat_mgr *stat_mgr
+) {
+    if (!stat_mgr->node_alerts_armed()) return;
+    //
+    PMPI_Comm_split_type(
+        MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL,
+        &node_usage_comm
+    );
+    int node_size = 0, node_rank = 0;
+    PMPI_Comm_size(node_usage_comm, &node_size);
+    PMPI_Comm_rank(node_usage_comm, &node_rank);
+    // All of it on the first rank, so that it is contiguous.
+    const size_t size = mmcu_node_usage::get_size(node_size);
+    int64_t *shm = nullptr;
+    PMPI_Win_allocate_shared(
+        MPI_Aint(node_rank == 0 ? size : 0), sizeof(int64_t), MPI_INFO_NULL,
+        node_usage_comm, &shm, &node_usage_win
+    );
+    MPI_Aint got_size = 0;
+    int disp_unit = 0;
+    PMPI_Win_shared_query(node_usage_win, 0, &got_size, &disp_unit, &shm);
+    if (node_rank == 0) memset(shm, 0, size);
+    PMPI_Barrier(node_usage_comm);
+    //
+    mmcu_mem_hooks_lock();
+    stat_mgr->set_node_usage(shm, node_size, node_rank);
+    mmcu_mem_hooks_unlock();
+}
+
+/**
+ *
+ */
+static void
+teardown_node_alerts(
+    mmcu_mem_stat_mgr *stat_mgr
+) {
+    if (node_usage_win == MPI_WIN_NULL) return;
+    //
+    mmcu_mem_hooks_lock();
+    stat_mgr->set_node_usage(nullptr, 0, 0);
+    mmcu_mem_hooks_unlock();
+    //
+    PMPI_Win_free(&node_usage_win);
+    PMPI_Comm_free(&node_usage_comm);
+}
+
 /**
  *
  */
@@ -27,7 +350,12 @@ MPI_Init(
     static mmcu_rt *rt = mmcu_rt::the_mmcu_rt();
     // Set init time.
     rt->set_init_begin_time_now();
+    rt->read_env_config();
+    // Create while no hooks are active, since the free fast path uses it
+    // without deactivating them.
+    (void)mmcu_mem_stat_mgr::the_mmcu_mem_stat_mgr();
     //
+    rt->set_mpi_call_id(MMCU_MPI_CALL_INIT);
     rt->activate_all_mem_hooks();
     int rc = PMPI_Init(argc, argv);
     rt->deactivate_all_mem_hooks();
@@ -39,6 +367,23 @@ MPI_Init(
     rt->gather_target_meta();
     PMPI_Comm_rank(MPI_COMM_WORLD, &rt->rank);
     PMPI_Comm_size(MPI_COMM_WORLD, &rt->numpe);
+    // Needs the rank. Serialized with the hooks, since it moves where they
+    // publish usage.
+    auto *stat_mgr = mmcu_mem_stat_mgr::the_mmcu_mem_stat_mgr();
+    // Report timelines are put on rank 0's clock.
+    setup_clock_sync(rt);
+    //
+    mmcu_mem_hooks_lock();
+    stat_mgr->open_telemetry(rt);
+    stat_mgr->arm_alerts();
+    stat_mgr->init_peers(rt->numpe);
+    mmcu_mem_hooks_unlock();
+    // Init's usage may already be past the alert thresholds.
+    abort_if_requested();
+    //
+    setup_node_alerts(stat_mgr);
+    //
+    install_snapshot_handler(stat_mgr);
     //
     const int nsyncs = 4;
     for (int i = 0; i < nsyncs; ++i) {
@@ -65,6 +410,366 @@ MPI_Init(
 // Point to Point
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
+/**
+ * Returns the given MPI handle (e.g., MPI_Request) as a table key.
+ */
+template <typename T>
+static uint64_t
+get_handle_key(
+    T handle
+) {
+    static_assert(sizeof(T) <= sizeof(uint64_t), "MPI handle too big");
+    uint64_t key = 0;
+    memcpy(&key, &handle, sizeof(handle));
+    return key;
+}
+
+// MPI_COMM_WORLD ranks of the members of the communicators seen by
+// point-to-point calls. Empty for intercommunicators.
+static mmcu_handle_cache<std::vector<int>> comm_world_ranks;
+
+/**
+ * Returns the MPI_COMM_WORLD ranks of the members of the given communicator.
+ * Calls into MPI, so never call with the hooks lock held.
+ */
+static std::vector<int> *
+new_world_ranks(
+    MPI_Comm comm
+) {
+    auto *world_ranks = new std::vector<int>();
+    int is_inter = 0;
+    PMPI_Comm_test_inter(comm, &is_inter);
+    if (is_inter) return world_ranks;
+    //
+    int size = 0;
+    PMPI_Comm_size(comm, &size);
+    std::vector<int> ranks(size);
+    for (int i = 0; i < size; ++i) ranks[i] = i;
+    world_ranks->resize(size);
+    MPI_Group group, world_group;
+    PMPI_Comm_group(comm, &group);
+    PMPI_Comm_group(MPI_COMM_WORLD, &world_group);
+    PMPI_Group_translate_ranks(
+        group, size, ranks.data(), world_group, world_ranks->data()
+    );
+    PMPI_Group_free(&group);
+    PMPI_Group_free(&world_group);
+    return world_ranks;
+}
+
+/**
+ * Returns world_ranks[rank], or -1 if there is no such rank in MPI_COMM_WORLD.
+ */
+static int
+lookup_world_rank(
+    const std::vector<int> &world_ranks,
+    int rank
+) {
+    if (size_t(rank) >= world_ranks.size()) return -1;
+    // Not in MPI_COMM_WORLD (e.g., spawned).
+    if (world_ranks[rank] == MPI_UNDEFINED) return -1;
+    return world_ranks[rank];
+}
+
+/**
+ * Returns the MPI_COMM_WORLD rank of the given rank in comm, or -1 if it isn't
+ * a single known peer (e.g., MPI_ANY_SOURCE or MPI_PROC_NULL). Doesn't lock
+ * once comm has been seen.
+ */
+static int
+get_world_rank(
+    MPI_Comm comm,
+    int rank
+) {
+    if (rank < 0) return -1;
+    if (comm == MPI_COMM_WORLD) return rank;
+    //
+    const uint64_t key = get_handle_key(comm);
+    const std::vector<int> *world_ranks = comm_world_ranks.find(key);
+    if (world_ranks) return lookup_world_rank(*world_ranks, rank);
+    // First time comm is seen. Hooks may be active for another thread, so keep
+    // what this one allocates out of them.
+    mmcu_mem_hook_mgr_enter_tool();
+    std::vector<int> *new_ranks = new_world_ranks(comm);
+    const int world_rank = lookup_world_rank(*new_ranks, rank);
+    // Another thread got in first, or the cache is full.
+    if (!comm_world_ranks.insert(key, new_ranks)) delete new_ranks;
+    mmcu_mem_hook_mgr_exit_tool();
+    return world_rank;
+}
+
+/**
+ * Forgets what get_world_rank() knows about the given communicator. Call
+ * before it is freed.
+ */
+static void
+forget_world_ranks(
+    MPI_Comm comm
+) {
+    mmcu_mem_hook_mgr_enter_tool();
+    comm_world_ranks.erase(get_handle_key(comm));
+    mmcu_mem_hook_mgr_exit_tool();
+}
+
+/**
+ * A point-to-point call that may make first contact with up to two peers.
+ */
+struct peer_contact {
+    // MPI_COMM_WORLD ranks not contacted before the call, or -1.
+    int peers[2];
+    // MPI memory usage before the call.
+    int64_t mpi_b;
+};
+
+/**
+ * Call before a point-to-point call with the given peers (ranks in comm).
+ * Cheap unless one of them is new.
+ */
+static peer_contact
+begin_peer_contact(
+    mmcu_mem_stat_mgr *stat_mgr,
+    MPI_Comm comm,
+    int peer_a,
+    int peer_b = -1
+) {
+    static mmcu_rt *rt = mmcu_rt::the_mmcu_rt();
+    //
+    peer_contact contact = {{-1, -1}, 0};
+    const int world_peers[2] = {
+        get_world_rank(comm, peer_a), get_world_rank(comm, peer_b)
+    };
+    bool any_new = false;
+    for (int i = 0; i < 2; ++i) {
+        if (stat_mgr->peer_contacted(world_peers[i])) continue;
+        // Messages to self set up no transport state.
+        if (world_peers[i] == rt->rank) continue;
+        contact.peers[i] = world_peers[i];
+        any_new = true;
+    }
+    if (any_new) contact.mpi_b = stat_mgr->get_mpi_b();
+    return contact;
+}
+
+/**
+ * Call after the point-to-point call started with begin_peer_contact().
+ */
+static void
+end_peer_contact(
+    mmcu_mem_stat_mgr *stat_mgr,
+    const peer_contact &contact,
+    uint8_t mpi_call_id
+) {
+    if (contact.peers[0] == -1 && contact.peers[1] == -1) return;
+    //
+    const int64_t mpi_b = stat_mgr->get_mpi_b();
+    // Both the same peer (e.g., MPI_Sendrecv).
+    const int n_peers = (contact.peers[0] == contact.peers[1]) ? 1 : 2;
+    mmcu_mem_hooks_lock();
+    stat_mgr->add_peer_contacts(
+        contact.peers, n_peers, ssize_t(mpi_b - contact.mpi_b),
+        mpi_call_id
+    );
+    mmcu_mem_hooks_unlock();
+}
+
+// Sizes of the datatypes seen by calls with payloads, so that PMPI_Type_size
+// is called once per handle.
+static mmcu_handle_cache<int> type_sizes;
+
+/**
+ * Returns the size of the given datatype. Doesn't lock once the datatype has
+ * been seen. Calls into MPI otherwise, so never call with the hooks lock held.
+ */
+static int
+get_type_size(
+    MPI_Datatype datatype
+) {
+    const uint64_t key = get_handle_key(datatype);
+    const int *cached = type_sizes.find(key);
+    if (cached) return *cached;
+    //
+    // First time the datatype is seen. Hooks may be active for another
+    // thread, so keep what this one allocates out of them.
+    mmcu_mem_hook_mgr_enter_tool();
+    int size = 0;
+    if (PMPI_Type_size(datatype, &size) != MPI_SUCCESS || size < 0) size = 0;
+    int *new_size = new int(size);
+    // Another thread got in first, or the cache is full.
+    if (!type_sizes.insert(key, new_size)) delete new_size;
+    mmcu_mem_hook_mgr_exit_tool();
+    return size;
+}
+
+/**
+ * Forgets the size of the given datatype, whose handle may be reused. Call
+ * before it is freed.
+ */
+static void
+forget_type_size(
+    MPI_Datatype datatype
+) {
+    mmcu_mem_hook_mgr_enter_tool();
+    type_sizes.erase(get_handle_key(datatype));
+    mmcu_mem_hook_mgr_exit_tool();
+}
+
+/**
+ * MPI memory state at some point.
+ */
+struct mem_mark {
+    // Bytes allocated by MPI so far.
+    uint64_t allocd_b;
+    // MPI memory usage.
+    int64_t mpi_b;
+};
+
+/**
+ * Returns the current MPI memory state. Doesn't lock.
+ */
+static mem_mark
+get_mem_mark(
+    mmcu_mem_stat_mgr *stat_mgr
+) {
+    mem_mark mark = {stat_mgr->get_total_allocd_b(), stat_mgr->get_mpi_b()};
+    return mark;
+}
+
+/**
+ * Returns what was allocated, and how much MPI memory usage grew, since the
+ * given mark.
+ */
+static mem_mark
+get_mem_mark_delta(
+    mmcu_mem_stat_mgr *stat_mgr,
+    const mem_mark &since
+) {
+    mem_mark delta = get_mem_mark(stat_mgr);
+    delta.allocd_b -= since.allocd_b;
+    delta.mpi_b -= since.mpi_b;
+    return delta;
+}
+
+/**
+ * Call after a successful call with a payload, given the mark taken before
+ * it. The payload is count elements of datatype, plus count2 of datatype2 for
+ * calls that both send and receive.
+ */
+static void
+end_payload_call(
+    mmcu_mem_stat_mgr *stat_mgr,
+    const mem_mark &mark,
+    uint8_t mpi_call_id,
+    int count,
+    MPI_Datatype datatype,
+    int count2 = 0,
+    MPI_Datatype datatype2 = MPI_DATATYPE_NULL
+) {
+    const mem_mark delta = get_mem_mark_delta(stat_mgr, mark);
+    //
+    uint64_t payload_b = 0;
+    if (count > 0) {
+        payload_b += uint64_t(count) * uint64_t(get_type_size(datatype));
+    }
+    if (count2 > 0) {
+        payload_b += uint64_t(count2) * uint64_t(get_type_size(datatype2));
+    }
+    mmcu_mem_hooks_lock();
+    stat_mgr->add_payload_sample(
+        mpi_call_id, payload_b, delta.allocd_b, ssize_t(delta.mpi_b)
+    );
+    mmcu_mem_hooks_unlock();
+}
+
+/**
+ * Call after a successful call that created the given request with the given
+ * peer (rank in comm).
+ */
+static void
+add_request(
+    mmcu_mem_stat_mgr *stat_mgr,
+    MPI_Comm comm,
+    MPI_Request request,
+    int peer,
+    int tag,
+    uint8_t mpi_call_id
+) {
+    if (request == MPI_REQUEST_NULL) return;
+    //
+    const int world_peer = get_world_rank(comm, peer);
+    mmcu_mem_hooks_lock();
+    stat_mgr->add_request(
+        get_handle_key(request), mpi_call_id, world_peer, tag
+    );
+    mmcu_mem_hooks_unlock();
+}
+
+/**
+ * Keys of the requests passed to a call that may complete them, taken before
+ * the call.
+ */
+class request_keys {
+    // Most calls pass a handful of requests.
+    static const int max_stack_keys = 64;
+    //
+    uint64_t stack_keys[max_stack_keys];
+    //
+    std::vector<uint64_t> heap_keys;
+    //
+    uint64_t *keys = stack_keys;
+
+public:
+    /**
+     *
+     */
+    request_keys(
+        const MPI_Request *requests,
+        int count
+    ) {
+        if (count > max_stack_keys) {
+            heap_keys.resize(count);
+            keys = heap_keys.data();
+        }
+        for (int i = 0; i < count; ++i) {
+            keys[i] = get_handle_key(requests[i]);
+        }
+    }
+
+    request_keys(const request_keys &) = delete;
+    //
+    request_keys &
+    operator=(const request_keys &) = delete;
+
+    /**
+     *
+     */
+    const uint64_t *
+    data(void) const {
+        return keys;
+    }
+};
+
+/**
+ * Call after a call that may have completed the given requests, with their
+ * keys from before the call. Completed requests were set to
+ * MPI_REQUEST_NULL; persistent ones are never tracked.
+ */
+static void
+complete_requests(
+    mmcu_mem_stat_mgr *stat_mgr,
+    const uint64_t *keys,
+    const MPI_Request *requests,
+    int n_requests
+) {
+    static const uint64_t null_key = get_handle_key(MPI_REQUEST_NULL);
+    //
+    mmcu_mem_hooks_lock();
+    for (int i = 0; i < n_requests; ++i) {
+        if (keys[i] == null_key || requests[i] != MPI_REQUEST_NULL) continue;
+        stat_mgr->complete_request(keys[i]);
+    }
+    mmcu_mem_hooks_unlock();
+}
+
 /**
  *
  */
@@ -79,7 +784,13 @@ MPI_Irecv(
     MPI_Request *request
 ) {
     static mmcu_rt *rt = mmcu_rt::the_mmcu_rt();
+    static auto *stat_mgr = mmcu_mem_stat_mgr::the_mmcu_mem_stat_mgr();
     //
+    const peer_contact contact = begin_peer_contact(
+        stat_mgr, comm, source
+    );
+    const mem_mark mark = get_mem_mark(stat_mgr);
+    rt->set_mpi_call_id(MMCU_MPI_CALL_IRECV);
     rt->activate_all_mem_hooks();
     int rc = PMPI_Irecv(
         buf,
@@ -91,6 +802,18 @@ MPI_Irecv(
         request
     );
     rt->deactivate_all_mem_hooks();
+    abort_if_requested();
+    if (rc == MPI_SUCCESS) {
+        end_payload_call(
+            stat_mgr, mark, MMCU_MPI_CALL_IRECV, count, datatype
+        );
+    }
+    end_peer_contact(stat_mgr, contact, MMCU_MPI_CALL_IRECV);
+    if (rc == MPI_SUCCESS) {
+        add_request(
+            stat_mgr, comm, *request, source, tag, MMCU_MPI_CALL_IRECV
+        );
+    }
     //
     return rc;
 }
@@ -108,7 +831,13 @@ MPI_Send(
     MPI_Comm comm
 ) {
     static mmcu_rt *rt = mmcu_rt::the_mmcu_rt();
+    static auto *stat_mgr = mmcu_mem_stat_mgr::the_mmcu_mem_stat_mgr();
     //
+    const peer_contact contact = begin_peer_contact(
+        stat_mgr, comm, dest
+    );
+    const mem_mark mark = get_mem_mark(stat_mgr);
+    rt->set_mpi_call_id(MMCU_MPI_CALL_SEND);
     rt->activate_all_mem_hooks();
     int rc = PMPI_Send(
         buf,
@@ -119,6 +848,13 @@ MPI_Send(
         comm
     );
     rt->deactivate_all_mem_hooks();
+    abort_if_requested();
+    if (rc == MPI_SUCCESS) {
+        end_payload_call(
+            stat_mgr, mark, MMCU_MPI_CALL_SEND, count, datatype
+        );
+    }
+    end_peer_contact(stat_mgr, contact, MMCU_MPI_CALL_SEND);
     //
     return rc;
 }
@@ -137,7 +873,13 @@ MPI_Recv(
     MPI_Status *status
 ) {
     static mmcu_rt *rt = mmcu_rt::the_mmcu_rt();
+    static auto *stat_mgr = mmcu_mem_stat_mgr::the_mmcu_mem_stat_mgr();
     //
+    const peer_contact contact = begin_peer_contact(
+        stat_mgr, comm, source
+    );
+    const mem_mark mark = get_mem_mark(stat_mgr);
+    rt->set_mpi_call_id(MMCU_MPI_CALL_RECV);
     rt->activate_all_mem_hooks();
     int rc = PMPI_Recv(
         buf,
@@ -149,6 +891,13 @@ MPI_Recv(
         status
     );
     rt->deactivate_all_mem_hooks();
+    abort_if_requested();
+    if (rc == MPI_SUCCESS) {
+        end_payload_call(
+            stat_mgr, mark, MMCU_MPI_CALL_RECV, count, datatype
+        );
+    }
+    end_peer_contact(stat_mgr, contact, MMCU_MPI_CALL_RECV);
     //
     return rc;
 }
@@ -167,7 +916,13 @@ MPI_Isend(
     MPI_Request *request
 ) {
     static mmcu_rt *rt = mmcu_rt::the_mmcu_rt();
+    static auto *stat_mgr = mmcu_mem_stat_mgr::the_mmcu_mem_stat_mgr();
     //
+    const peer_contact contact = begin_peer_contact(
+        stat_mgr, comm, dest
+    );
+    const mem_mark mark = get_mem_mark(stat_mgr);
+    rt->set_mpi_call_id(MMCU_MPI_CALL_ISEND);
     rt->activate_all_mem_hooks();
     int rc = PMPI_Isend(
         buf,
@@ -179,6 +934,18 @@ MPI_Isend(
         request
     );
     rt->deactivate_all_mem_hooks();
+    abort_if_requested();
+    if (rc == MPI_SUCCESS) {
+        end_payload_call(
+            stat_mgr, mark, MMCU_MPI_CALL_ISEND, count, datatype
+        );
+    }
+    end_peer_contact(stat_mgr, contact, MMCU_MPI_CALL_ISEND);
+    if (rc == MPI_SUCCESS) {
+        add_request(
+            stat_mgr, comm, *request, dest, tag, MMCU_MPI_CALL_ISEND
+        );
+    }
     //
     return rc;
 }
@@ -202,7 +969,13 @@ MPI_Sendrecv(
     MPI_Status *status
 ) {
     static mmcu_rt *rt = mmcu_rt::the_mmcu_rt();
+    static auto *stat_mgr = mmcu_mem_stat_mgr::the_mmcu_mem_stat_mgr();
     //
+    const peer_contact contact = begin_peer_contact(
+        stat_mgr, comm, dest, source
+    );
+    const mem_mark mark = get_mem_mark(stat_mgr);
+    rt->set_mpi_call_id(MMCU_MPI_CALL_SENDRECV);
     rt->activate_all_mem_hooks();
     int rc = PMPI_Sendrecv(
         sendbuf,
@@ -219,6 +992,14 @@ MPI_Sendrecv(
         status
     );
     rt->deactivate_all_mem_hooks();
+    abort_if_requested();
+    if (rc == MPI_SUCCESS) {
+        end_payload_call(
+            stat_mgr, mark, MMCU_MPI_CALL_SENDRECV,
+            sendcount, sendtype, recvcount, recvtype
+        );
+    }
+    end_peer_contact(stat_mgr, contact, MMCU_MPI_CALL_SENDRECV);
     //
     return rc;
 }
@@ -232,13 +1013,18 @@ MPI_Wait(
     MPI_Status *status
 ) {
     static mmcu_rt *rt = mmcu_rt::the_mmcu_rt();
+    static auto *stat_mgr = mmcu_mem_stat_mgr::the_mmcu_mem_stat_mgr();
     //
+    const uint64_t key = get_handle_key(*request);
+    rt->set_mpi_call_id(MMCU_MPI_CALL_WAIT);
     rt->activate_all_mem_hooks();
     int rc = PMPI_Wait(
         request,
         status
     );
     rt->deactivate_all_mem_hooks();
+    abort_if_requested();
+    complete_requests(stat_mgr, &key, request, 1);
     //
     return rc;
 }
@@ -253,7 +1039,10 @@ MPI_Waitall(
     MPI_Status *array_of_statuses
 ) {
     static mmcu_rt *rt = mmcu_rt::the_mmcu_rt();
+    static auto *stat_mgr = mmcu_mem_stat_mgr::the_mmcu_mem_stat_mgr();
     //
+    const request_keys keys(array_of_requests, count);
+    rt->set_mpi_call_id(MMCU_MPI_CALL_WAITALL);
     rt->activate_all_mem_hooks();
     int rc = PMPI_Waitall(
         count,
@@ -261,6 +1050,209 @@ MPI_Waitall(
         array_of_statuses
     );
     rt->deactivate_all_mem_hooks();
+    abort_if_requested();
+    complete_requests(stat_mgr, keys.data(), array_of_requests, count);
+    //
+    return rc;
+}
+
+/**
+ *
+ */
+int
+MPI_Waitany(
+    int count,
+    MPI_Request array_of_requests[],
+    int *index,
+    MPI_Status *status
+) {
+    static mmcu_rt *rt = mmcu_rt::the_mmcu_rt();
+    static auto *stat_mgr = mmcu_mem_stat_mgr::the_mmcu_mem_stat_mgr();
+    //
+    const request_keys keys(array_of_requests, count);
+    rt->set_mpi_call_id(MMCU_MPI_CALL_WAITANY);
+    rt->activate_all_mem_hooks();
+    int rc = PMPI_Waitany(
+        count,
+        array_of_requests,
+        index,
+        status
+    );
+    rt->deactivate_all_mem_hooks();
+    abort_if_requested();
+    complete_requests(stat_mgr, keys.data(), array_of_requests, count);
+    //
+    return rc;
+}
+
+/**
+ *
+ */
+int
+MPI_Waitsome(
+    int incount,
+    MPI_Request array_of_requests[],
+    int *outcount,
+    int array_of_indices[],
+    MPI_Status array_of_statuses[]
+) {
+    static mmcu_rt *rt = mmcu_rt::the_mmcu_rt();
+    static auto *stat_mgr = mmcu_mem_stat_mgr::the_mmcu_mem_stat_mgr();
+    //
+    const request_keys keys(array_of_requests, incount);
+    rt->set_mpi_call_id(MMCU_MPI_CALL_WAITSOME);
+    rt->activate_all_mem_hooks();
+    int rc = PMPI_Waitsome(
+        incount,
+        array_of_requests,
+        outcount,
+        array_of_indices,
+        array_of_statuses
+    );
+    rt->deactivate_all_mem_hooks();
+    abort_if_requested();
+    complete_requests(stat_mgr, keys.data(), array_of_requests, incount);
+    //
+    return rc;
+}
+
+/**
+ *
+ */
+int
+MPI_Test(
+    MPI_Request *request,
+    int *flag,
+    MPI_Status *status
+) {
+    static mmcu_rt *rt = mmcu_rt::the_mmcu_rt();
+    static auto *stat_mgr = mmcu_mem_stat_mgr::the_mmcu_mem_stat_mgr();
+    //
+    const uint64_t key = get_handle_key(*request);
+    rt->set_mpi_call_id(MMCU_MPI_CALL_TEST);
+    rt->activate_all_mem_hooks();
+    int rc = PMPI_Test(
+        request,
+        flag,
+        status
+    );
+    rt->deactivate_all_mem_hooks();
+    abort_if_requested();
+    complete_requests(stat_mgr, &key, request, 1);
+    //
+    return rc;
+}
+
+/**
+ *
+ */
+int
+MPI_Testany(
+    int count,
+    MPI_Request array_of_requests[],
+    int *index,
+    int *flag,
+    MPI_Status *status
+) {
+    static mmcu_rt *rt = mmcu_rt::the_mmcu_rt();
+    static auto *stat_mgr = mmcu_mem_stat_mgr::the_mmcu_mem_stat_mgr();
+    //
+    const request_keys keys(array_of_requests, count);
+    rt->set_mpi_call_id(MMCU_MPI_CALL_TESTANY);
+    rt->activate_all_mem_hooks();
+    int rc = PMPI_Testany(
+        count,
+        array_of_requests,
+        index,
+        flag,
+        status
+    );
+    rt->deactivate_all_mem_hooks();
+    abort_if_requested();
+    complete_requests(stat_mgr, keys.data(), array_of_requests, count);
+    //
+    return rc;
+}
+
+/**
+ *
+ */
+int
+MPI_Testsome(
+    int incount,
+    MPI_Request array_of_requests[],
+    int *outcount,
+    int array_of_indices[],
+    MPI_Status array_of_statuses[]
+) {
+    static mmcu_rt *rt = mmcu_rt::the_mmcu_rt();
+    static auto *stat_mgr = mmcu_mem_stat_mgr::the_mmcu_mem_stat_mgr();
+    //
+    const request_keys keys(array_of_requests, incount);
+    rt->set_mpi_call_id(MMCU_MPI_CALL_TESTSOME);
+    rt->activate_all_mem_hooks();
+    int rc = PMPI_Testsome(
+        incount,
+        array_of_requests,
+        outcount,
+        array_of_indices,
+        array_of_statuses
+    );
+    rt->deactivate_all_mem_hooks();
+    abort_if_requested();
+    complete_requests(stat_mgr, keys.data(), array_of_requests, incount);
+    //
+    return rc;
+}
+
+/**
+ *
+ */
+int
+MPI_Testall(
+    int count,
+    MPI_Request array_of_requests[],
+    int *flag,
+    MPI_Status array_of_statuses[]
+) {
+    static mmcu_rt *rt = mmcu_rt::the_mmcu_rt();
+    static auto *stat_mgr = mmcu_mem_stat_mgr::the_mmcu_mem_stat_mgr();
+    //
+    const request_keys keys(array_of_requests, count);
+    rt->set_mpi_call_id(MMCU_MPI_CALL_TESTALL);
+    rt->activate_all_mem_hooks();
+    int rc = PMPI_Testall(
+        count,
+        array_of_requests,
+        flag,
+        array_of_statuses
+    );
+    rt->deactivate_all_mem_hooks();
+    abort_if_requested();
+    complete_requests(stat_mgr, keys.data(), array_of_requests, count);
+    //
+    return rc;
+}
+
+/**
+ * Freeing an active request ends its tracking: MPI completes it on its own.
+ */
+int
+MPI_Request_free(
+    MPI_Request *request
+) {
+    static mmcu_rt *rt = mmcu_rt::the_mmcu_rt();
+    static auto *stat_mgr = mmcu_mem_stat_mgr::the_mmcu_mem_stat_mgr();
+    //
+    const uint64_t key = get_handle_key(*request);
+    rt->set_mpi_call_id(MMCU_MPI_CALL_REQUEST_FREE);
+    rt->activate_all_mem_hooks();
+    int rc = PMPI_Request_free(
+        request
+    );
+    rt->deactivate_all_mem_hooks();
+    abort_if_requested();
+    complete_requests(stat_mgr, &key, request, 1);
     //
     return rc;
 }
@@ -278,6 +1270,7 @@ MPI_Iprobe(
 ) {
     static mmcu_rt *rt = mmcu_rt::the_mmcu_rt();
     //
+    rt->set_mpi_call_id(MMCU_MPI_CALL_IPROBE);
     rt->activate_all_mem_hooks();
     int rc = PMPI_Iprobe(
         source,
@@ -287,6 +1280,7 @@ MPI_Iprobe(
         status
     );
     rt->deactivate_all_mem_hooks();
+    abort_if_requested();
     //
     return rc;
 }
@@ -305,7 +1299,13 @@ MPI_Issend(
     MPI_Request *request
 ) {
     static mmcu_rt *rt = mmcu_rt::the_mmcu_rt();
+    static auto *stat_mgr = mmcu_mem_stat_mgr::the_mmcu_mem_stat_mgr();
     //
+    const peer_contact contact = begin_peer_contact(
+        stat_mgr, comm, dest
+    );
+    const mem_mark mark = get_mem_mark(stat_mgr);
+    rt->set_mpi_call_id(MMCU_MPI_CALL_ISSEND);
     rt->activate_all_mem_hooks();
     int rc = PMPI_Issend(
         buf,
@@ -317,6 +1317,18 @@ MPI_Issend(
         request
     );
     rt->deactivate_all_mem_hooks();
+    abort_if_requested();
+    if (rc == MPI_SUCCESS) {
+        end_payload_call(
+            stat_mgr, mark, MMCU_MPI_CALL_ISSEND, count, datatype
+        );
+    }
+    end_peer_contact(stat_mgr, contact, MMCU_MPI_CALL_ISSEND);
+    if (rc == MPI_SUCCESS) {
+        add_request(
+            stat_mgr, comm, *request, dest, tag, MMCU_MPI_CALL_ISSEND
+        );
+    }
     //
     return rc;
 }
@@ -334,7 +1346,13 @@ MPI_Ssend(
     MPI_Comm comm
 ) {
     static mmcu_rt *rt = mmcu_rt::the_mmcu_rt();
+    static auto *stat_mgr = mmcu_mem_stat_mgr::the_mmcu_mem_stat_mgr();
     //
+    const peer_contact contact = begin_peer_contact(
+        stat_mgr, comm, dest
+    );
+    const mem_mark mark = get_mem_mark(stat_mgr);
+    rt->set_mpi_call_id(MMCU_MPI_CALL_SSEND);
     rt->activate_all_mem_hooks();
     int rc = PMPI_Ssend(
         buf,
@@ -345,6 +1363,13 @@ MPI_Ssend(
         comm
     );
     rt->deactivate_all_mem_hooks();
+    abort_if_requested();
+    if (rc == MPI_SUCCESS) {
+        end_payload_call(
+            stat_mgr, mark, MMCU_MPI_CALL_SSEND, count, datatype
+        );
+    }
+    end_peer_contact(stat_mgr, contact, MMCU_MPI_CALL_SSEND);
     //
     return rc;
 }
@@ -365,12 +1390,14 @@ MPI_Comm_size(
 ) {
     static mmcu_rt *rt = mmcu_rt::the_mmcu_rt();
     //
+    rt->set_mpi_call_id(MMCU_MPI_CALL_COMM_SIZE);
     rt->activate_all_mem_hooks();
     int rc = PMPI_Comm_size(
         comm,
         size
     );
     rt->deactivate_all_mem_hooks();
+    abort_if_requested();
     //
     return rc;
 }
@@ -385,12 +1412,14 @@ MPI_Comm_rank(
 ) {
     static mmcu_rt *rt = mmcu_rt::the_mmcu_rt();
     //
+    rt->set_mpi_call_id(MMCU_MPI_CALL_COMM_RANK);
     rt->activate_all_mem_hooks();
     int rc = PMPI_Comm_rank(
         comm,
         rank
     );
     rt->deactivate_all_mem_hooks();
+    abort_if_requested();
     //
     return rc;
 }
@@ -404,11 +1433,13 @@ MPI_Barrier(
 ) {
     static mmcu_rt *rt = mmcu_rt::the_mmcu_rt();
     //
+    rt->set_mpi_call_id(MMCU_MPI_CALL_BARRIER);
     rt->activate_all_mem_hooks();
     int rc = PMPI_Barrier(
         comm
     );
     rt->deactivate_all_mem_hooks();
+    abort_if_requested();
     //
     return rc;
 }
@@ -426,7 +1457,10 @@ MPI_Allreduce(
     MPI_Comm comm
 ) {
     static mmcu_rt *rt = mmcu_rt::the_mmcu_rt();
+    static auto *stat_mgr = mmcu_mem_stat_mgr::the_mmcu_mem_stat_mgr();
     //
+    const mem_mark mark = get_mem_mark(stat_mgr);
+    rt->set_mpi_call_id(MMCU_MPI_CALL_ALLREDUCE);
     rt->activate_all_mem_hooks();
     int rc = PMPI_Allreduce(
         sendbuf,
@@ -437,6 +1471,12 @@ MPI_Allreduce(
         comm
     );
     rt->deactivate_all_mem_hooks();
+    abort_if_requested();
+    if (rc == MPI_SUCCESS) {
+        end_payload_call(
+            stat_mgr, mark, MMCU_MPI_CALL_ALLREDUCE, count, datatype
+        );
+    }
     //
     return rc;
 }
@@ -453,7 +1493,10 @@ MPI_Bcast(
     MPI_Comm comm
 ) {
     static mmcu_rt *rt = mmcu_rt::the_mmcu_rt();
+    static auto *stat_mgr = mmcu_mem_stat_mgr::the_mmcu_mem_stat_mgr();
     //
+    const mem_mark mark = get_mem_mark(stat_mgr);
+    rt->set_mpi_call_id(MMCU_MPI_CALL_BCAST);
     rt->activate_all_mem_hooks();
     int rc = PMPI_Bcast(
         buffer,
@@ -463,6 +1506,12 @@ MPI_Bcast(
         comm
     );
     rt->deactivate_all_mem_hooks();
+    abort_if_requested();
+    if (rc == MPI_SUCCESS) {
+        end_payload_call(
+            stat_mgr, mark, MMCU_MPI_CALL_BCAST, count, datatype
+        );
+    }
     //
     return rc;
 }
@@ -481,7 +1530,10 @@ MPI_Reduce(
     MPI_Comm comm
 ) {
     static mmcu_rt *rt = mmcu_rt::the_mmcu_rt();
+    static auto *stat_mgr = mmcu_mem_stat_mgr::the_mmcu_mem_stat_mgr();
     //
+    const mem_mark mark = get_mem_mark(stat_mgr);
+    rt->set_mpi_call_id(MMCU_MPI_CALL_REDUCE);
     rt->activate_all_mem_hooks();
     int rc = PMPI_Reduce(
         sendbuf,
@@ -493,6 +1545,12 @@ MPI_Reduce(
         comm
     );
     rt->deactivate_all_mem_hooks();
+    abort_if_requested();
+    if (rc == MPI_SUCCESS) {
+        end_payload_call(
+            stat_mgr, mark, MMCU_MPI_CALL_REDUCE, count, datatype
+        );
+    }
     //
     return rc;
 }
@@ -511,9 +1569,11 @@ MPI_Wtime(void)
 {
     static mmcu_rt *rt = mmcu_rt::the_mmcu_rt();
     //
+    rt->set_mpi_call_id(MMCU_MPI_CALL_WTIME);
     rt->activate_all_mem_hooks();
     double res = PMPI_Wtime();
     rt->deactivate_all_mem_hooks();
+    abort_if_requested();
     //
     return res;
 }
@@ -528,12 +1588,14 @@ MPI_Address(
 ) {
     static mmcu_rt *rt = mmcu_rt::the_mmcu_rt();
     //
+    rt->set_mpi_call_id(MMCU_MPI_CALL_ADDRESS);
     rt->activate_all_mem_hooks();
     int rc = PMPI_Address(
         location,
         address
     );
     rt->deactivate_all_mem_hooks();
+    abort_if_requested();
     //
     return rc;
 }
@@ -550,6 +1612,7 @@ MPI_Comm_split(
 ) {
     static mmcu_rt *rt = mmcu_rt::the_mmcu_rt();
     //
+    rt->set_mpi_call_id(MMCU_MPI_CALL_COMM_SPLIT);
     rt->activate_all_mem_hooks();
     int rc = PMPI_Comm_split(
         comm,
@@ -558,6 +1621,7 @@ MPI_Comm_split(
         newcomm
     );
     rt->deactivate_all_mem_hooks();
+    abort_if_requested();
     //
     return rc;
 }
@@ -571,11 +1635,14 @@ MPI_Comm_free(
 ) {
     static mmcu_rt *rt = mmcu_rt::the_mmcu_rt();
     //
+    forget_world_ranks(*comm);
+    rt->set_mpi_call_id(MMCU_MPI_CALL_COMM_FREE);
     rt->activate_all_mem_hooks();
     int rc = PMPI_Comm_free(
         comm
     );
     rt->deactivate_all_mem_hooks();
+    abort_if_requested();
     //
     return rc;
 }
@@ -590,16 +1657,38 @@ MPI_Abort(
 ) {
     static mmcu_rt *rt = mmcu_rt::the_mmcu_rt();
     //
+    rt->set_mpi_call_id(MMCU_MPI_CALL_ABORT);
     rt->activate_all_mem_hooks();
     int rc = PMPI_Abort(
         comm,
         errorcode
     );
     rt->deactivate_all_mem_hooks();
+    abort_if_requested();
     //
     return rc;
 }
 
+/**
+ * Call after a successful call that created the given derived datatype, given
+ * the mark taken before it.
+ */
+static void
+add_datatype(
+    mmcu_mem_stat_mgr *stat_mgr,
+    const mem_mark &mark,
+    MPI_Datatype datatype,
+    uint8_t mpi_call_id
+) {
+    const mem_mark delta = get_mem_mark_delta(stat_mgr, mark);
+    mmcu_mem_hooks_lock();
+    stat_mgr->add_datatype(
+        get_handle_key(datatype), mpi_call_id, delta.allocd_b,
+        ssize_t(delta.mpi_b)
+    );
+    mmcu_mem_hooks_unlock();
+}
+
 /**
  *
  */
@@ -608,12 +1697,24 @@ MPI_Type_commit(
     MPI_Datatype *type
 ) {
     static mmcu_rt *rt = mmcu_rt::the_mmcu_rt();
+    static auto *stat_mgr = mmcu_mem_stat_mgr::the_mmcu_mem_stat_mgr();
     //
+    const mem_mark mark = get_mem_mark(stat_mgr);
+    rt->set_mpi_call_id(MMCU_MPI_CALL_TYPE_COMMIT);
     rt->activate_all_mem_hooks();
     int rc = PMPI_Type_commit(
         type
     );
     rt->deactivate_all_mem_hooks();
+    abort_if_requested();
+    if (rc == MPI_SUCCESS) {
+        const mem_mark delta = get_mem_mark_delta(stat_mgr, mark);
+        mmcu_mem_hooks_lock();
+        stat_mgr->commit_datatype(
+            get_handle_key(*type), delta.allocd_b, ssize_t(delta.mpi_b)
+        );
+        mmcu_mem_hooks_unlock();
+    }
     //
     return rc;
 }
@@ -626,12 +1727,22 @@ MPI_Type_free(
     MPI_Datatype *type
 ) {
     static mmcu_rt *rt = mmcu_rt::the_mmcu_rt();
+    static auto *stat_mgr = mmcu_mem_stat_mgr::the_mmcu_mem_stat_mgr();
     //
+    const uint64_t key = get_handle_key(*type);
+    forget_type_size(*type);
+    rt->set_mpi_call_id(MMCU_MPI_CALL_TYPE_FREE);
     rt->activate_all_mem_hooks();
     int rc = PMPI_Type_free(
         type
     );
     rt->deactivate_all_mem_hooks();
+    abort_if_requested();
+    if (rc == MPI_SUCCESS) {
+        mmcu_mem_hooks_lock();
+        stat_mgr->free_datatype(key);
+        mmcu_mem_hooks_unlock();
+    }
     //
     return rc;
 }
@@ -646,7 +1757,10 @@ MPI_Type_contiguous(
     MPI_Datatype *newtype
 ) {
     static mmcu_rt *rt = mmcu_rt::the_mmcu_rt();
+    static auto *stat_mgr = mmcu_mem_stat_mgr::the_mmcu_mem_stat_mgr();
     //
+    const mem_mark mark = get_mem_mark(stat_mgr);
+    rt->set_mpi_call_id(MMCU_MPI_CALL_TYPE_CONTIGUOUS);
     rt->activate_all_mem_hooks();
     int rc = PMPI_Type_contiguous(
         count,
@@ -654,6 +1768,10 @@ MPI_Type_contiguous(
         newtype
     );
     rt->deactivate_all_mem_hooks();
+    abort_if_requested();
+    if (rc == MPI_SUCCESS) {
+        add_datatype(stat_mgr, mark, *newtype, MMCU_MPI_CALL_TYPE_CONTIGUOUS);
+    }
     //
     return rc;
 }
@@ -670,7 +1788,10 @@ MPI_Type_struct(
     MPI_Datatype *newtype
 ) {
     static mmcu_rt *rt = mmcu_rt::the_mmcu_rt();
+    static auto *stat_mgr = mmcu_mem_stat_mgr::the_mmcu_mem_stat_mgr();
     //
+    const mem_mark mark = get_mem_mark(stat_mgr);
+    rt->set_mpi_call_id(MMCU_MPI_CALL_TYPE_STRUCT);
     rt->activate_all_mem_hooks();
     int rc = PMPI_Type_struct(
         count,
@@ -680,6 +1801,10 @@ MPI_Type_struct(
         newtype
     );
     rt->deactivate_all_mem_hooks();
+    abort_if_requested();
+    if (rc == MPI_SUCCESS) {
+        add_datatype(stat_mgr, mark, *newtype, MMCU_MPI_CALL_TYPE_STRUCT);
+    }
     //
     return rc;
 }
@@ -696,7 +1821,10 @@ MPI_Type_vector(
     MPI_Datatype *newtype
 ) {
     static mmcu_rt *rt = mmcu_rt::the_mmcu_rt();
+    static auto *stat_mgr = mmcu_mem_stat_mgr::the_mmcu_mem_stat_mgr();
     //
+    const mem_mark mark = get_mem_mark(stat_mgr);
+    rt->set_mpi_call_id(MMCU_MPI_CALL_TYPE_VECTOR);
     rt->activate_all_mem_hooks();
     int rc = PMPI_Type_vector(
         count,
@@ -706,15 +1834,222 @@ MPI_Type_vector(
         newtype
     );
     rt->deactivate_all_mem_hooks();
+    abort_if_requested();
+    if (rc == MPI_SUCCESS) {
+        add_datatype(stat_mgr, mark, *newtype, MMCU_MPI_CALL_TYPE_VECTOR);
+    }
+    //
+    return rc;
+}
+
+/**
+ *
+ */
+int
+MPI_Type_create_struct(
+    int count,
+    const int array_of_blocklengths[],
+    const MPI_Aint array_of_displacements[],
+    const MPI_Datatype array_of_types[],
+    MPI_Datatype *newtype
+) {
+    static mmcu_rt *rt = mmcu_rt::the_mmcu_rt();
+    static auto *stat_mgr = mmcu_mem_stat_mgr::the_mmcu_mem_stat_mgr();
+    //
+    const mem_mark mark = get_mem_mark(stat_mgr);
+    rt->set_mpi_call_id(MMCU_MPI_CALL_TYPE_CREATE_STRUCT);
+    rt->activate_all_mem_hooks();
+    int rc = PMPI_Type_create_struct(
+        count,
+        array_of_blocklengths,
+        array_of_displacements,
+        array_of_types,
+        newtype
+    );
+    rt->deactivate_all_mem_hooks();
+    abort_if_requested();
+    if (rc == MPI_SUCCESS) {
+        add_datatype(
+            stat_mgr, mark, *newtype, MMCU_MPI_CALL_TYPE_CREATE_STRUCT
+        );
+    }
+    //
+    return rc;
+}
+
+/**
+ *
+ */
+int
+MPI_Type_dup(
+    MPI_Datatype oldtype,
+    MPI_Datatype *newtype
+) {
+    static mmcu_rt *rt = mmcu_rt::the_mmcu_rt();
+    static auto *stat_mgr = mmcu_mem_stat_mgr::the_mmcu_mem_stat_mgr();
+    //
+    const mem_mark mark = get_mem_mark(stat_mgr);
+    rt->set_mpi_call_id(MMCU_MPI_CALL_TYPE_DUP);
+    rt->activate_all_mem_hooks();
+    int rc = PMPI_Type_dup(
+        oldtype,
+        newtype
+    );
+    rt->deactivate_all_mem_hooks();
+    abort_if_requested();
+    if (rc == MPI_SUCCESS) {
+        add_datatype(stat_mgr, mark, *newtype, MMCU_MPI_CALL_TYPE_DUP);
+    }
     //
     return rc;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// Application API
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+/**
+ * Enters (name != nullptr) or exits an application phase. May be called while
+ * another thread is in MPI, so serialize with the hooks and leave their state
+ * as we found it. Ignored before MPI_Init, since there is nothing to attribute
+ * to the phase yet.
+ */
+static void
+change_phase(
+    const char *name,
+    bool pcontrol
+) {
+    static mmcu_rt *rt = mmcu_rt::the_mmcu_rt();
+    // Not created before MPI_Init, and creating it here would set up the
+    // tool too early.
+    auto *stat_mgr = mmcu_mem_stat_mgr::the_mmcu_mem_stat_mgr_if_created();
+    if (!stat_mgr) return;
+    //
+    mmcu_mem_hooks_lock();
+    const bool hooks_active = rt->mem_hooks_active();
+    rt->deactivate_all_mem_hooks();
+    if (name) stat_mgr->push_phase(name, pcontrol);
+    else stat_mgr->pop_phase(pcontrol);
+    if (hooks_active) rt->activate_all_mem_hooks();
+    mmcu_mem_hooks_unlock();
+}
+
+/**
+ *
+ */
+void
+mmcu_phase_push(
+    const char *name
+) {
+    if (!name) return;
+    change_phase(name, false);
+}
+
+/**
+ *
+ */
+void
+mmcu_phase_pop(void)
+{
+    change_phase(nullptr, false);
+}
+
+/**
+ *
+ */
+int
+mmcu_usage_get(
+    mmcu_usage_t *usage
+) {
+    // Not created before MPI_Init, and creating it here would take locks.
+    const auto *stat_mgr = mmcu_mem_stat_mgr::the_mmcu_mem_stat_mgr_if_created();
+    if (!usage || !stat_mgr) return -1;
+    stat_mgr->get_usage(usage);
+    return 0;
+}
+
+/**
+ *
+ */
+const char *
+mmcu_usage_mpi_call_name(
+    uint32_t i
+) {
+    if (i >= MMCU_MPI_CALL_LAST) return "Unknown";
+    return mmcu_mpi_call_name(uint8_t(i));
+}
+
+/**
+ * Level 0 pauses tracing and level 1 resumes it. Levels >= 2 enter the phase
+ * Pcontrol_<level>, replacing any phase entered this way, and negative levels
+ * exit it. The varargs are not inspected.
+ */
+int
+MPI_Pcontrol(
+    const int level,
+    ...
+) {
+    static mmcu_rt *rt = mmcu_rt::the_mmcu_rt();
+    //
+    if (level == 0 || level == 1) {
+        mmcu_mem_hooks_lock();
+        rt->set_tracing_paused(level == 0);
+        mmcu_mem_hooks_unlock();
+    }
+    else if (level > 1) {
+        const std::string name = "Pcontrol_" + std::to_string(level);
+        change_phase(name.c_str(), true);
+    }
+    else {
+        change_phase(nullptr, true);
+    }
+    //
+    return PMPI_Pcontrol(level);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 // Finalize
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
+/**
+ * Gives every rank the node-level view of the shared-memory segments mapped
+ * by the ranks on its node.
+ */
+static void
+exchange_shm_segments(
+    mmcu_mem_stat_mgr *stat_mgr
+) {
+    MPI_Comm node_comm;
+    PMPI_Comm_split_type(
+        MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &node_comm
+    );
+    int node_size = 0;
+    PMPI_Comm_size(node_comm, &node_size);
+    //
+    const std::string packed = stat_mgr->pack_shm_segments();
+    int len = int(packed.size());
+    std::vector<int> lens(node_size), displs(node_size);
+    PMPI_Allgather(&len, 1, MPI_INT, lens.data(), 1, MPI_INT, node_comm);
+    int total_len = 0;
+    for (int i = 0; i < node_size; ++i) {
+        displs[i] = total_len;
+        total_len += lens[i];
+    }
+    std::vector<char> node_packed(total_len + 1, '\0');
+    PMPI_Allgatherv(
+        packed.data(), len, MPI_CHAR,
+        node_packed.data(), lens.data(), displs.data(), MPI_CHAR,
+        node_comm
+    );
+    stat_mgr->set_node_shm_segments(
+        std::string(node_packed.data(), total_len)
+    );
+    //
+    PMPI_Comm_free(&node_comm);
+}
+
 /**
  *
  */
@@ -724,14 +2059,24 @@ MPI_Finalize(void)
     static mmcu_rt *rt = mmcu_rt::the_mmcu_rt();
     rt->deactivate_all_mem_hooks();
     static auto *stat_mgr = mmcu_mem_stat_mgr::the_mmcu_mem_stat_mgr();
+    // Requested snapshots are written below from here on.
+    stop_snapshot_poller();
     // Sync.
     PMPI_Barrier(MPI_COMM_WORLD);
     //
     static const bool force_sample = true;
     stat_mgr->update_mem_stats(force_sample);
+    abort_if_requested();
+    //
+    teardown_node_alerts(stat_mgr);
+    //
+    exchange_shm_segments(stat_mgr);
+    //
+    teardown_clock_sync(rt);
     // Sync.
     PMPI_Barrier(MPI_COMM_WORLD);
     stat_mgr->report(rt, true);
+    stat_mgr->close_telemetry();
     //
     return PMPI_Finalize();
 }
@@ -0,0 +1,168 @@
+/*
+ * Copyright (c)      2017 Los Alamos National Security, LLC.
+ *                         All rights reserved.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+
+/**
+ * An outstanding MPI request.
+ */
+struct mmcu_request_entry {
+    // Request handle, as an integer.
+    uint64_t key;
+    // When the request was created.
+    double created_at;
+    // MPI memory usage right after it was created.
+    int64_t mpi_b;
+    // MPI_COMM_WORLD rank of the peer, or -1.
+    int32_t peer;
+    //
+    int32_t tag;
+    // MPI call that created it.
+    uint8_t mpi_call_id;
+    // Whether the slot holds an entry.
+    bool used;
+};
+
+/**
+ * Open-addressed (linear probing) table of outstanding MPI requests, keyed by
+ * handle. Removal shifts entries back instead of leaving tombstones, so
+ * lookups stay short however many requests come and go. Not thread-safe.
+ */
+class mmcu_request_table {
+    // Smallest capacity. Always a power of two.
+    static constexpr size_t min_capacity = 64;
+    //
+    std::vector<mmcu_request_entry> slots;
+    //
+    size_t n_entries = 0;
+
+    /**
+     *
+     */
+    size_t
+    get_mask(void) const {
+        return slots.size() - 1;
+    }
+
+    /**
+     * Returns the home slot of the given key. Handles are often pointers, so
+     * mix the bits before taking the low ones.
+     */
+    size_t
+    get_home(
+        uint64_t key
+    ) const {
+        uint64_t h = key * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 32;
+        return size_t(h) & get_mask();
+    }
+
+    /**
+     * Returns the slot that holds the given key, or the empty slot where it
+     * would go.
+     */
+    size_t
+    find_slot(
+        uint64_t key
+    ) const {
+        size_t i = get_home(key);
+        while (slots[i].used && slots[i].key != key) {
+            i = (i + 1) & get_mask();
+        }
+        return i;
+    }
+
+    /**
+     *
+     */
+    void
+    grow(void) {
+        std::vector<mmcu_request_entry> old;
+        old.swap(slots);
+        const size_t capacity = old.empty() ? min_capacity : old.size() * 2;
+        slots.assign(capacity, mmcu_request_entry());
+        for (const auto &e : old) {
+            if (e.used) slots[find_slot(e.key)] = e;
+        }
+    }
+
+public:
+
+    /**
+     *
+     */
+    size_t
+    size(void) const {
+        return n_entries;
+    }
+
+    /**
+     * Adds the given entry, replacing any with the same key. Returns false if
+     * one was replaced.
+     */
+    bool
+    insert(
+        const mmcu_request_entry &entry
+    ) {
+        // Keep the load factor at most 1/2.
+        if (2 * (n_entries + 1) > slots.size()) grow();
+        //
+        const size_t i = find_slot(entry.key);
+        const bool is_new = !slots[i].used;
+        slots[i] = entry;
+        slots[i].used = true;
+        n_entries += is_new;
+        return is_new;
+    }
+
+    /**
+     * Removes the entry with the given key, copying it to the given one.
+     * Returns false if there was none.
+     */
+    bool
+    remove(
+        uint64_t key,
+        mmcu_request_entry &entry
+    ) {
+        if (n_entries == 0) return false;
+        //
+        size_t i = find_slot(key);
+        if (!slots[i].used) return false;
+        entry = slots[i];
+        n_entries--;
+        // Shift back the entries of the run after i that may live there.
+        size_t j = i;
+        for (;;) {
+            j = (j + 1) & get_mask();
+            if (!slots[j].used) break;
+            const size_t home = get_home(slots[j].key);
+            // Stays put if its home is cyclically in (i, j].
+            const bool stays = (i <= j) ? (i < home && home <= j)
+                                        : (i < home || home <= j);
+            if (stays) continue;
+            slots[i] = slots[j];
+            i = j;
+        }
+        slots[i].used = false;
+        return true;
+    }
+
+    /**
+     * Calls the given function for every entry, in no particular order.
+     */
+    template <typename F>
+    void
+    for_each(
+        F f
+    ) const {
+        for (const auto &e : slots) {
+            if (e.used) f(e);
+        }
+    }
+};
@@ -3,10 +3,12 @@
 
 #include <cstdio>
 #include <cstdlib>
+#include <algorithm>
 #include <ctime>
 
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
 
 /**
  *
@@ -16,6 +18,17 @@ mmcu_rt::mmcu_rt(void)
     deactivate_all_mem_hooks();
 }
 
+/**
+ * Reads settings from the environment. Not done at construction, since the
+ * runtime is first used from within malloc.
+ */
+void
+mmcu_rt::read_env_config(void)
+{
+    alloc_sample_interval = get_env_uint64("MMCU_SAMPLE_BYTES", 0);
+    alloc_headers = get_env_uint64("MMCU_ALLOC_HEADERS", 0) != 0;
+}
+
 /**
  *
  */
@@ -46,6 +59,8 @@ mmcu_rt::get_mem_hook_mgr(void)
 void
 mmcu_rt::activate_all_mem_hooks(void)
 {
+    // Paused with MPI_Pcontrol(0).
+    if (__atomic_load_n(&tracing_paused, __ATOMIC_RELAXED)) return;
     mmcu_mem_hook_mgr_activate_all(&mhmgr);
 }
 
@@ -58,6 +73,16 @@ mmcu_rt::deactivate_all_mem_hooks(void)
     mmcu_mem_hook_mgr_deactivate_all(&mhmgr);
 }
 
+/**
+ *
+ */
+bool
+mmcu_rt::mem_hooks_active(void)
+{
+    // They are all set together.
+    return mmcu_mem_hook_mgr_hook_active(&mhmgr, MMCU_HOOK_MALLOC);
+}
+
 /**
  *
  */
@@ -65,6 +90,8 @@ void
 mmcu_rt::set_init_begin_time_now(void)
 {
     init_begin_time = mmcu_time();
+    // Until rank 0's is known.
+    ref_init_begin_time = init_begin_time;
 }
 
 /**
@@ -76,6 +103,79 @@ mmcu_rt::set_init_end_time_now(void)
     init_end_time = mmcu_time();
 }
 
+/**
+ * Records an estimate of rank 0's clock minus this rank's, made at the given
+ * local time. The first sets the offset; later ones set the drift relative
+ * to it.
+ */
+void
+mmcu_rt::add_clock_sync(
+    double at,
+    double offset,
+    double offset_err
+) {
+    if (n_clock_syncs++ == 0 || at <= clock_sync_time) {
+        clock_offset = offset;
+        clock_offset_err = offset_err;
+        clock_sync_time = at;
+        return;
+    }
+    clock_drift = (offset - clock_offset) / (at - clock_sync_time);
+    clock_offset_err = std::max(clock_offset_err, offset_err);
+}
+
+/**
+ * Returns the value of the given environment variable as a double, or
+ * default_val if it is not set or invalid.
+ */
+double
+mmcu_rt::get_env_double(
+    const char *name,
+    double default_val
+) {
+    const char *val_str = getenv(name);
+    if (!val_str) return default_val;
+    //
+    char *endp = nullptr;
+    errno = 0;
+    const double val = strtod(val_str, &endp);
+    if (errno != 0 || endp == val_str || val < 0.0) {
+        fprintf(
+            stderr,
+            "(pid: %d) WARNING: ignoring invalid %s value (%s)\n",
+            (int)getpid(), name, val_str
+        );
+        return default_val;
+    }
+    return val;
+}
+
+/**
+ * Returns the value of the given environment variable as an unsigned integer,
+ * or default_val if it is not set or invalid.
+ */
+uint64_t
+mmcu_rt::get_env_uint64(
+    const char *name,
+    uint64_t default_val
+) {
+    const char *val_str = getenv(name);
+    if (!val_str) return default_val;
+    //
+    char *endp = nullptr;
+    errno = 0;
+    const uint64_t val = strtoull(val_str, &endp, 0);
+    if (errno != 0 || endp == val_str || val_str[0] == '-') {
+        fprintf(
+            stderr,
+            "(pid: %d) WARNING: ignoring invalid %s value (%s)\n",
+            (int)getpid(), name, val_str
+        );
+        return default_val;
+    }
+    return val;
+}
+
 /**
  *
  */
@@ -1,9 +1,11 @@
 #pragma once
 
 #include "mpimcu-mem-hook-state.h"
+#include "mpimcu-mpi-call.h"
 
 #ifdef __cplusplus
 #include <string>
+#include <cstdint>
 #include <limits.h>
 
 class mmcu_rt {
@@ -26,6 +28,28 @@ private:
     char hostname[256];
     //
     char app_comm[PATH_MAX];
+    // The MPI call whose memory operations are being captured.
+    uint8_t mpi_call_id = MMCU_MPI_CALL_NONE;
+    // Mean number of bytes between sampled allocations (MMCU_SAMPLE_BYTES).
+    // 0 records every allocation.
+    uint64_t alloc_sample_interval = 0;
+    // Whether or not traced allocations carry a header (MMCU_ALLOC_HEADERS).
+    bool alloc_headers = false;
+    // While set, memory hooks stay inactive (MPI_Pcontrol).
+    bool tracing_paused = false;
+    // Rank 0's clock minus this rank's at clock_sync_time (local clock).
+    double clock_offset = 0.0;
+    // Change in clock_offset per second.
+    double clock_drift = 0.0;
+    //
+    double clock_sync_time = 0.0;
+    // Bound on the error of clock_offset: half the best round-trip time.
+    double clock_offset_err = 0.0;
+    // Number of offset estimates made.
+    int n_clock_syncs = 0;
+    // Rank 0's MPI_Init entry time, on rank 0's clock. Report timelines
+    // start there.
+    double ref_init_begin_time = 0.0;
     //
     void
     set_hostname(void);
@@ -50,12 +74,56 @@ public:
     void
     deactivate_all_mem_hooks(void);
     //
+    bool
+    mem_hooks_active(void);
+    //
+    void
+    read_env_config(void);
+    //
     void
     set_init_begin_time_now(void);
     //
     void
     set_init_end_time_now(void);
     //
+    void
+    add_clock_sync(
+        double at,
+        double offset,
+        double offset_err
+    );
+    //
+    void
+    set_ref_init_begin_time(double t) {
+        ref_init_begin_time = t;
+    }
+    // Maps a time on this rank's clock to one on rank 0's.
+    double
+    get_ref_time(double t) {
+        return t + clock_offset + clock_drift * (t - clock_sync_time);
+    }
+    // Time since rank 0 entered MPI_Init, so that timelines of ranks on
+    // different nodes line up.
+    double
+    get_report_time(double t) {
+        return get_ref_time(t) - ref_init_begin_time;
+    }
+    //
+    double
+    get_clock_offset(void) {
+        return clock_offset;
+    }
+    //
+    double
+    get_clock_drift(void) {
+        return clock_drift;
+    }
+    //
+    double
+    get_clock_offset_err(void) {
+        return clock_offset_err;
+    }
+    //
     std::string
     get_date_time_str_now(void);
     //
@@ -68,6 +136,45 @@ public:
     void
     gather_target_meta(void);
     //
+    static double
+    get_env_double(
+        const char *name,
+        double default_val
+    );
+    //
+    static uint64_t
+    get_env_uint64(
+        const char *name,
+        uint64_t default_val
+    );
+    //
+    void
+    set_mpi_call_id(uint8_t call_id) {
+        mpi_call_id = call_id;
+    }
+    //
+    uint8_t
+    get_mpi_call_id(void) {
+        return mpi_call_id;
+    }
+    //
+    uint64_t
+    get_alloc_sample_interval(void) {
+        return alloc_sample_interval;
+    }
+    //
+    bool
+    get_alloc_headers(void) {
+        return alloc_headers;
+    }
+    // Pausing also turns off hooks activated by calls in progress on other
+    // threads. Call with the hooks lock held.
+    void
+    set_tracing_paused(bool paused) {
+        __atomic_store_n(&tracing_paused, paused, __ATOMIC_RELAXED);
+        if (paused) deactivate_all_mem_hooks();
+    }
+    //
     double
     get_init_begin_time(void) {
         return init_begin_time;
@@ -0,0 +1,107 @@
+/*
+ * Copyright (c)      2017 Los Alamos National Security, LLC.
+ *                         All rights reserved.
+ */
+
+/*
+ * Single-writer sequence lock over blocks of 64-bit words. Readers never
+ * block the writer and never write shared memory, so they may live in other
+ * processes (e.g., through a shared mapping). Readers are not wait-free: they
+ * retry while an update is in flight.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Starts an update of the block guarded by seq. Until the matching
+ * mmcu_seqlock_write_end(), stores to the block must be atomic.
+ */
+static inline void
+mmcu_seqlock_write_begin(
+    uint64_t *seq
+) {
+    // Odd while an update is in flight.
+    __atomic_store_n(seq, __atomic_load_n(seq, __ATOMIC_RELAXED) + 1,
+                     __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/**
+ *
+ */
+static inline void
+mmcu_seqlock_write_end(
+    uint64_t *seq
+) {
+    __atomic_store_n(seq, __atomic_load_n(seq, __ATOMIC_RELAXED) + 1,
+                     __ATOMIC_RELEASE);
+}
+
+/**
+ * Stores a word of the block being updated.
+ */
+static inline void
+mmcu_seqlock_store(
+    void *word,
+    uint64_t val
+) {
+    __atomic_store_n((uint64_t *)word, val, __ATOMIC_RELAXED);
+}
+
+/**
+ * Like mmcu_seqlock_read(), but gives up after max_tries attempts. Returns 0
+ * and sets *seq_out (if not NULL) to the sequence number of the copy, or -1 if
+ * no attempt saw a consistent view. For readers in other processes, whose
+ * writer may die mid-update and leave seq odd forever.
+ */
+static inline int
+mmcu_seqlock_try_read(
+    const uint64_t *seq,
+    uint64_t *dst,
+    const uint64_t *src,
+    size_t nwords,
+    uint64_t max_tries,
+    uint64_t *seq_out
+) {
+    for (uint64_t t = 0; t < max_tries; ++t) {
+        const uint64_t s = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+        if (s & 1) continue;
+        for (size_t i = 0; i < nwords; ++i) {
+            dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(seq, __ATOMIC_RELAXED) != s) continue;
+        if (seq_out) *seq_out = s;
+        return 0;
+    }
+    return -1;
+}
+
+/**
+ * Copies a consistent view of the block guarded by seq to dst. Returns the
+ * sequence number of the copy. Retries for as long as an update is in flight,
+ * so only for readers in the writer's process.
+ */
+static inline uint64_t
+mmcu_seqlock_read(
+    const uint64_t *seq,
+    uint64_t *dst,
+    const uint64_t *src,
+    size_t nwords
+) {
+    uint64_t s = 0;
+    while (0 != mmcu_seqlock_try_read(seq, dst, src, nwords, UINT64_MAX, &s)) {
+    }
+    return s;
+}
+
+#ifdef __cplusplus
+}
+#endif
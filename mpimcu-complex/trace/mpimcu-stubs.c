@@ -0,0 +1,55 @@
+/*
+ * Copyright (c)      2017 Los Alamos National Security, LLC.
+ *                         All rights reserved.
+ */
+
+/*
+ * Do-nothing versions of the API in mpimcu.h for applications that run with
+ * and without the tool. mpimcu-trace.so is preloaded, so its definitions are
+ * found first when it is in use. Weak, so they also yield to the real ones if
+ * both end up in the same link.
+ */
+
+#include "mpimcu.h"
+
+#include <stddef.h>
+
+/**
+ *
+ */
+__attribute__((weak)) void
+mmcu_phase_push(
+    const char *name
+) {
+    (void)name;
+}
+
+/**
+ *
+ */
+__attribute__((weak)) void
+mmcu_phase_pop(void)
+{
+}
+
+/**
+ *
+ */
+__attribute__((weak)) int
+mmcu_usage_get(
+    mmcu_usage_t *usage
+) {
+    (void)usage;
+    return -1;
+}
+
+/**
+ *
+ */
+__attribute__((weak)) const char *
+mmcu_usage_mpi_call_name(
+    uint32_t i
+) {
+    (void)i;
+    return "Unknown";
+}
@@ -0,0 +1,149 @@
+/*
+ * Copyright (c)      2017 Los Alamos National Security, LLC.
+ *                         All rights reserved.
+ */
+
+/*
+ * Layout of the live telemetry page each rank maps under /dev/shm when
+ * MMCU_TELEMETRY is set. Readers (e.g., mpimcu-monitor) need nothing but this
+ * header: no MPI and no help from the application.
+ */
+
+#pragma once
+
+#include "mpimcu.h"
+#include "mpimcu-seqlock.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* First word of every page. */
+#define MMCU_TELEMETRY_MAGIC 0x6d6d6375746c6d79ULL
+/* Bumped when the layout below changes. */
+#define MMCU_TELEMETRY_VERSION 1
+/* Pages are named MMCU_TELEMETRY_PREFIX<pid>. */
+#define MMCU_TELEMETRY_PREFIX "mpimcu-telemetry."
+/* Capacity of the ring of recent samples. */
+#define MMCU_TELEMETRY_N_SAMPLES 256
+/* Capacity of string fields, including the terminator. */
+#define MMCU_TELEMETRY_NAME_LEN 64
+/* Attempts mmcu_telemetry_try_read() makes before giving up. An update takes
+ * a few dozen stores, so this only runs out if the writer is descheduled or
+ * died mid-update. */
+#define MMCU_TELEMETRY_READ_TRIES 100000
+
+/* Values of mmcu_telemetry_page_t::state. */
+enum {
+    MMCU_TELEMETRY_STATE_RUNNING = 1,
+    MMCU_TELEMETRY_STATE_FINALIZED = 2
+};
+
+/*
+ * Usage with the sequence number that guards it.
+ */
+typedef struct mmcu_usage_block_t {
+    uint64_t seq;
+    mmcu_usage_t usage;
+} mmcu_usage_block_t;
+
+/*
+ * One whole-process sample.
+ */
+typedef struct mmcu_telemetry_sample_t {
+    /* Seconds since MPI_Init was entered. */
+    double time;
+    /* Memory held by MPI (heap and mmap). */
+    int64_t mpi_b;
+    /* Whole-process PSS. */
+    int64_t pss_b;
+    /* Index of the innermost application phase. */
+    uint64_t phase;
+} mmcu_telemetry_sample_t;
+
+/*
+ * Everything guarded by mmcu_telemetry_page_t::seq, other than the usage.
+ */
+typedef struct mmcu_telemetry_live_t {
+    /* See MMCU_TELEMETRY_STATE_*. */
+    uint64_t state;
+    /* Number of samples taken so far. The latest is at index
+     * (n_samples - 1) % MMCU_TELEMETRY_N_SAMPLES. */
+    uint64_t n_samples;
+    /* Name of the innermost application phase. */
+    char phase_name[MMCU_TELEMETRY_NAME_LEN];
+    /* Ring of the most recent samples. */
+    mmcu_telemetry_sample_t samples[MMCU_TELEMETRY_N_SAMPLES];
+} mmcu_telemetry_live_t;
+
+/*
+ * The page. Fields before usage_block are set before the page becomes
+ * visible and never change afterwards.
+ */
+typedef struct mmcu_telemetry_page_t {
+    /* MMCU_TELEMETRY_MAGIC. */
+    uint64_t magic;
+    /* MMCU_TELEMETRY_VERSION. */
+    uint32_t version;
+    /* sizeof(mmcu_telemetry_page_t). */
+    uint32_t size;
+    /* Of the publishing process. */
+    int32_t pid;
+    /* In MPI_COMM_WORLD. */
+    int32_t rank;
+    /* Size of MPI_COMM_WORLD. */
+    int32_t numpe;
+    /* Keeps what follows 64-bit aligned. */
+    int32_t reserved;
+    /* Seconds since the Epoch at which MPI_Init was entered. */
+    double init_wall_time;
+    /* Monotonic clock (see mmcu_time) at which MPI_Init was entered, so
+     * samples of ranks on the same node can be lined up. */
+    double init_mono_time;
+    /* Application name. */
+    char app_name[MMCU_TELEMETRY_NAME_LEN];
+    /* Latest published usage. Its sequence number also guards live. */
+    mmcu_usage_block_t usage_block;
+    /* Everything else that changes. */
+    mmcu_telemetry_live_t live;
+} mmcu_telemetry_page_t;
+
+/**
+ * Copies a consistent view of the changing parts of the given page. Returns 0
+ * on success, or -1 if none was seen within MMCU_TELEMETRY_READ_TRIES
+ * attempts, in which case usage and live are left unchanged.
+ */
+static inline int
+mmcu_telemetry_try_read(
+    const mmcu_telemetry_page_t *page,
+    mmcu_usage_t *usage,
+    mmcu_telemetry_live_t *live
+) {
+    /* Both are covered by one sequence number, so read them in one go. */
+    typedef struct {
+        mmcu_usage_t usage;
+        mmcu_telemetry_live_t live;
+    } both_t;
+    both_t both;
+    if (0 != mmcu_seqlock_try_read(
+                 &page->usage_block.seq,
+                 (uint64_t *)&both,
+                 (const uint64_t *)&page->usage_block.usage,
+                 sizeof(both) / 8,
+                 MMCU_TELEMETRY_READ_TRIES,
+                 NULL
+             )) {
+        return -1;
+    }
+    memcpy(usage, &both.usage, sizeof(*usage));
+    memcpy(live, &both.live, sizeof(*live));
+    return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
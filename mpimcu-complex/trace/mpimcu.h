@@ -0,0 +1,118 @@
+/*
+ * Copyright (c)      2017 Los Alamos National Security, LLC.
+ *                         All rights reserved.
+ */
+
+/*
+ * Application-facing API of mpimcu-trace.so. Link against libmpimcu-stubs.so
+ * so that applications also run without the tool: when mpimcu-trace.so is
+ * preloaded, its definitions take precedence over the stubs.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Enters the application phase with the given name. Memory usage high
+ * watermarks, allocation counts, and time spent are reported per phase.
+ * Phases nest, and entries of phases with the same name are combined.
+ * Ignored before MPI_Init.
+ */
+void
+mmcu_phase_push(
+    const char *name
+);
+
+/**
+ * Exits the phase entered by the last unmatched mmcu_phase_push().
+ */
+void
+mmcu_phase_pop(void);
+
+/* Bumped when the layout of mmcu_usage_t changes. */
+#define MMCU_USAGE_VERSION 1
+/* Capacity of mmcu_usage_t::mpi_call_b. */
+#define MMCU_USAGE_MAX_MPI_CALLS 64
+
+/*
+ * MPI memory usage as of the latest captured memory operation. All sizes are
+ * in bytes, and estimated when allocation sampling is enabled.
+ */
+typedef struct mmcu_usage_t {
+    /* MMCU_USAGE_VERSION of the tool that filled this in. */
+    uint32_t version;
+    /* Number of valid entries in mpi_call_b. */
+    uint32_t n_mpi_calls;
+    /* Seconds since MPI_Init was entered. */
+    double time;
+    /* Memory currently held by MPI (heap and mmap). */
+    int64_t mpi_b;
+    /* High watermark of mpi_b. */
+    int64_t mpi_high_b;
+    /* Whole-process PSS at the latest sample. */
+    int64_t pss_b;
+    /* High watermark of pss_b. */
+    int64_t pss_high_b;
+    /* MPI heap allocations and frees so far. mmap and munmap are not
+     * counted. */
+    int64_t n_allocs;
+    int64_t n_frees;
+    /* Live MPI heap bytes by the MPI call that allocated them. See
+     * mmcu_usage_mpi_call_name(). */
+    int64_t mpi_call_b[MMCU_USAGE_MAX_MPI_CALLS];
+} mmcu_usage_t;
+
+/**
+ * Fills in the current MPI memory usage. Doesn't take the tool's locks or slow
+ * it down, so it is cheap enough to call often. It only retries while an
+ * update is being published, which takes a few stores. Returns 0 on success,
+ * or -1 if the tool isn't loaded or MPI_Init hasn't been called yet.
+ */
+int
+mmcu_usage_get(
+    mmcu_usage_t *usage
+);
+
+/**
+ * Returns the name of the MPI call behind mmcu_usage_t::mpi_call_b[i].
+ */
+const char *
+mmcu_usage_mpi_call_name(
+    uint32_t i
+);
+
+/**
+ * Sets diff to the change from snapshot earlier to snapshot later. diff may
+ * alias either one.
+ */
+static inline void
+mmcu_usage_diff(
+    const mmcu_usage_t *later,
+    const mmcu_usage_t *earlier,
+    mmcu_usage_t *diff
+) {
+    uint32_t i;
+    const uint32_t n = later->n_mpi_calls < earlier->n_mpi_calls ?
+                       later->n_mpi_calls : earlier->n_mpi_calls;
+    diff->version = later->version;
+    diff->n_mpi_calls = n;
+    diff->time = later->time - earlier->time;
+    diff->mpi_b = later->mpi_b - earlier->mpi_b;
+    diff->mpi_high_b = later->mpi_high_b - earlier->mpi_high_b;
+    diff->pss_b = later->pss_b - earlier->pss_b;
+    diff->pss_high_b = later->pss_high_b - earlier->pss_high_b;
+    diff->n_allocs = later->n_allocs - earlier->n_allocs;
+    diff->n_frees = later->n_frees - earlier->n_frees;
+    for (i = 0; i < n; ++i) {
+        diff->mpi_call_b[i] = later->mpi_call_b[i] - earlier->mpi_call_b[i];
+    }
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,401 @@
+/*
+ * Copyright (c)      2017 Los Alamos National Security, LLC.
+ *                         All rights reserved.
+ */
+
+/*
+ * Attaches to the live telemetry pages (MMCU_TELEMETRY) of all the ranks on
+ * this node and prints a node-level view of their memory usage. Needs no MPI
+ * and no help from the application.
+ */
+
+#include "mpimcu-telemetry.h"
+#include "mpimcu-mpi-call.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace {
+
+/**
+ * A mapped telemetry page.
+ */
+struct page_attachment {
+    const mmcu_telemetry_page_t *page = nullptr;
+    // Number of the page's samples already streamed.
+    uint64_t n_samples_seen = 0;
+    // mpi_b at the previous refresh.
+    int64_t prev_mpi_b = 0;
+    //
+    bool seen_before = false;
+    // Latest consistent view of the page, all zeros until there is one.
+    mmcu_usage_t usage = mmcu_usage_t();
+    //
+    mmcu_telemetry_live_t live = mmcu_telemetry_live_t();
+};
+
+/**
+ * A consistent view of one page.
+ */
+struct page_view {
+    const mmcu_telemetry_page_t *page;
+    page_attachment *pa;
+    mmcu_usage_t usage;
+    mmcu_telemetry_live_t live;
+    bool alive;
+    // Whether or not the page was mid-update for the whole read, so the
+    // previous view is shown.
+    bool stale;
+};
+
+/**
+ *
+ */
+double
+tomb(int64_t b)
+{
+    return double(b) / 1024.0 / 1024.0;
+}
+
+/**
+ *
+ */
+double
+wall_time_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return double(ts.tv_sec) + double(ts.tv_nsec) / 1e9;
+}
+
+/**
+ * Maps the given page read-only. Returns nullptr if it isn't a complete page
+ * of a layout we understand.
+ */
+const mmcu_telemetry_page_t *
+attach(
+    const std::string &path
+) {
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) return nullptr;
+    //
+    const size_t size = sizeof(mmcu_telemetry_page_t);
+    struct stat sb;
+    void *addr = MAP_FAILED;
+    if (fstat(fd, &sb) == 0 && size_t(sb.st_size) >= size) {
+        addr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (addr == MAP_FAILED) return nullptr;
+    //
+    const mmcu_telemetry_page_t *page =
+        static_cast<const mmcu_telemetry_page_t *>(addr);
+    if (page->magic != MMCU_TELEMETRY_MAGIC ||
+        page->version != MMCU_TELEMETRY_VERSION ||
+        page->size != size) {
+        munmap(addr, size);
+        return nullptr;
+    }
+    return page;
+}
+
+/**
+ *
+ */
+void
+detach(
+    const mmcu_telemetry_page_t *page
+) {
+    munmap(const_cast<mmcu_telemetry_page_t *>(page), sizeof(*page));
+}
+
+/**
+ * Brings the given attachments in line with the pages currently in dir.
+ */
+void
+rescan(
+    const std::string &dir,
+    std::map<std::string, page_attachment> &attached
+) {
+    std::map<std::string, page_attachment> current;
+    DIR *d = opendir(dir.c_str());
+    if (!d) {
+        fprintf(
+            stderr, "cannot open %s: %s\n", dir.c_str(), strerror(errno)
+        );
+        exit(EXIT_FAILURE);
+    }
+    static const std::string prefix = MMCU_TELEMETRY_PREFIX;
+    while (struct dirent *ent = readdir(d)) {
+        const std::string name = ent->d_name;
+        if (name.compare(0, prefix.size(), prefix) != 0) continue;
+        // Still being set up.
+        if (name.find(".tmp") != std::string::npos) continue;
+        //
+        const std::string path = dir + "/" + name;
+        auto got = attached.find(path);
+        if (got != attached.end()) {
+            current[path] = got->second;
+            attached.erase(got);
+            continue;
+        }
+        page_attachment pa;
+        pa.page = attach(path);
+        if (pa.page) current[path] = pa;
+    }
+    closedir(d);
+    // What's left is gone.
+    for (const auto &pa : attached) {
+        detach(pa.second.page);
+    }
+    attached.swap(current);
+}
+
+/**
+ * Returns the MPI call holding the most live heap memory.
+ */
+uint32_t
+top_mpi_call(
+    const mmcu_usage_t &usage
+) {
+    uint32_t top = 0;
+    const uint32_t n = std::min<uint32_t>(
+        usage.n_mpi_calls, MMCU_USAGE_MAX_MPI_CALLS
+    );
+    for (uint32_t i = 1; i < n; ++i) {
+        if (usage.mpi_call_b[i] > usage.mpi_call_b[top]) top = i;
+    }
+    return top;
+}
+
+/**
+ *
+ */
+void
+print_table(
+    double now,
+    const std::vector<page_view> &views
+) {
+    char tbuf[64];
+    const time_t secs = time_t(now);
+    strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S", localtime(&secs));
+    //
+    printf("# %s: %zu rank(s)\n", tbuf, views.size());
+    printf(
+        "%6s %8s %-9s %10s %10s %10s %10s %10s %10s %10s  %-16s %s\n",
+        "Rank", "PID", "State", "Time_s", "MPI_MB", "MPI_dMB", "MPI_Hi_MB",
+        "PSS_MB", "PSS_Hi_MB", "Allocs", "Phase", "Top_MPI_Call"
+    );
+    int64_t node_mpi_b = 0, node_mpi_high_b = 0, node_pss_b = 0;
+    for (const auto &v : views) {
+        const mmcu_telemetry_page_t *page = v.page;
+        page_attachment *pa = v.pa;
+        const int64_t delta_b =
+            pa->seen_before ? v.usage.mpi_b - pa->prev_mpi_b : 0;
+        pa->prev_mpi_b = v.usage.mpi_b;
+        pa->seen_before = true;
+        //
+        const char *state =
+            !v.alive ? "exited" :
+            v.stale ? "stale" :
+            v.live.state == MMCU_TELEMETRY_STATE_FINALIZED ? "finalized" :
+            "running";
+        const uint32_t top = top_mpi_call(v.usage);
+        char top_buf[96];
+        snprintf(
+            top_buf, sizeof(top_buf), "%s (%.3lf MB)",
+            mmcu_mpi_call_name(uint8_t(top)),
+            tomb(v.usage.mpi_call_b[top])
+        );
+        char phase[MMCU_TELEMETRY_NAME_LEN];
+        memcpy(phase, v.live.phase_name, sizeof(phase));
+        phase[sizeof(phase) - 1] = '\0';
+        //
+        printf(
+            "%6d %8d %-9s %10.2lf %10.3lf %10.3lf %10.3lf %10.3lf %10.3lf "
+            "%10" PRId64 "  %-16s %s\n",
+            page->rank, page->pid, state, v.usage.time,
+            tomb(v.usage.mpi_b), tomb(delta_b), tomb(v.usage.mpi_high_b),
+            tomb(v.usage.pss_b), tomb(v.usage.pss_high_b),
+            v.usage.n_allocs, phase, top_buf
+        );
+        node_mpi_b += v.usage.mpi_b;
+        node_mpi_high_b += v.usage.mpi_high_b;
+        node_pss_b += v.usage.pss_b;
+    }
+    // Per-rank highs may not coincide, so their sum bounds the node's.
+    printf(
+        "# Node: MPI %.3lf MB (sum of highs: %.3lf MB), PSS %.3lf MB\n\n",
+        tomb(node_mpi_b), tomb(node_mpi_high_b), tomb(node_pss_b)
+    );
+}
+
+/**
+ * Prints one line per rank, and any samples taken since the last refresh.
+ */
+void
+print_stream(
+    double now,
+    const std::vector<page_view> &views
+) {
+    int64_t node_mpi_b = 0, node_pss_b = 0;
+    for (const auto &v : views) {
+        const mmcu_telemetry_page_t *page = v.page;
+        page_attachment *pa = v.pa;
+        printf(
+            "RANK %lf %d %d %d %lf %" PRId64 " %" PRId64 " %" PRId64
+            " %" PRId64 " %" PRId64 " %" PRId64 "\n",
+            now, page->rank, page->pid,
+            !v.alive ? 0 : v.stale ? -1 : int(v.live.state),
+            v.usage.time, v.usage.mpi_b, v.usage.mpi_high_b, v.usage.pss_b,
+            v.usage.pss_high_b, v.usage.n_allocs, v.usage.n_frees
+        );
+        // Samples that were overwritten before we got to them are lost.
+        const uint64_t n = v.live.n_samples;
+        uint64_t first = pa->n_samples_seen;
+        if (n - first > MMCU_TELEMETRY_N_SAMPLES) {
+            first = n - MMCU_TELEMETRY_N_SAMPLES;
+        }
+        for (uint64_t i = first; i < n; ++i) {
+            const mmcu_telemetry_sample_t &smp =
+                v.live.samples[i % MMCU_TELEMETRY_N_SAMPLES];
+            printf(
+                "SAMPLE %d %lf %" PRId64 " %" PRId64 " %" PRIu64 "\n",
+                page->rank, smp.time, smp.mpi_b, smp.pss_b, smp.phase
+            );
+        }
+        pa->n_samples_seen = n;
+        node_mpi_b += v.usage.mpi_b;
+        node_pss_b += v.usage.pss_b;
+    }
+    printf(
+        "NODE %lf %zu %" PRId64 " %" PRId64 "\n",
+        now, views.size(), node_mpi_b, node_pss_b
+    );
+}
+
+/**
+ *
+ */
+void
+usage(
+    const char *argv0
+) {
+    fprintf(
+        stderr,
+        "usage: %s [-d dir] [-i interval_s] [-n count] [-s]\n"
+        "  -d  where the pages are (default: $MMCU_TELEMETRY_PATH or "
+        "/dev/shm)\n"
+        "  -i  seconds between refreshes (default: 1)\n"
+        "  -n  number of refreshes, 0 for no limit (default: 0)\n"
+        "  -s  stream machine-readable lines, including every new sample\n"
+        "# Stream fields:\n"
+        "# RANK Wall_Time Rank PID State Time_s MPI_B MPI_High_B PSS_B "
+        "PSS_High_B Allocations Frees\n"
+        "#   State: 0 exited, 1 running, 2 finalized, -1 stale (the page "
+        "stayed\n"
+        "#   mid-update for the whole read, so the previous values are "
+        "shown)\n"
+        "# SAMPLE Rank Time_s MPI_B PSS_B Phase\n"
+        "# NODE Wall_Time Ranks MPI_B PSS_B\n",
+        argv0
+    );
+}
+
+} // namespace
+
+/**
+ *
+ */
+int
+main(
+    int argc,
+    char **argv
+) {
+    const char *env_dir = getenv("MMCU_TELEMETRY_PATH");
+    std::string dir = env_dir ? env_dir : "/dev/shm";
+    double interval = 1.0;
+    long count = 0;
+    bool stream = false;
+    //
+    int opt;
+    while ((opt = getopt(argc, argv, "d:i:n:sh")) != -1) {
+        switch (opt) {
+            case 'd':
+                dir = optarg;
+                break;
+            case 'i':
+                interval = strtod(optarg, nullptr);
+                break;
+            case 'n':
+                count = strtol(optarg, nullptr, 10);
+                break;
+            case 's':
+                stream = true;
+                break;
+            default:
+                usage(argv[0]);
+                return (opt == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (interval <= 0.0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    //
+    std::map<std::string, page_attachment> attached;
+    for (long i = 0; count == 0 || i < count; ++i) {
+        if (i != 0) {
+            struct timespec ts;
+            ts.tv_sec = time_t(interval);
+            ts.tv_nsec = long((interval - double(ts.tv_sec)) * 1e9);
+            nanosleep(&ts, nullptr);
+        }
+        rescan(dir, attached);
+        //
+        std::vector<page_view> views;
+        for (auto &pa : attached) {
+            page_view v;
+            v.page = pa.second.page;
+            v.pa = &pa.second;
+            // Pages of processes that died without finalizing stay around.
+            v.alive = kill(v.page->pid, 0) == 0 || errno != ESRCH;
+            // A rank killed mid-update leaves its page inconsistent for good,
+            // so don't wait for it. Show the last consistent view instead.
+            v.stale = 0 != mmcu_telemetry_try_read(
+                               v.page, &pa.second.usage, &pa.second.live
+                           );
+            v.usage = pa.second.usage;
+            v.live = pa.second.live;
+            views.push_back(v);
+        }
+        std::sort(
+            views.begin(), views.end(),
+            [](const page_view &a, const page_view &b) {
+                return a.page->rank < b.page->rank;
+            }
+        );
+        //
+        const double now = wall_time_now();
+        if (stream) print_stream(now, views);
+        else print_table(now, views);
+        fflush(stdout);
+    }
+    //
+    return EXIT_SUCCESS;
+}